@@ -0,0 +1,90 @@
+#!/bin/sh
+
+set -eu
+
+: ${BRILLO_BIN:=./brillo}
+: ${BRILLO_BENCH_LEDS:=120}
+: ${BRILLO_BENCH_FRAMES:=1000}
+: ${BRILLO_BENCH_SIM:=lat=20}
+
+_frames() {
+	awk -v leds="$1" -v frames="$2" 'BEGIN {
+		for (f = 0; f < frames; f++) {
+			for (i = 0; i < leds; i++)
+				printf "sim%d,%d,%d,%d,255\n", i,
+					(i * 7 + f) % 256, (i * 3 + f * 2) % 256, (f * 5) % 256
+			printf "\n"
+		}
+	}'
+}
+
+_bench() {
+	local id="$1"
+
+	shift
+
+	printf '%s: ' "${id}"
+	"$BRILLO_BIN" -B "sim:n=${BRILLO_BENCH_LEDS},max=255,cache=${dir}/cache,${BRILLO_BENCH_SIM}" \
+		-k -v 6 "$@" 2>&1 | sed -n 's/^Informational: //p'
+}
+
+# the simulated controllers are kept out of the cache of the user
+tmp="$(mktemp)"
+dir="$(mktemp -d)"
+trap 'rm -f "${tmp}"; rm -rf "${dir}"' EXIT
+mkdir "${dir}/cache"
+
+_frames "${BRILLO_BENCH_LEDS}" "${BRILLO_BENCH_FRAMES}" > "${tmp}"
+
+_bench "frames" -f "${tmp}"
+_bench "frames scaled" -g 50 -f "${tmp}"
+
+: ${BRILLO_BENCH_ADAPT:=3840x2160}
+: ${BRILLO_BENCH_CTRLS:=500}
+: ${BRILLO_BENCH_RUNS:=20}
+
+_tree() {
+	local i=0
+
+	while [ "${i}" -lt "${BRILLO_BENCH_CTRLS}" ]; do
+		mkdir -p "$1/sys/leds/led${i}"
+		echo "$(( i % 256 ))" > "$1/sys/leds/led${i}/brightness"
+		echo 255 > "$1/sys/leds/led${i}/max_brightness"
+		i=$(( i + 1 ))
+	done
+	mkdir -p "$1/cache"
+}
+
+_bench_io() {
+	local id="$1" io start end i
+
+	shift
+
+	for io in sync uring; do
+		i=0
+		start="$(date +%s%N)"
+		while [ "${i}" -lt "${BRILLO_BENCH_RUNS}" ]; do
+			"$BRILLO_BIN" -B "sysfs:root=${dir}/sys,cache=${dir}/cache,io=${io}" \
+				-k "$@" > /dev/null
+			i=$(( i + 1 ))
+		done
+		end="$(date +%s%N)"
+		printf '%s (%s): %s us per run\n' "${id}" "${io}" \
+			"$(( (end - start) / 1000 / BRILLO_BENCH_RUNS ))"
+	done
+}
+
+# the picture level, of an optimized build such as with CFLAGS=-O2
+w="${BRILLO_BENCH_ADAPT%x*}"
+h="${BRILLO_BENCH_ADAPT#*x}"
+head -c "$(( w * h * 4 * 4 ))" /dev/urandom > "${dir}/adapt.raw"
+printf 'adapt: '
+"$BRILLO_BIN" -B "sim:clock=virtual,cache=${dir}/cache" -v 6 -D "${dir}/adapt.raw,${BRILLO_BENCH_ADAPT}" 2>&1 |
+	sed -n 's/^Informational: //p'
+rm "${dir}/adapt.raw"
+
+_tree "${dir}"
+
+_bench_io "get all" -e -G
+_bench_io "list" -L -M 128
+_bench_io "auto" -G
@@ -0,0 +1,185 @@
+#!/bin/sh
+
+# Runs fades on simulated controllers with a virtual clock, and compares
+# the time and value of every write with the golden files. The fades run
+# at full speed, and take the same steps every time.
+# Set BRILLO_FADE_UPDATE=1 to rewrite the golden files instead.
+
+set -eu
+
+: ${BRILLO_BIN:=./brillo}
+: ${BRILLO_FADE_UPDATE:=}
+
+golden="$(dirname "$0")/golden"
+dir="$(mktemp -d)"
+trap 'rm -rf "${dir}"' EXIT
+
+# prints bytes of a little endian integer
+_le() {
+	local v="$1" n="$2" out=""
+
+	while [ "${n}" -gt 0 ]; do
+		out="${out}\\$(printf '%03o' $((v & 255)))"
+		v=$((v >> 8))
+		n=$((n - 1))
+	done
+
+	printf "${out}"
+}
+
+# prints a struct input_event of a 64-bit system: sec usec type code value
+_event() {
+	_le "$1" 8
+	_le "$2" 8
+	_le "$3" 2
+	_le "$4" 2
+	_le "$5" 4
+}
+
+# prints a key event followed by a report: sec usec code value
+_key() {
+	_event "$1" "$2" 1 "$3" "$4"
+	_event "$1" "$2" 0 0 0
+}
+
+_setup() {
+	local sim="$1"
+
+	shift
+
+	"$BRILLO_BIN" -B "sim:cache=${dir}/cache${sim:+,${sim}}" "$@" > /dev/null
+}
+
+_fade() {
+	local id="$1" sim="$2" out="${dir}/$1"
+
+	shift 2
+
+	"$BRILLO_BIN" -B "sim:clock=virtual,trace=1,cache=${dir}/cache${sim:+,${sim}}" \
+		"$@" > "${out}" || {
+		printf '%s: failed\n' "${id}"
+		ret=1
+		return
+	}
+
+	_golden "${id}"
+}
+
+# waits up to five seconds for a write of a value to show up in a trace,
+# after the given number of writes
+_wait_write() {
+	local out="$1" val="$2" skip="$3" n=50
+
+	until tail -n "+$((skip + 1))" "${out}" | grep -q " ${val}\$"; do
+		n=$((n - 1))
+		[ "${n}" -gt 0 ] || return 1
+		sleep 0.1
+	done
+}
+
+_golden() {
+	local id="$1" out="${dir}/$1"
+
+	if [ -n "${BRILLO_FADE_UPDATE}" ]; then
+		cp "${out}" "${golden}/${id}"
+	elif ! diff -u "${golden}/${id}" "${out}"; then
+		printf '%s: differs from golden file\n' "${id}"
+		ret=1
+		return
+	fi
+
+	printf '%s: %s writes over %s us\n' "${id}" \
+		"$(wc -l < "${out}")" "$(tail -n 1 "${out}" | cut -d ' ' -f 1)"
+}
+
+ret=0
+
+mkdir -p "${golden}" "${dir}/cache"
+
+_fade "set" "" -u 200000 -S 80
+_fade "add-exp" "" -q -u 100000 -A 10
+_fade "sub-quant" "quant=10,smooth=50000" -u 60000 -U 33
+_fade "latency" "lat=3000,jitter=1000,seed=7" -u 100000 -S 10
+_fade "slow-writes" "lat=30000,spike=20/15000,seed=3" -u 100000 -S 90
+_fade "rate" "" -y 100 -S 90
+_fade "all" "n=3,max=255/1000/7" -e -u 100000 -S 25
+_fade "ten-seconds" "val=0" -u 10000000 -S 100
+
+_setup "val=900" -O
+_fade "restore" "" -u 100000 -I
+
+_setup "n=2,val=100" -e -r -N night
+_fade "scene" "n=2" -u 100000 -n night
+
+printf 'sim0,255,0,0,1\nsim1,0,255,0\n\nsim0,0,0,255\n\nsim1,0,0,0\n' > "${dir}/frames.csv"
+_fade "frames" "n=2" -k -u 20000 -f "${dir}/frames.csv"
+
+# hold up with three repeats, turn around halfway through, then tap down
+{
+	_key 100 0 225 1
+	_key 100 250000 225 2
+	_key 100 283000 225 2
+	_key 100 316000 225 2
+	_key 100 350000 225 0
+	_key 100 360000 224 1
+	_key 100 400000 224 0
+	_key 101 0 224 1
+	_key 101 50000 224 0
+} > "${dir}/keys.ev"
+_fade "keys" "" -u 100000 -E "${dir}/keys.ev"
+
+# a calibrated firmware ramp takes a single write
+echo 50000 > "${dir}/cache/backlight.sim0.ramp"
+_fade "ramp" "smooth=50000" -w -u 500000 -S 80
+rm "${dir}/cache/backlight.sim0.ramp"
+
+# frames of 16x4 pixels: white twice, black, mid gray and a gray too close
+# to it to move the brightness, then white again
+_frame() {
+	head -c 256 /dev/zero | tr '\0' "$1"
+}
+for c in '\377' '\377' '\000' '\200' '\170' '\377'; do
+	_frame "${c}"
+done > "${dir}/adapt.raw"
+_fade "adapt" "" -u 100000 -D "${dir}/adapt.raw,16x4"
+
+# a cap of 30% stops a fade to 90% short, until it expires
+echo "300 9999999999999" > "${dir}/cache/backlight.sim0.cap"
+_fade "cap" "" -u 100000 -S 90
+rm "${dir}/cache/backlight.sim0.cap"
+
+# a flash played twice, and slow writes that do not delay the keyframes
+_fade "sequence" "" -Q 20:100000:out,80:100000:in-outx2
+_fade "sequence-slow" "lat=30000,seed=3" -Q 20:100000,80:100000
+
+# a policy on a fake sysfs tree: a hot zone stores a cap of 40% and fades
+# down to it, and the brightness comes back once the zone cools down,
+# with a battery that is discharging but not low
+mkdir -p "${dir}/sys/thermal/thermal_zone0" "${dir}/sys/power_supply/BAT0"
+echo 90000 > "${dir}/sys/thermal/thermal_zone0/temp"
+echo Battery > "${dir}/sys/power_supply/BAT0/type"
+echo Discharging > "${dir}/sys/power_supply/BAT0/status"
+echo 50 > "${dir}/sys/power_supply/BAT0/capacity"
+"$BRILLO_BIN" -B "sim:clock=virtual,trace=1,val=1000,cache=${dir}/cache,root=${dir}/sys" \
+	-u 100000 -Y > "${dir}/policy" &
+policy=$!
+failed=
+if ! _wait_write "${dir}/policy" 400 0; then
+	failed="no fade down"
+elif ! read -r cap expiry < "${dir}/cache/backlight.sim0.cap" || [ "${cap}" != 400 ]; then
+	failed="cap not stored"
+else
+	writes="$(wc -l < "${dir}/policy")"
+	echo 30000 > "${dir}/sys/thermal/thermal_zone0/temp"
+	_wait_write "${dir}/policy" 1000 "${writes}" || failed="no fade up"
+fi
+kill "${policy}"
+wait "${policy}" 2> /dev/null || true
+if [ -n "${failed}" ]; then
+	printf 'policy: %s\n' "${failed}"
+	ret=1
+else
+	_golden "policy"
+fi
+
+exit "${ret}"
@@ -0,0 +1,32 @@
+#!/bin/sh
+
+# Checks that the binary carries every static probe in its ELF notes.
+# Binaries built without sys/sdt.h have no probes at all, and are skipped.
+
+set -eu
+
+: ${BRILLO_BIN:=./brillo}
+
+probes="ctrl_found lock_acquire lock_release rewrite_start rewrite_end fade_plan fade_done"
+
+notes="$(readelf -n "$BRILLO_BIN" | awk '
+	/Provider:/ { provider = $2 }
+	/Name:/ && provider == "brillo" { print $2 }' | sort -u)"
+
+if [ -z "${notes}" ]; then
+	printf 'probes: none compiled in, skipped\n'
+	exit 0
+fi
+
+ret=0
+
+for probe in ${probes}; do
+	if ! printf '%s\n' "${notes}" | grep -qx "${probe}"; then
+		printf '%s: missing\n' "${probe}"
+		ret=1
+	fi
+done
+
+printf 'probes: %s\n' "$(printf '%s\n' "${notes}" | wc -l)"
+
+exit "${ret}"
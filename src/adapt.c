@@ -0,0 +1,472 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+/* for MAP_POPULATE */
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "light.h"
+#include "value.h"
+#include "exec.h"
+#include "clk.h"
+#include "adapt.h"
+
+/*
+ * Adaptive brightness lowers the backlight on dark content, the way panels
+ * with content adaptive backlight control do. The picture is mapped from a
+ * framebuffer device, or from a file of raw frames given as
+ *
+ *	<path>[,<width>x<height>[,xrgb8888|rgb565]]
+ *
+ * A file is played one frame per period and ends the operation, a device
+ * is read again every period. The average luminance of ADAPT_ROWS rows
+ * gives the picture level, which moves the brightness on the exponential
+ * scale between the level the controller was at, for white, and
+ * ADAPT_DEPTH below it, for black.
+ */
+
+#define ADAPT_PERIOD_NSEC 250000000
+/* rows measured of every frame, evenly spread */
+#define ADAPT_ROWS 256
+/* the picture level moves this far before the brightness follows */
+#define ADAPT_HYST 500
+#define ADAPT_DEPTH 4000
+
+typedef uint16_t adapt_vec __attribute__((vector_size(16)));
+
+#define ADAPT_LANES (sizeof(adapt_vec) / sizeof(uint16_t))
+/* vectors summed into a lane before it could overflow */
+#define ADAPT_FLUSH 256
+
+/*
+ * Luminance in 256ths, weighted as BT.709, and the same weights
+ * scaled for 5 and 6 bit channels. Both fit in 16 bits.
+ */
+#define ADAPT_R 54
+#define ADAPT_G 183
+#define ADAPT_B 19
+#define ADAPT_R5 444
+#define ADAPT_G6 741
+#define ADAPT_B5 156
+
+enum adapt_format {
+	ADAPT_XRGB8888,
+	ADAPT_RGB565
+};
+
+struct adapt_src {
+	int fd;
+	bool device;
+	const uint8_t *map;
+	size_t len;
+	size_t width;
+	size_t height;
+	size_t stride;
+	enum adapt_format format;
+	/* complete frames in a file */
+	size_t frames;
+};
+
+/**
+ * adapt_sum:
+ * @acc:	accumulated lanes
+ *
+ * Returns: sum of the lanes
+ **/
+static uint64_t adapt_sum(adapt_vec acc)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < ADAPT_LANES; i++)
+		sum += acc[i];
+
+	return sum;
+}
+
+/**
+ * adapt_row_xrgb:
+ * @row:	pixels of the row
+ * @width:	number of pixels
+ *
+ * Every pixel takes two lanes, blue and green in the first and red in
+ * the second, which are weighted and rounded down to 8 bits apiece.
+ *
+ * Returns: sum of the luminance of the pixels
+ **/
+static uint64_t adapt_row_xrgb(const uint8_t *row, size_t width)
+{
+	const adapt_vec zero = { 0 };
+	const adapt_vec lo = { ADAPT_B, ADAPT_R, ADAPT_B, ADAPT_R,
+		ADAPT_B, ADAPT_R, ADAPT_B, ADAPT_R };
+	const adapt_vec hi = { ADAPT_G, 0, ADAPT_G, 0, ADAPT_G, 0, ADAPT_G, 0 };
+	adapt_vec acc = zero, v;
+	uint64_t sum = 0;
+	size_t i = 0, n = 0;
+	uint32_t p;
+
+	for (; i + ADAPT_LANES / 2 <= width; i += ADAPT_LANES / 2) {
+		memcpy(&v, row + i * 4, sizeof(v));
+		acc += ((v & 0xff) * lo + (v >> 8) * hi + 128) >> 8;
+		if (++n == ADAPT_FLUSH) {
+			sum += adapt_sum(acc);
+			acc = zero;
+			n = 0;
+		}
+	}
+
+	sum += adapt_sum(acc);
+
+	for (; i < width; i++) {
+		memcpy(&p, row + i * 4, sizeof(p));
+		sum += ((p & 0xff) * ADAPT_B + ((p >> 8) & 0xff) * ADAPT_G + 128) / 256 +
+			(((p >> 16) & 0xff) * ADAPT_R + 128) / 256;
+	}
+
+	return sum;
+}
+
+/**
+ * adapt_row_565:
+ * @row:	pixels of the row
+ * @width:	number of pixels
+ *
+ * Returns: sum of the luminance of the pixels
+ **/
+static uint64_t adapt_row_565(const uint8_t *row, size_t width)
+{
+	const adapt_vec zero = { 0 };
+	adapt_vec acc = zero, v;
+	uint64_t sum = 0;
+	size_t i = 0, n = 0;
+	uint16_t p;
+
+	for (; i + ADAPT_LANES <= width; i += ADAPT_LANES) {
+		memcpy(&v, row + i * 2, sizeof(v));
+		acc += ((v >> 11) * ADAPT_R5 + ((v >> 5) & 0x3f) * ADAPT_G6 +
+				(v & 0x1f) * ADAPT_B5 + 128) >> 8;
+		if (++n == ADAPT_FLUSH) {
+			sum += adapt_sum(acc);
+			acc = zero;
+			n = 0;
+		}
+	}
+
+	sum += adapt_sum(acc);
+
+	for (; i < width; i++) {
+		memcpy(&p, row + i * 2, sizeof(p));
+		sum += ((p >> 11) * ADAPT_R5 + ((p >> 5) & 0x3f) * ADAPT_G6 +
+				(p & 0x1f) * ADAPT_B5 + 128) / 256;
+	}
+
+	return sum;
+}
+
+/**
+ * adapt_level:
+ * @s:		source of the picture
+ * @px:		first pixel of the frame
+ *
+ * Returns: average luminance of the measured rows, out of VALUE_PCT_MAX
+ **/
+static int64_t adapt_level(const struct adapt_src *s, const uint8_t *px)
+{
+	uint64_t sum = 0, rows = 0;
+	size_t step = s->height > ADAPT_ROWS ? s->height / ADAPT_ROWS : 1;
+
+	for (size_t y = step / 2; y < s->height; y += step, rows++) {
+		if (s->format == ADAPT_RGB565)
+			sum += adapt_row_565(px + y * s->stride, s->width);
+		else
+			sum += adapt_row_xrgb(px + y * s->stride, s->width);
+	}
+
+	return VALUE_CLAMP_PCT((int64_t) (sum * VALUE_PCT_MAX / (rows * s->width * 255)));
+}
+
+/**
+ * adapt_bpp:
+ * @s:		source of the picture
+ *
+ * Returns: bytes per pixel
+ **/
+static size_t adapt_bpp(const struct adapt_src *s)
+{
+	return s->format == ADAPT_RGB565 ? 2 : 4;
+}
+
+/**
+ * adapt_frame:
+ * @s:		source of the picture
+ * @frame:	index of the frame in a file
+ *
+ * Returns: first pixel of the frame, or NULL if it is out of bounds
+ **/
+static const uint8_t *adapt_frame(const struct adapt_src *s, size_t frame)
+{
+	struct fb_var_screeninfo var;
+	size_t offset = s->device ? 0 : frame * s->stride * s->height;
+
+	/* the visible part pans across the memory of a device */
+	if (s->device && ioctl(s->fd, FBIOGET_VSCREENINFO, &var) == 0)
+		offset = var.yoffset * s->stride + var.xoffset * adapt_bpp(s);
+
+	if (offset + s->stride * (s->height - 1) + s->width * adapt_bpp(s) > s->len) {
+		vlog_err("frame is out of bounds");
+		return NULL;
+	}
+
+	return s->map + offset;
+}
+
+/**
+ * adapt_geometry:
+ * @s:		source to store the geometry in
+ * @arg:	"<width>x<height>", optionally followed by a comma and the format
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool adapt_geometry(struct adapt_src *s, const char *arg)
+{
+	char format[16] = "xrgb8888";
+
+	if (sscanf(arg, "%zux%zu,%15s", &s->width, &s->height, format) < 2 ||
+	    s->width == 0 || s->height == 0) {
+		vlog_err("geometry not recognizable");
+		return false;
+	}
+
+	if (strcmp(format, "xrgb8888") == 0) {
+		s->format = ADAPT_XRGB8888;
+	} else if (strcmp(format, "rgb565") == 0) {
+		s->format = ADAPT_RGB565;
+	} else {
+		vlog_err("format must be xrgb8888 or rgb565");
+		return false;
+	}
+
+	s->stride = s->width * adapt_bpp(s);
+	return true;
+}
+
+/**
+ * adapt_device:
+ * @s:		opened framebuffer device to store the geometry of
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool adapt_device(struct adapt_src *s)
+{
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+
+	if (ioctl(s->fd, FBIOGET_VSCREENINFO, &var) < 0 ||
+	    ioctl(s->fd, FBIOGET_FSCREENINFO, &fix) < 0) {
+		vlog_err("ioctl: %m");
+		return false;
+	}
+
+	if (var.xres == 0 || var.yres == 0 ||
+	    (var.bits_per_pixel != 32 && var.bits_per_pixel != 16)) {
+		vlog_err("framebuffer of %ux%u with %u bits per pixel is not supported",
+				var.xres, var.yres, var.bits_per_pixel);
+		return false;
+	}
+
+	s->format = var.bits_per_pixel == 16 ? ADAPT_RGB565 : ADAPT_XRGB8888;
+	s->width = var.xres;
+	s->height = var.yres;
+	s->stride = fix.line_length;
+	s->len = fix.smem_len;
+	return true;
+}
+
+/**
+ * adapt_open:
+ * @s:		source to open
+ * @spec:	path, optionally followed by the geometry
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool adapt_open(struct adapt_src *s, const char *spec)
+{
+	struct stat st;
+	char *geometry;
+	burn_o char *path = strdup(spec);
+
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+
+	if (!path) {
+		vlog_err("strdup: %m");
+		return false;
+	}
+
+	if ((geometry = strchr(path, ',')))
+		*geometry++ = '\0';
+
+	if ((s->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(s->fd, &st) < 0) {
+		vlog_err("open '%s': %m", path);
+		return false;
+	}
+
+	s->device = S_ISCHR(st.st_mode);
+
+	if (s->device && !geometry) {
+		if (!adapt_device(s))
+			return false;
+	} else if (!geometry) {
+		vlog_err("'%s' needs a geometry", path);
+		return false;
+	} else if (!adapt_geometry(s, geometry)) {
+		return false;
+	} else {
+		s->len = (size_t) st.st_size;
+	}
+
+	if (!s->device && (s->frames = s->len / (s->stride * s->height)) == 0) {
+		vlog_err("'%s' holds no complete frame", path);
+		return false;
+	}
+
+	/* mapped up front, rather than faulting on every frame */
+	s->map = mmap(NULL, s->len, PROT_READ, MAP_SHARED | MAP_POPULATE, s->fd, 0);
+
+	if (s->map == MAP_FAILED) {
+		vlog_err("mmap '%s': %m", path);
+		s->map = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * adapt_close:
+ * @s:		source to close
+ **/
+static void adapt_close(struct adapt_src *s)
+{
+	if (s->map)
+		munmap((void *) s->map, s->len);
+	if (s->fd >= 0)
+		close(s->fd);
+}
+
+/**
+ * adapt_factor:
+ * @apl:	picture level
+ *
+ * Returns: share of the ceiling to set, out of VALUE_PCT_MAX
+ **/
+static int64_t adapt_factor(int64_t apl)
+{
+	return VALUE_PCT_MAX - ADAPT_DEPTH * (VALUE_PCT_MAX - apl) / VALUE_PCT_MAX;
+}
+
+/**
+ * adapt_loop:
+ * @conf:	configuration object holding the controller
+ * @s:		opened source of the picture
+ *
+ * Returns: true once a file ends, false on failure
+ **/
+static bool adapt_loop(struct light_conf *conf, struct adapt_src *s)
+{
+	struct timespec next, t0, t1;
+	int64_t max, cur, ceiling, last, apl, usec = 0;
+	/* the controller starts at the ceiling, as for a white picture */
+	int64_t applied = VALUE_PCT_MAX;
+	const uint8_t *px;
+	size_t frame = 0;
+
+	if ((max = exec_get_max(conf)) <= 0 || (cur = light_fetch(conf, LIGHT_BRIGHTNESS)) < 0)
+		return false;
+
+	ceiling = value_from_raw(LIGHT_PERCENT_EXPONENTIAL, cur, max);
+	last = cur;
+
+	/* every change is a smooth set, in place */
+	conf->op_mode = LIGHT_SET;
+	conf->val_mode = LIGHT_PERCENT_EXPONENTIAL;
+	conf->detach = false;
+
+	clk_now(&next);
+
+	for (; s->device || frame < s->frames; frame++) {
+		if (!(px = adapt_frame(s, frame)))
+			return false;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		apl = adapt_level(s, px);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		usec += (int64_t) (t1.tv_sec - t0.tv_sec) * 1000000 +
+			(t1.tv_nsec - t0.tv_nsec) / 1000;
+
+		vlog_debug("picture level %.2f%%", apl / 100.0);
+
+		/* the brightness was moved by someone else, and is
+		 * where the ceiling is dimmed to at this level */
+		if ((cur = light_fetch(conf, LIGHT_BRIGHTNESS)) >= 0 && cur != last) {
+			ceiling = VALUE_CLAMP_PCT(value_from_raw(LIGHT_PERCENT_EXPONENTIAL,
+						cur, max) * VALUE_PCT_MAX / adapt_factor(applied));
+			last = cur;
+			vlog_notice("brightness of '%s' moved, adapting from there", conf->ctrl);
+		}
+
+		/* a dropped change is tried again next period */
+		if (llabs(apl - applied) >= ADAPT_HYST) {
+			conf->value = ceiling * adapt_factor(apl) / VALUE_PCT_MAX;
+
+			if (!exec_op(conf))
+				return false;
+
+			if (!conf->dropped)
+				applied = apl;
+			last = light_fetch(conf, LIGHT_BRIGHTNESS);
+		}
+
+		clk_add(&next, ADAPT_PERIOD_NSEC);
+		clk_sleep_until(&next);
+	}
+
+	vlog_info("%zu frames of %zux%zu, %.3f ms per picture level", frame,
+			s->width, s->height, frame > 0 ? usec / 1000.0 / frame : 0);
+	return true;
+}
+
+/**
+ * adapt_run:
+ * @conf:	configuration object holding the source and the controller
+ *
+ * Adjusts the brightness to the picture level of every period.
+ *
+ * Returns: true once a file ends, false on failure
+ **/
+bool adapt_run(struct light_conf *conf)
+{
+	bool ret;
+	struct adapt_src s;
+
+	if (conf->ctrl_mode == LIGHT_CTRL_ALL) {
+		vlog_err("adaptive brightness takes a single controller");
+		return false;
+	}
+
+	ret = adapt_open(&s, conf->adapt) && adapt_loop(conf, &s);
+
+	adapt_close(&s);
+	return ret;
+}
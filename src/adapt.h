@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include <stdbool.h>
+
+#include "light.h"
+
+bool adapt_run(struct light_conf *conf);
+
+#endif /* ADAPT_H */
@@ -0,0 +1,175 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "light.h"
+#include "exec.h"
+#include "metrics.h"
+#include "arb.h"
+
+/*
+ * Several agents may drive one controller: an ambient light loop, an idle
+ * dimmer, a resume hook and the user at the keyboard. Every request has a
+ * source and a priority, and a request with a hold time claims the
+ * controller for that long, in <cache>/<target>.<ctrl>.claim:
+ *
+ *	<source> <priority> <end of the hold, wall clock milliseconds>
+ *
+ * While the claim holds, requests of a lower priority are dropped before
+ * the controller is opened. The file is locked while a request is
+ * arbitrated, so that separate processes take turns.
+ */
+
+#define ARB_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+/* room for the source, two numbers and the separators */
+#define ARB_CLAIM_MAX (ARB_SOURCE_MAX + 48)
+
+/**
+ * arb_source:
+ * @conf:	configuration object to store the source in
+ * @arg:	source name, optionally followed by a comma and its priority
+ *
+ * Returns: true on success, false on failure
+ **/
+bool arb_source(struct light_conf *conf, char *arg)
+{
+	char *prio = strchr(arg, ',');
+
+	conf->priority = ARB_PRIO_AUTO;
+
+	if (prio) {
+		*prio++ = '\0';
+		if (sscanf(prio, "%" SCNd64, &conf->priority) != 1) {
+			vlog_err("priority not recognizable");
+			return false;
+		}
+	}
+
+	if (arg[0] == '\0' || strlen(arg) >= ARB_SOURCE_MAX || strpbrk(arg, " \t\n")) {
+		vlog_err("can't handle source: '%s'", arg);
+		return false;
+	}
+
+	conf->source = arg;
+	return true;
+}
+
+/**
+ * arb_hold:
+ * @conf:	configuration object to populate
+ * @interactive:	whether the user asks for the change as it happens
+ *
+ * Sets the hold time unless one was given. Only interactive user
+ * requests hold the controller, for ARB_HOLD_USEC: restores and
+ * daemons would otherwise lock automatic sources out after them.
+ **/
+void arb_hold(struct light_conf *conf, bool interactive)
+{
+	if (conf->hold < 0)
+		conf->hold = interactive && conf->priority >= ARB_PRIO_USER ?
+			ARB_HOLD_USEC : 0;
+}
+
+/**
+ * arb_defaults:
+ * @conf:	configuration object to populate
+ *
+ * Requests that do not name a source come from the user. Setting,
+ * increasing and decreasing the brightness are interactive; brightness
+ * keys are left for arb_hold() until it is known whether they are
+ * pressed or replayed. The policy operation overrides everyone
+ * without holding the controller.
+ **/
+void arb_defaults(struct light_conf *conf)
+{
+	if (!conf->source && conf->op_mode == LIGHT_POLICY) {
+		conf->source = "policy";
+		conf->priority = ARB_PRIO_POLICY;
+		if (conf->hold < 0)
+			conf->hold = 0;
+	} else if (!conf->source) {
+		conf->source = "user";
+		conf->priority = ARB_PRIO_USER;
+	}
+
+	if (conf->op_mode != LIGHT_LISTEN)
+		arb_hold(conf, conf->op_mode == LIGHT_SET ||
+				conf->op_mode == LIGHT_ADD || conf->op_mode == LIGHT_SUB);
+}
+
+/**
+ * arb_allow:
+ * @conf:	configuration object holding the controller and source
+ *
+ * Arbitrates a request to change the brightness, and records its
+ * claim on the controller if it has a hold time. Requests go ahead
+ * when the cache directory can not be written.
+ *
+ * Returns: true if the request goes ahead, false if it is dropped
+ **/
+bool arb_allow(struct light_conf *conf)
+{
+	char buf[ARB_CLAIM_MAX], holder[ARB_SOURCE_MAX];
+	int64_t prio, until, now;
+	struct timespec ts;
+	ssize_t len;
+	int fd;
+	burn_o char *path = light_path_new(conf, LIGHT_CLAIM);
+
+	if (!path)
+		return true;
+
+	if ((fd = open(path, O_RDWR | O_CREAT, ARB_MODE)) < 0) {
+		vlog_info("open '%s': %m", path);
+		return true;
+	}
+
+	if (lockf(fd, F_LOCK, 0) < 0) {
+		vlog_warning("lockf '%s': %m", path);
+		close(fd);
+		return true;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	/* holder is ARB_SOURCE_MAX long */
+	if ((len = pread(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		if (sscanf(buf, "%31s %" SCNd64 " %" SCNd64, holder, &prio, &until) != 3)
+			until = 0;
+
+		if (until > now && prio > conf->priority) {
+			vlog_notice("dropping request of '%s', '%s' holds '%s' for %" PRId64 " ms",
+					conf->source, holder, conf->ctrl, until - now);
+			METRICS_COUNT(METRICS_DROPPED);
+			close(fd);
+			return false;
+		}
+
+		/* key repeats of the same source mostly leave the claim be */
+		if (until > now && prio == conf->priority && strcmp(holder, conf->source) == 0 &&
+		    now + conf->hold / 1000 - until < ARB_REFRESH_MSEC) {
+			close(fd);
+			return true;
+		}
+	}
+
+	if (conf->hold > 0) {
+		len = snprintf(buf, sizeof(buf), "%s %" PRId64 " %" PRId64 "\n",
+				conf->source, conf->priority, now + conf->hold / 1000);
+		if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, len, 0) != len)
+			vlog_warning("write '%s': %m", path);
+	}
+
+	close(fd);
+	return true;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef ARB_H
+#define ARB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "light.h"
+
+/* priority of requests that do not name a source, such as hotkeys */
+#define ARB_PRIO_USER 100
+/* priority of named sources that do not give one */
+#define ARB_PRIO_AUTO 0
+/* priority of the policy operation, which caps over everyone */
+#define ARB_PRIO_POLICY 1000
+/* time an interactive user request holds the controller for, unless given */
+#define ARB_HOLD_USEC 60000000
+/* a claim of the same source is only extended once it moved this far */
+#define ARB_REFRESH_MSEC 1000
+/* longest source name, including the terminator */
+#define ARB_SOURCE_MAX 32
+
+bool arb_source(struct light_conf *conf, char *arg);
+void arb_defaults(struct light_conf *conf);
+void arb_hold(struct light_conf *conf, bool interactive);
+bool arb_allow(struct light_conf *conf);
+
+#endif /* ARB_H */
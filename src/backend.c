@@ -0,0 +1,280 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "file.h"
+#include "light.h"
+#include "backend.h"
+#include "batch.h"
+
+static const struct backend *backends[] = {
+	&backend_sysfs,
+	&backend_sim,
+	&backend_ddc,
+};
+
+/**
+ * backend_set:
+ * @conf:	configuration object to set the backend of
+ * @spec:	backend name, optionally followed by ':' and its options
+ *
+ * Returns: true on success, false on failure
+ **/
+bool backend_set(struct light_conf *conf, const char *spec)
+{
+	const char *opts = strchr(spec, ':');
+	size_t len = opts ? (size_t) (opts - spec) : strlen(spec);
+
+	for (size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+		const struct backend *b = backends[i];
+
+		if (strlen(b->name) != len || strncmp(b->name, spec, len) != 0)
+			continue;
+
+		conf->backend = b;
+		return !b->init || b->init(conf, opts ? opts + 1 : "");
+	}
+
+	vlog_err("unknown backend: '%s'", spec);
+	return false;
+}
+
+/**
+ * backend_attr_new:
+ * @conf:	configuration object holding the sysfs prefix
+ * @ctrl:	name of the controller
+ * @attr:	attribute of the controller
+ *
+ * WARNING: this function allocates memory, but does not free it.
+ *          free the data pointed to by the return value after use.
+ *
+ * Returns: sysfs path of the attribute, or NULL on failure
+ **/
+char *backend_attr_new(struct light_conf *conf, const char *ctrl, const char *attr)
+{
+	char *p;
+
+	if (!path_component(ctrl) || !(p = path_new()))
+		return NULL;
+
+	return path_append(p, "%s/%s/%s", conf->sys_prefix, ctrl, attr);
+}
+
+/**
+ * sysfs_init:
+ * @conf:	configuration object
+ * @opts:	comma separated key=value options
+ *
+ * Options redirect the device classes (root) and the cache
+ * directory (cache), so that a fake tree can be used instead,
+ * and choose how attributes of many controllers are read (io).
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool sysfs_init(struct light_conf *conf, const char *opts)
+{
+	while (*opts) {
+		char key[8];
+		char **dst;
+		size_t len;
+		int n;
+
+		if (sscanf(opts, "%7[a-z]=%n", key, &n) != 1) {
+			vlog_err("sysfs: malformed option '%s'", opts);
+			return false;
+		}
+
+		if (strcmp(key, "io") == 0) {
+			opts += n;
+			len = strcspn(opts, ",");
+			if (len == 5 && strncmp(opts, "uring", len) == 0) {
+				batch_use_ring(true);
+			} else if (len == 4 && strncmp(opts, "sync", len) == 0) {
+				batch_use_ring(false);
+			} else {
+				vlog_err("sysfs: io must be uring or sync");
+				return false;
+			}
+			opts += len;
+			if (*opts == ',')
+				opts++;
+			continue;
+		} else if (strcmp(key, "root") == 0) {
+			dst = &conf->sys_root;
+		} else if (strcmp(key, "cache") == 0) {
+			dst = &conf->cache_root;
+		} else {
+			vlog_err("sysfs: unknown option '%s'", key);
+			return false;
+		}
+
+		opts += n;
+		len = strcspn(opts, ",");
+
+		free(*dst);
+
+		if (!(*dst = strndup(opts, len))) {
+			vlog_err("strndup: %m");
+			return false;
+		}
+
+		opts += len;
+		if (*opts == ',')
+			opts++;
+	}
+
+	return true;
+}
+
+static void *sysfs_iter_new(struct light_conf *conf)
+{
+	DIR *dir = opendir(conf->sys_prefix);
+
+	if (!dir)
+		vlog_err("opendir: %m");
+
+	return dir;
+}
+
+static char *sysfs_iter_next(void *iter)
+{
+	struct dirent *file;
+
+	while ((file = readdir(iter))) {
+		if (file->d_name[0] != '.')
+			return strdup(file->d_name);
+	}
+
+	return NULL;
+}
+
+static void sysfs_iter_free(void *iter)
+{
+	closedir(iter);
+}
+
+static int64_t sysfs_read(struct light_conf *conf, const char *ctrl, LIGHT_FIELD field)
+{
+	burn_o char *path = backend_attr_new(conf, ctrl,
+			field == LIGHT_MAX_BRIGHTNESS ? "max_brightness" : "brightness");
+	return path ? file_read(path) : -ENOMEM;
+}
+
+static void sysfs_read_all(struct light_conf *conf, char *const *ctrls, size_t num,
+		LIGHT_FIELD field, int64_t *vals)
+{
+	const char *attr = field == LIGHT_MAX_BRIGHTNESS ? "max_brightness" : "brightness";
+	burn_o struct batch_read *reads = calloc(num, sizeof(*reads));
+
+	if (!reads) {
+		for (size_t i = 0; i < num; i++)
+			vals[i] = sysfs_read(conf, ctrls[i], field);
+		return;
+	}
+
+	for (size_t i = 0; i < num; i++)
+		reads[i].path = backend_attr_new(conf, ctrls[i], attr);
+
+	batch_read(reads, num);
+
+	for (size_t i = 0; i < num; i++) {
+		vals[i] = reads[i].val;
+		free((char *) reads[i].path);
+	}
+}
+
+static int sysfs_open(struct light_conf *conf, const char *ctrl)
+{
+	burn_o char *path = backend_attr_new(conf, ctrl, "brightness");
+	return path ? file_open(path, O_RDWR) : -1;
+}
+
+static int64_t sysfs_read_actual(struct light_conf *conf, const char *ctrl)
+{
+	burn_o char *path = backend_attr_new(conf, ctrl, "actual_brightness");
+	return path ? file_read(path) : -ENOMEM;
+}
+
+static int sysfs_notify(struct light_conf *conf, const char *ctrl)
+{
+	burn_o char *attr = backend_attr_new(conf, ctrl,
+			conf->target == LIGHT_KEYBOARD ?
+			"brightness_hw_changed" : "actual_brightness");
+
+	/* brightness itself never reports a change, so it is no substitute */
+	return attr ? open(attr, O_RDONLY) : -1;
+}
+
+static int sysfs_open_color(struct light_conf *conf, const char *ctrl)
+{
+	static const char *const channels[] = { "red", "green", "blue" };
+	char name[16];
+	int num;
+	burn_o char *index = backend_attr_new(conf, ctrl, "multi_index");
+	burn_o char *path = backend_attr_new(conf, ctrl, "multi_intensity");
+	burn_file file = NULL;
+
+	/* most LEDs only have a single color */
+	if (!index || !path || access(path, W_OK) != 0 || !(file = fopen(index, "r")))
+		return -1;
+
+	/* the intensities are written in the order of the channels */
+	for (num = 0; fscanf(file, "%15s", name) == 1; num++) {
+		if (num == 3 || strcmp(name, channels[num]) != 0) {
+			num = -1;
+			break;
+		}
+	}
+
+	if (num != 3) {
+		vlog_notice("'%s' has no red, green and blue channels, leaving its color", ctrl);
+		return -1;
+	}
+
+	return file_open(path, O_WRONLY);
+}
+
+static bool sysfs_write_color(int fd, const uint16_t rgb[3])
+{
+	if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+		vlog_err("ftruncate: %m");
+		return false;
+	}
+
+	if (dprintf(fd, "%u %u %u", rgb[0], rgb[1], rgb[2]) < 0) {
+		vlog_err("dprintf: %u %u %u", rgb[0], rgb[1], rgb[2]);
+		return false;
+	}
+
+	/* flush all data to disk so the change takes effect */
+	if (fsync(fd) != 0) {
+		vlog_err("fsync: %m");
+		return false;
+	}
+
+	return true;
+}
+
+const struct backend backend_sysfs = {
+	.name = "sysfs",
+	.init = sysfs_init,
+	.iter_new = sysfs_iter_new,
+	.iter_next = sysfs_iter_next,
+	.iter_free = sysfs_iter_free,
+	.read = sysfs_read,
+	.read_all = sysfs_read_all,
+	.open = sysfs_open,
+	.write = file_rewrite,
+	.read_fd = file_read_fd,
+	.read_actual = sysfs_read_actual,
+	.notify = sysfs_notify,
+	.open_color = sysfs_open_color,
+	.write_color = sysfs_write_color,
+};
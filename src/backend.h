@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "light.h"
+
+struct backend {
+	const char *name;
+	/* parses the options following "name:" in the spec, may be NULL */
+	bool (*init)(struct light_conf *conf, const char *opts);
+	/* enumerates controller names, each allocated */
+	void *(*iter_new)(struct light_conf *conf);
+	char *(*iter_next)(void *iter);
+	void (*iter_free)(void *iter);
+	/* reads LIGHT_BRIGHTNESS or LIGHT_MAX_BRIGHTNESS, -errno on failure */
+	int64_t (*read)(struct light_conf *conf, const char *ctrl, LIGHT_FIELD field);
+	/* reads a field of many controllers at once, may be NULL */
+	void (*read_all)(struct light_conf *conf, char *const *ctrls, size_t num,
+			LIGHT_FIELD field, int64_t *vals);
+	/* opens the brightness of a controller for writing */
+	int (*open)(struct light_conf *conf, const char *ctrl);
+	bool (*write)(int fd, int64_t val);
+	/* reads the brightness through an fd from open(), keeping its lock */
+	int64_t (*read_fd)(int fd);
+	/* reads the brightness the hardware applied, -ENOENT if unknown */
+	int64_t (*read_actual)(struct light_conf *conf, const char *ctrl);
+	/* opens an fd that polls POLLPRI on changes, or returns -1 */
+	int (*notify)(struct light_conf *conf, const char *ctrl);
+	/* opens the color intensities of a multicolor LED, or returns -1 */
+	int (*open_color)(struct light_conf *conf, const char *ctrl);
+	bool (*write_color)(int fd, const uint16_t rgb[3]);
+};
+
+extern const struct backend backend_sysfs;
+extern const struct backend backend_sim;
+extern const struct backend backend_ddc;
+
+bool backend_set(struct light_conf *conf, const char *spec);
+char *backend_attr_new(struct light_conf *conf, const char *ctrl, const char *attr)
+	__attribute__ ((warn_unused_result));
+
+#endif /* BACKEND_H */
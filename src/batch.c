@@ -0,0 +1,389 @@
+/* SPDX-License-Identifier: 0BSD */
+
+/* for syscall(), io_uring has no wrappers in libc */
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "vlog.h"
+#include "file.h"
+#include "batch.h"
+
+#if !defined(BATCH_DISABLE) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define BATCH_RING 1
+#endif
+#endif
+
+/* smaller batches are cheaper to read one after another */
+#define BATCH_MIN 8
+/* attributes in flight at once, each takes three entries of the ring */
+#define BATCH_OPS 64
+#define BATCH_ENTRIES 256
+#define BATCH_BUF 32
+
+/* attributes in the page cache read as fast one after another,
+ * the ring pays off with drivers that block on every read */
+static bool batch_ring = false;
+
+/**
+ * batch_use_ring:
+ * @ring:	whether to submit batches through io_uring if available
+ **/
+void batch_use_ring(bool ring)
+{
+	batch_ring = ring;
+}
+
+/**
+ * batch_parse:
+ * @buf:	attribute contents, terminated
+ *
+ * Returns: value, or -errno on failure
+ **/
+static int64_t batch_parse(const char *buf)
+{
+	char *end;
+	int64_t value;
+
+	errno = 0;
+	value = strtoll(buf, &end, 10);
+
+	if (errno != 0)
+		return -errno;
+	if (end == buf)
+		return -EINVAL;
+
+	return value;
+}
+
+#ifdef BATCH_RING
+
+struct batch_uring {
+	int fd;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	struct io_uring_cqe *cqes;
+	/* the kernel reads into these until every entry completed */
+	char (*bufs)[BATCH_BUF];
+	/* entries are still in flight */
+	bool busy;
+};
+
+/**
+ * batch_close:
+ * @r:		ring to tear down
+ **/
+static void batch_close(struct batch_uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+
+	/* reads still in flight may complete into the buffers later */
+	if (!r->busy)
+		free(r->bufs);
+}
+
+/**
+ * batch_open:
+ * @r:		ring to set up
+ *
+ * Sets up a ring with a table of BATCH_OPS direct descriptors,
+ * which the attributes are opened into.
+ *
+ * Returns: true on success, false if io_uring is not available
+ **/
+static bool batch_open(struct batch_uring *r)
+{
+	struct io_uring_params p;
+	int files[BATCH_OPS];
+
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+
+	if ((r->fd = (int) syscall(__NR_io_uring_setup, BATCH_ENTRIES, &p)) < 0) {
+		vlog_debug("io_uring_setup: %m");
+		return false;
+	}
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		batch_close(r);
+		return false;
+	}
+
+	r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ptr :
+		mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED, r->fd, IORING_OFF_SQES);
+
+	if (r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if (r->cq_ptr == MAP_FAILED)
+			r->cq_ptr = NULL;
+		if (r->sqes == MAP_FAILED)
+			r->sqes = NULL;
+		batch_close(r);
+		return false;
+	}
+
+	r->sq_head = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+
+	if (!(r->bufs = calloc(BATCH_OPS, sizeof(*r->bufs)))) {
+		vlog_err("calloc: %m");
+		batch_close(r);
+		return false;
+	}
+
+	/* an empty table, every slot is filled by an open */
+	memset(files, 0xff, sizeof(files));
+
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES,
+				files, BATCH_OPS) < 0) {
+		vlog_debug("io_uring_register: %m");
+		batch_close(r);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * batch_sqe:
+ * @r:		ring to queue into
+ * @tail:	tail of the submission queue, advanced
+ * @opcode:	operation
+ * @flags:	IOSQE_* flags
+ * @data:	user data of the completion
+ *
+ * Returns: zeroed submission entry, filled in by the caller
+ **/
+static struct io_uring_sqe *batch_sqe(struct batch_uring *r, unsigned *tail,
+		uint8_t opcode, uint8_t flags, uint64_t data)
+{
+	unsigned idx = (*tail)++ & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->user_data = data;
+	r->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+/**
+ * batch_chunk:
+ * @r:		ring to submit through
+ * @reads:	at most BATCH_OPS attributes to read
+ * @num:	number of attributes
+ *
+ * Opens every attribute into its own slot, reads it and closes the slot,
+ * linked so that each step waits for the one before. Every entry the
+ * kernel took is reaped before returning, even if the batch fails, as
+ * the reads complete into the buffers of the ring. The kernel copies
+ * the paths when it takes the entries.
+ *
+ * Returns: true on success, false if the batch could not be submitted
+ **/
+static bool batch_chunk(struct batch_uring *r, struct batch_read *reads, size_t num)
+{
+	char (*bufs)[BATCH_BUF] = r->bufs;
+	unsigned tail = *r->sq_tail, head, total = 0, submitted = 0, seen = 0;
+	int n;
+
+	for (size_t i = 0; i < num; i++) {
+		struct io_uring_sqe *sqe;
+
+		if (!reads[i].path)
+			continue;
+
+		reads[i].val = -EIO;
+
+		sqe = batch_sqe(r, &tail, IORING_OP_OPENAT, IOSQE_IO_LINK, i * 3);
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t) reads[i].path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		sqe->file_index = i + 1;
+
+		/* the slot is closed even if the read fails */
+		sqe = batch_sqe(r, &tail, IORING_OP_READ,
+				IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK, i * 3 + 1);
+		sqe->fd = i;
+		sqe->addr = (uintptr_t) bufs[i];
+		sqe->len = BATCH_BUF - 1;
+
+		sqe = batch_sqe(r, &tail, IORING_OP_CLOSE, 0, i * 3 + 2);
+		sqe->file_index = i + 1;
+
+		total += 3;
+	}
+
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (submitted < total) {
+		if ((n = (int) syscall(__NR_io_uring_enter, r->fd, total - submitted,
+					0, 0, NULL, 0)) > 0)
+			submitted += n;
+		else if (n == 0 || errno != EINTR)
+			break;
+	}
+
+	/* entries the kernel did not take are dropped */
+	if (submitted < total) {
+		vlog_debug("io_uring_enter: %m");
+		__atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE),
+				__ATOMIC_RELEASE);
+	}
+
+	head = *r->cq_head;
+
+	while (seen < submitted) {
+		struct io_uring_cqe *cqe;
+		size_t i;
+		int res;
+
+		if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+			if (syscall(__NR_io_uring_enter, r->fd, 0, submitted - seen,
+						IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				vlog_debug("io_uring_enter: %m");
+				r->busy = true;
+				return false;
+			}
+			continue;
+		}
+
+		cqe = &r->cqes[head++ & *r->cq_mask];
+		i = cqe->user_data / 3;
+		res = cqe->res;
+		seen++;
+
+		switch (cqe->user_data % 3) {
+		case 0:
+			/* a failed open cancels the rest of the chain */
+			if (res < 0)
+				reads[i].val = res;
+			break;
+		case 1:
+			if (res >= 0) {
+				bufs[i][res] = '\0';
+				reads[i].val = res > 0 ? batch_parse(bufs[i]) : -ENOENT;
+			} else if (res != -ECANCELED) {
+				reads[i].val = res;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return submitted == total;
+}
+
+/**
+ * batch_submit:
+ * @reads:	attributes to read
+ * @num:	number of attributes
+ *
+ * Returns: number of attributes read through io_uring, the rest
+ *          are left to be read one after another
+ **/
+static size_t batch_submit(struct batch_read *reads, size_t num)
+{
+	struct batch_uring r;
+	size_t done = 0;
+
+	if (!batch_open(&r))
+		return 0;
+
+	while (done < num) {
+		size_t n = num - done > BATCH_OPS ? BATCH_OPS : num - done;
+
+		if (!batch_chunk(&r, &reads[done], n))
+			break;
+
+		done += n;
+	}
+
+	batch_close(&r);
+	return done;
+}
+
+#else
+
+static size_t batch_submit(struct batch_read *reads, size_t num)
+{
+	(void) reads;
+	(void) num;
+	return 0;
+}
+
+#endif /* BATCH_RING */
+
+/**
+ * batch_read:
+ * @reads:	attributes to read, with their values stored on return
+ * @num:	number of attributes
+ *
+ * Reads every attribute, in one batch if possible. Attributes the
+ * ring could not open, such as on kernels that can not open into
+ * its table, are read again with file_read().
+ **/
+void batch_read(struct batch_read *reads, size_t num)
+{
+	size_t done = 0;
+
+	if (batch_ring && num >= BATCH_MIN)
+		done = batch_submit(reads, num);
+
+	for (size_t i = 0; i < num; i++) {
+		if (!reads[i].path)
+			reads[i].val = -ENOMEM;
+		else if (i >= done || reads[i].val == -EINVAL || reads[i].val == -EOPNOTSUPP)
+			reads[i].val = file_read(reads[i].path);
+	}
+}
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: 0BSD */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reads the values of many attributes at once. With io_uring, if asked for,
+ * the open, read and close of every attribute are submitted as one batch,
+ * and complete in whatever order the files answer. Otherwise, or when
+ * building with BATCH_DISABLE defined, the attributes are read one after
+ * another with file_read().
+ */
+
+struct batch_read {
+	/* attribute to read, NULL to skip it */
+	const char *path;
+	/* value read, or -errno */
+	int64_t val;
+};
+
+void batch_use_ring(bool ring);
+void batch_read(struct batch_read *reads, size_t num);
+
+#endif /* BATCH_H */
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: 0BSD */
+
+#include <errno.h>
+#include <string.h>
+
+#include "vlog.h"
+#include "clk.h"
+
+static const struct clk *clk = &clk_real;
+
+/* time of the virtual clock, which only moves when it is slept on */
+static struct timespec clk_virtual_time;
+
+static void clk_real_now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static bool clk_real_sleep_until(const struct timespec *ts)
+{
+	int err;
+
+	while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL)) == EINTR)
+		;
+
+	if (err != 0) {
+		vlog_err("clock_nanosleep: %s", strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+static void clk_virtual_now(struct timespec *ts)
+{
+	*ts = clk_virtual_time;
+}
+
+static bool clk_virtual_sleep_until(const struct timespec *ts)
+{
+	if (ts->tv_sec > clk_virtual_time.tv_sec ||
+	    (ts->tv_sec == clk_virtual_time.tv_sec &&
+	     ts->tv_nsec > clk_virtual_time.tv_nsec))
+		clk_virtual_time = *ts;
+
+	return true;
+}
+
+const struct clk clk_real = {
+	.name = "real",
+	.now = clk_real_now,
+	.sleep_until = clk_real_sleep_until,
+};
+
+const struct clk clk_virtual = {
+	.name = "virtual",
+	.now = clk_virtual_now,
+	.sleep_until = clk_virtual_sleep_until,
+};
+
+/**
+ * clk_use:
+ * @c:		clock to use from now on
+ *
+ * Selects the clock that paces fades and simulated hardware.
+ * The virtual clock starts at zero and never waits, so fades
+ * run at full speed and take the same steps every time.
+ **/
+void clk_use(const struct clk *c)
+{
+	clk = c;
+}
+
+/**
+ * clk_now:
+ * @ts:		where to store the current time
+ **/
+void clk_now(struct timespec *ts)
+{
+	clk->now(ts);
+}
+
+/**
+ * clk_sleep_until:
+ * @ts:		time to wait for
+ *
+ * Returns: true on success, false on failure
+ **/
+bool clk_sleep_until(const struct timespec *ts)
+{
+	return clk->sleep_until(ts);
+}
+
+/**
+ * clk_add:
+ * @ts:		time to move
+ * @nsec:	nanoseconds to add, not negative
+ **/
+void clk_add(struct timespec *ts, int64_t nsec)
+{
+	ts->tv_sec += nsec / 1000000000;
+	ts->tv_nsec += nsec % 1000000000;
+
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/**
+ * clk_sleep:
+ * @nsec:	nanoseconds to wait for
+ *
+ * Returns: true on success, false on failure
+ **/
+bool clk_sleep(int64_t nsec)
+{
+	struct timespec ts;
+
+	clk_now(&ts);
+	clk_add(&ts, nsec);
+	return clk_sleep_until(&ts);
+}
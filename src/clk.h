@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: 0BSD */
+
+#ifndef CLK_H
+#define CLK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+struct clk {
+	const char *name;
+	/* reads the current monotonic time */
+	void (*now)(struct timespec *ts);
+	/* waits until the given monotonic time */
+	bool (*sleep_until)(const struct timespec *ts);
+};
+
+extern const struct clk clk_real;
+extern const struct clk clk_virtual;
+
+void clk_use(const struct clk *clk);
+void clk_now(struct timespec *ts);
+bool clk_sleep_until(const struct timespec *ts);
+bool clk_sleep(int64_t nsec);
+void clk_add(struct timespec *ts, int64_t nsec);
+
+#endif /* CLK_H */
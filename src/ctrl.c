@@ -1,48 +1,254 @@
 /* SPDX-License-Identifier: GPL-3.0-only */
 
 #include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <time.h>
 
 #include "common.h"
 
 #include "burno.h"
 #include "vlog.h"
 #include "light.h"
+#include "backend.h"
 #include "exec.h"
 #include "ctrl.h"
+#include "probe.h"
+#include "metrics.h"
+
+/**
+ * ctrl_match_type:
+ * @conf:	configuration object holding the type filter
+ * @name:	name of the controller
+ *
+ * Returns: true if the backlight type of the controller matches
+ **/
+static bool ctrl_match_type(struct light_conf *conf, const char *name)
+{
+	char type[16];
+	burn_o char *path = backend_attr_new(conf, name, "type");
+	burn_file file = path ? fopen(path, "r") : NULL;
+
+	if (!file)
+		return false;
+
+	if (fscanf(file, "%15s", type) != 1)
+		/* cppcheck-suppress resourceLeak */
+		return false;
+
+	/* cppcheck-suppress resourceLeak */
+	return strcmp(type, conf->ctrl_type) == 0;
+}
+
+/**
+ * ctrl_match:
+ * @conf:	configuration object holding the filters
+ * @name:	name of the controller
+ *
+ * Checks a controller against the name patterns, then the type
+ * filter, so that only the attributes of controllers with a
+ * matching name are read.
+ *
+ * Returns: true if the controller passes these filters
+ **/
+static bool ctrl_match(struct light_conf *conf, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < conf->ctrl_globs_len; i++)
+		if (fnmatch(conf->ctrl_globs[i], name, 0) == 0)
+			break;
+
+	if (conf->ctrl_globs_len > 0 && i == conf->ctrl_globs_len)
+		return false;
+
+	if (conf->ctrl_type && !ctrl_match_type(conf, name))
+		return false;
+
+	return true;
+}
+
+/**
+ * ctrl_iter_fetch:
+ * @iter:	iterator from ctrl_iter_new()
+ * @conf:	configuration object holding the backend
+ * @field:	LIGHT_BRIGHTNESS or LIGHT_MAX_BRIGHTNESS
+ *
+ * Reads a field of every remaining controller at once, for
+ * ctrl_iter_value() to return as the controllers come up.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool ctrl_iter_fetch(struct ctrl_iter *iter, struct light_conf *conf, LIGHT_FIELD field)
+{
+	int64_t **vals = field == LIGHT_MAX_BRIGHTNESS ? &iter->max : &iter->val;
+	const struct backend *b = conf->backend;
+	size_t n = iter->num - iter->pos;
+
+	if (*vals)
+		return true;
+
+	if (!(*vals = calloc(iter->num + 1, sizeof(**vals)))) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	if (b->read_all) {
+		b->read_all(conf, &iter->names[iter->pos], n, field, &(*vals)[iter->pos]);
+	} else {
+		for (size_t i = iter->pos; i < iter->num; i++)
+			(*vals)[i] = b->read(conf, iter->names[i], field);
+	}
+
+	return true;
+}
+
+/**
+ * ctrl_iter_value:
+ * @iter:	iterator from ctrl_iter_new()
+ * @field:	field fetched with ctrl_iter_fetch()
+ *
+ * Returns: the field of the controller last returned by ctrl_iter_next(),
+ *          -ENODATA if it was not fetched, or another -errno on failure
+ **/
+int64_t ctrl_iter_value(struct ctrl_iter *iter, LIGHT_FIELD field)
+{
+	int64_t *vals = field == LIGHT_MAX_BRIGHTNESS ? iter->max : iter->val;
+
+	if (!vals || iter->pos == 0)
+		return -ENODATA;
+
+	return vals[iter->pos - 1];
+}
+
+/**
+ * ctrl_iter_min_max:
+ * @iter:	iterator holding every controller that matched
+ * @conf:	configuration object holding the minimum max brightness
+ *
+ * Drops the controllers with a lower max brightness.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool ctrl_iter_min_max(struct ctrl_iter *iter, struct light_conf *conf)
+{
+	size_t n = 0;
+
+	if (!ctrl_iter_fetch(iter, conf, LIGHT_MAX_BRIGHTNESS))
+		return false;
+
+	for (size_t i = 0; i < iter->num; i++) {
+		if (iter->max[i] < conf->ctrl_min_max) {
+			free(iter->names[i]);
+			continue;
+		}
+		iter->names[n] = iter->names[i];
+		iter->max[n++] = iter->max[i];
+	}
+
+	iter->num = n;
+	return true;
+}
+
+/**
+ * ctrl_iter_new:
+ * @conf:	configuration object holding the backend and filters
+ *
+ * Enumerates the controllers of the backend that pass the filters.
+ * The max brightness filter reads every controller at once.
+ *
+ * Returns: iterator to pass to ctrl_iter_next(), or NULL on failure
+ **/
+struct ctrl_iter *ctrl_iter_new(struct light_conf *conf)
+{
+	const struct backend *b = conf->backend;
+	struct ctrl_iter *iter;
+	void *state;
+	char *name;
+
+	if (!(iter = calloc(1, sizeof(*iter)))) {
+		vlog_err("calloc: %m");
+		return NULL;
+	}
+
+	if (!(state = b->iter_new(conf))) {
+		free(iter);
+		return NULL;
+	}
+
+	while ((name = b->iter_next(state))) {
+		char **names;
+
+		if (!ctrl_match(conf, name)) {
+			free(name);
+			continue;
+		}
+
+		if (!(names = realloc(iter->names, (iter->num + 1) * sizeof(*names)))) {
+			vlog_err("realloc: %m");
+			free(name);
+			break;
+		}
+
+		iter->names = names;
+		iter->names[iter->num++] = name;
+	}
+
+	b->iter_free(state);
+
+	if (name || (conf->ctrl_min_max > 0 && !ctrl_iter_min_max(iter, conf)))
+		ctrl_iter_free(&iter);
+
+	return iter;
+}
+
+/**
+ * ctrl_iter_free:
+ * @iter:	pointer to the iterator to free
+ **/
+void ctrl_iter_free(struct ctrl_iter **iter)
+{
+	if (!(*iter))
+		return;
+	for (size_t i = (*iter)->pos; i < (*iter)->num; i++)
+		free((*iter)->names[i]);
+	free((*iter)->names);
+	free((*iter)->max);
+	free((*iter)->val);
+	free(*iter);
+	*iter = NULL;
+}
 
 /**
  * ctrl_iter_next:
- * @dir:	opened directory to iterate over
+ * @iter:	iterator from ctrl_iter_new()
  *
- * Iterates over the directory given by dir.
+ * Iterates over the controllers that passed the filters of ctrl_iter_new().
  *
  * WARNING: will allocate a string and return it,
  *          this string should be freed after use
  *
- * Returns: name of the next controller, NULL on end of dir or failure
+ * Returns: name of the next controller, NULL on end or failure
  **/
-char *ctrl_iter_next(DIR * dir)
+char *ctrl_iter_next(struct ctrl_iter *iter)
 {
-	struct dirent *file;
-
-	if (!dir) {
-		vlog_err("directory uninitialized");
+	if (!iter) {
+		vlog_err("iterator uninitialized");
 		return NULL;
 	}
 
-	while ((file = readdir(dir))) {
-		if (file->d_name[0] != '.')
-			return strdup(file->d_name);
-	}
+	if (iter->pos == iter->num)
+		return NULL;
 
-	return NULL;
+	/* the caller takes over the name */
+	return iter->names[iter->pos++];
 }
 
 /**
  * ctrl_auto:
  * @conf:	configuration object to work on
  *
- * Iterates over the appropriate directory and finds the
+ * Iterates over the controllers of the backend and finds the
  * controller with the highest max brightness. Stores the
  * name of the controller and the max brightness value in
  * the configuration object
@@ -55,19 +261,23 @@ char *ctrl_iter_next(DIR * dir)
 bool ctrl_auto(struct light_conf *conf)
 {
 	char *next, *prev;
-	burn_dir dir = opendir(conf->sys_prefix);
+	struct timespec t0, t1;
+	burn_iter iter;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 
-	if (!dir) {
-		vlog_err("opendir: %m");
+	if (!(iter = ctrl_iter_new(conf)) ||
+	    !ctrl_iter_fetch(iter, conf, LIGHT_MAX_BRIGHTNESS))
 		return false;
-	}
 
-	while ((next = ctrl_iter_next(dir))) {
-		int64_t max = 0;
+	while ((next = ctrl_iter_next(iter))) {
+		int64_t max = ctrl_iter_value(iter, LIGHT_MAX_BRIGHTNESS);
 		prev = conf->ctrl;
 		conf->ctrl = next;
 
-		if ((max = light_fetch(conf, LIGHT_MAX_BRIGHTNESS)) > 0) {
+		PROBE2(ctrl_found, next, max);
+
+		if (max > 0) {
 			if (max > conf->cached_max) {
 				vlog_debug("found (better) controller '%s'", next);
 				conf->cached_max = max;
@@ -86,6 +296,10 @@ bool ctrl_auto(struct light_conf *conf)
 		free(next);
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	METRICS_OBSERVE(METRICS_DISCOVERY, (int64_t) (t1.tv_sec - t0.tv_sec) * 1000000 +
+			(t1.tv_nsec - t0.tv_nsec) / 1000);
+
 	if (conf->ctrl) {
 		vlog_notice("automatically chose controller: '%s'", conf->ctrl);
 		return true;
@@ -3,12 +3,27 @@
 #ifndef CTRL_H
 #define CTRL_H
 
-#include <dirent.h>
-
 #include "light.h"
+#include "backend.h"
+
+/* controllers that passed the filters, with the fields fetched for them */
+struct ctrl_iter {
+	char **names;
+	size_t num;
+	size_t pos;
+	int64_t *max;
+	int64_t *val;
+};
 
-char *ctrl_iter_next(DIR * dir)
+struct ctrl_iter *ctrl_iter_new(struct light_conf *conf)
 	__attribute__ ((warn_unused_result));
+void ctrl_iter_free(struct ctrl_iter **iter);
+char *ctrl_iter_next(struct ctrl_iter *iter)
+	__attribute__ ((warn_unused_result));
+bool ctrl_iter_fetch(struct ctrl_iter *iter, struct light_conf *conf, LIGHT_FIELD field);
+int64_t ctrl_iter_value(struct ctrl_iter *iter, LIGHT_FIELD field);
+
+#define burn_iter __attribute__((cleanup(ctrl_iter_free))) struct ctrl_iter *
 bool ctrl_auto(struct light_conf *conf)
 	__attribute__ ((warn_unused_result));
 
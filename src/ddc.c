@@ -0,0 +1,879 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+/* for cfmakeraw(), flock() and ioctl() */
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/i2c-dev.h>
+#include <dirent.h>
+#include <termios.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "file.h"
+#include "light.h"
+#include "backend.h"
+#include "clk.h"
+#include "metrics.h"
+
+/*
+ * External monitors, reached over DDC/CI on the i2c buses in /dev, next to
+ * the controllers in sysfs. A monitor is named after its bus, such as
+ * i2c-4, and its brightness is VCP feature 0x10. Options:
+ *
+ *	ddc:dev=/dev,bus=4/7,root=...,cache=...,io=...
+ *
+ * dev:		directory holding the i2c-<n> devices
+ * bus:		'/' separated buses to consider, every bus if unset
+ *
+ * Every other option is passed to the sysfs backend. A device that is a
+ * terminal instead of an i2c adapter is talked to as a byte stream, which
+ * is how an emulated monitor behind a pty is reached.
+ *
+ * The monitor has to be left alone for 40 ms before its reply is read,
+ * and for 50 ms after every command, so the maximum and the last value are
+ * kept in <cache>/<target>.<ctrl>.vcp, and are shared by every process:
+ *
+ * - reads return the last value for DDC_CUR_MSEC, or as long as a value is
+ *   waiting to be sent, and the maximum for DDC_MAX_MSEC
+ * - a write that comes before the monitor is ready is queued, and a single
+ *   process, forked by the first of them, sends the latest queued value as
+ *   soon as the monitor is ready
+ *
+ * so that a burst of key presses, or the steps of a fade, only send the
+ * value that is current by the time the monitor takes it. The fd handed out
+ * by open() is of <cache>/<target>.<ctrl>.vcp.lock, which only carries the
+ * lock of the caller: every value goes through write().
+ */
+
+#define DDC_ADDR 0x37
+/* addresses of the monitor and the host, for the checksums */
+#define DDC_DEST 0x6e
+#define DDC_HOST 0x50
+#define DDC_SRC 0x51
+#define DDC_VCP_BRIGHTNESS 0x10
+#define DDC_OP_GET 0x01
+#define DDC_OP_REPLY 0x02
+#define DDC_OP_SET 0x03
+#define DDC_REPLY_LEN 11
+
+/* the monitor takes this long to prepare a reply */
+#define DDC_REPLY_NSEC 40000000
+/* and this long after every command before the next */
+#define DDC_GAP_NSEC 50000000
+/* a reply that is not there by now will not come */
+#define DDC_TIMEOUT_MSEC 200
+#define DDC_TRIES 3
+
+/* the value a monitor is at is trusted this long, it may be moved by hand */
+#define DDC_CUR_MSEC 5000
+/* and the maximum, or that a bus has no monitor, this long */
+#define DDC_MAX_MSEC 86400000
+
+#define DDC_MAGIC 0x31636464
+#define DDC_MONS_MAX 16
+#define DDC_BUSES_MAX 16
+
+struct ddc_state {
+	uint32_t magic;
+	/* set while a forked process is to send the queued value */
+	uint32_t flusher;
+	/* raw maximum, 0 if the bus has no monitor, -1 if unknown */
+	int64_t max;
+	int64_t max_at;
+	/* value last sent or queued, -1 if unknown */
+	int64_t cur;
+	int64_t cur_at;
+	/* monotonic time the monitor takes the next command at */
+	int64_t ready;
+	/* values queued and the last of them sent */
+	uint64_t seq;
+	uint64_t sent;
+	int64_t pending;
+};
+
+struct ddc_mon {
+	char *name;
+	char *dev;
+	char *state_path;
+	/* kept open for flock(), which goes with the open file */
+	int state_fd;
+	/* handed out by open() and locked by the caller, which is all it is for */
+	char *lock_path;
+	int fd;
+	struct ddc_state st;
+};
+
+static struct {
+	char *dev;
+	int buses[DDC_BUSES_MAX];
+	size_t num_buses;
+	struct ddc_mon mons[DDC_MONS_MAX];
+	size_t num_mons;
+} ddc;
+
+struct ddc_iter {
+	struct light_conf *conf;
+	void *sys;
+	DIR *dev;
+};
+
+/**
+ * ddc_mono:
+ *
+ * Returns: monotonic time in nanoseconds
+ **/
+static int64_t ddc_mono(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * ddc_wall:
+ *
+ * Returns: wall clock time in milliseconds
+ **/
+static int64_t ddc_wall(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * ddc_sleep_until:
+ * @ns:		monotonic time in nanoseconds
+ **/
+static void ddc_sleep_until(int64_t ns)
+{
+	struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+	if (ns > ddc_mono())
+		clk_real.sleep_until(&ts);
+}
+
+/**
+ * ddc_load:
+ * @m:		monitor to load the shared state of, its lock held
+ **/
+static void ddc_load(struct ddc_mon *m)
+{
+	struct ddc_state st;
+	int64_t now = ddc_mono();
+
+	if (m->state_fd >= 0 && pread(m->state_fd, &st, sizeof(st), 0) == sizeof(st) &&
+	    st.magic == DDC_MAGIC)
+		m->st = st;
+	else if (m->st.magic != DDC_MAGIC)
+		m->st = (struct ddc_state) { .magic = DDC_MAGIC, .max = -1, .cur = -1 };
+
+	/* left behind before a reboot */
+	if (m->st.ready > now + DDC_GAP_NSEC) {
+		m->st.ready = now;
+		m->st.flusher = 0;
+	}
+}
+
+/**
+ * ddc_store:
+ * @m:		monitor to store the shared state of, its lock held
+ **/
+static void ddc_store(struct ddc_mon *m)
+{
+	if (m->state_fd >= 0 && pwrite(m->state_fd, &m->st, sizeof(m->st), 0) != sizeof(m->st))
+		vlog_warning("write '%s': %m", m->state_path);
+}
+
+/**
+ * ddc_lock:
+ * @m:		monitor to lock the shared state of
+ * @lock:	true to lock it, false to unlock it
+ **/
+static void ddc_lock(struct ddc_mon *m, bool lock)
+{
+	while (m->state_fd >= 0 && flock(m->state_fd, lock ? LOCK_EX : LOCK_UN) < 0) {
+		if (errno != EINTR) {
+			vlog_warning("flock '%s': %m", m->state_path);
+			break;
+		}
+	}
+
+	if (lock)
+		ddc_load(m);
+}
+
+/**
+ * ddc_full:
+ * @fd:		bus to transfer through
+ * @buf:	bytes to write, or buffer to read into
+ * @len:	number of bytes
+ * @out:	true to write, false to read
+ *
+ * A stream may take several calls, where an i2c adapter takes one.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool ddc_full(int fd, uint8_t *buf, size_t len, bool out)
+{
+	struct pollfd pfd = { .fd = fd, .events = out ? POLLOUT : POLLIN };
+	ssize_t r;
+
+	while (len > 0) {
+		if (poll(&pfd, 1, DDC_TIMEOUT_MSEC) == 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+
+		if ((r = out ? write(fd, buf, len) : read(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		} else if (r == 0) {
+			errno = EIO;
+			return false;
+		}
+
+		buf += r;
+		len -= (size_t) r;
+	}
+
+	return true;
+}
+
+/**
+ * ddc_bus:
+ * @m:		monitor to open the bus of
+ *
+ * Returns: bus addressing the monitor, or -1 on failure
+ **/
+static int ddc_bus(struct ddc_mon *m)
+{
+	struct termios t;
+	int fd;
+
+	if ((fd = open(m->dev, O_RDWR | O_CLOEXEC | O_NOCTTY)) < 0) {
+		vlog_info("open '%s': %m", m->dev);
+		return -1;
+	}
+
+	if (ioctl(fd, I2C_SLAVE, DDC_ADDR) == 0)
+		return fd;
+
+	if (errno != ENOTTY || tcgetattr(fd, &t) < 0) {
+		vlog_info("ioctl '%s': %m", m->dev);
+		close(fd);
+		return -1;
+	}
+
+	/* an emulated monitor, which gets the bytes as they are */
+	cfmakeraw(&t);
+	tcsetattr(fd, TCSANOW, &t);
+	return fd;
+}
+
+/**
+ * ddc_send:
+ * @fd:		bus addressing the monitor
+ * @data:	payload of the message
+ * @len:	length of the payload
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool ddc_send(int fd, const uint8_t *data, size_t len)
+{
+	uint8_t msg[8] = { DDC_SRC, 0x80 | (uint8_t) len };
+	uint8_t sum = DDC_DEST ^ msg[0] ^ msg[1];
+
+	for (size_t i = 0; i < len; i++)
+		sum ^= msg[2 + i] = data[i];
+
+	msg[2 + len] = sum;
+
+	return ddc_full(fd, msg, len + 3, true);
+}
+
+/**
+ * ddc_get:
+ * @m:		monitor to read, its lock held
+ *
+ * Reads the maximum and the value of the brightness.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool ddc_get(struct ddc_mon *m)
+{
+	const uint8_t req[] = { DDC_OP_GET, DDC_VCP_BRIGHTNESS };
+	uint8_t r[DDC_REPLY_LEN], sum;
+	int tries = 0, fd;
+
+	if ((fd = ddc_bus(m)) < 0)
+		return false;
+
+	while (tries++ < DDC_TRIES) {
+		ddc_sleep_until(m->st.ready);
+
+		if (!ddc_send(fd, req, sizeof(req))) {
+			vlog_info("write '%s': %m", m->dev);
+			m->st.ready = ddc_mono() + DDC_GAP_NSEC;
+			continue;
+		}
+
+		ddc_sleep_until(ddc_mono() + DDC_REPLY_NSEC);
+
+		if (!ddc_full(fd, r, sizeof(r), false)) {
+			vlog_info("read '%s': %m", m->dev);
+			m->st.ready = ddc_mono() + DDC_GAP_NSEC;
+			continue;
+		}
+
+		m->st.ready = ddc_mono() + DDC_GAP_NSEC;
+
+		sum = DDC_HOST;
+		for (size_t i = 0; i < sizeof(r) - 1; i++)
+			sum ^= r[i];
+
+		/* a busy monitor answers with an empty message */
+		if (r[1] == 0x80 || sum != r[sizeof(r) - 1] || r[1] != 0x88 ||
+		    r[2] != DDC_OP_REPLY || r[4] != DDC_VCP_BRIGHTNESS) {
+			vlog_info("'%s': bad reply", m->dev);
+			continue;
+		}
+
+		close(fd);
+
+		if (r[3] != 0) {
+			vlog_info("'%s' has no brightness", m->dev);
+			return false;
+		}
+
+		m->st.max = r[6] << 8 | r[7];
+		m->st.cur = r[8] << 8 | r[9];
+		m->st.max_at = m->st.cur_at = ddc_wall();
+		return true;
+	}
+
+	close(fd);
+	return false;
+}
+
+/**
+ * ddc_set:
+ * @m:		monitor to write, its lock held
+ * @val:	raw brightness
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool ddc_set(struct ddc_mon *m, int64_t val)
+{
+	const uint8_t req[] = {
+		DDC_OP_SET, DDC_VCP_BRIGHTNESS, (uint8_t) (val >> 8), (uint8_t) val
+	};
+	bool ok = false;
+	int tries = 0, fd;
+
+	if ((fd = ddc_bus(m)) < 0)
+		return false;
+
+	/* a set is not acknowledged, only a failed transfer is retried */
+	while (!ok && tries++ < DDC_TRIES) {
+		ddc_sleep_until(m->st.ready);
+
+		if (!(ok = ddc_send(fd, req, sizeof(req))))
+			vlog_info("write '%s': %m", m->dev);
+
+		m->st.ready = ddc_mono() + DDC_GAP_NSEC;
+	}
+
+	close(fd);
+
+	if (ok)
+		METRICS_COUNT(METRICS_WRITES);
+	else
+		METRICS_COUNT(METRICS_WRITE_ERRORS);
+
+	return ok;
+}
+
+/**
+ * ddc_is_mon:
+ * @conf:	configuration object
+ * @ctrl:	name of the controller
+ *
+ * Returns: true if the name is that of a monitor this backend handles
+ **/
+static bool ddc_is_mon(struct light_conf *conf, const char *ctrl)
+{
+	int bus, n = -1;
+
+	if (conf->target != LIGHT_BACKLIGHT || !ctrl ||
+	    sscanf(ctrl, "i2c-%d%n", &bus, &n) != 1 || ctrl[n] != '\0' || bus < 0)
+		return false;
+
+	if (ddc.num_buses == 0)
+		return true;
+
+	for (size_t i = 0; i < ddc.num_buses; i++)
+		if (ddc.buses[i] == bus)
+			return true;
+
+	return false;
+}
+
+/**
+ * ddc_mon:
+ * @conf:	configuration object holding the cache prefix
+ * @ctrl:	name of the monitor
+ *
+ * Returns: the monitor, set up on first use, or NULL on failure
+ **/
+static struct ddc_mon *ddc_mon(struct light_conf *conf, const char *ctrl)
+{
+	struct ddc_mon *m;
+	char *p;
+
+	for (size_t i = 0; i < ddc.num_mons; i++)
+		if (strcmp(ddc.mons[i].name, ctrl) == 0)
+			return &ddc.mons[i];
+
+	if (ddc.num_mons >= DDC_MONS_MAX) {
+		vlog_err("ddc: too many monitors");
+		return NULL;
+	}
+
+	m = memset(&ddc.mons[ddc.num_mons], 0, sizeof(*m));
+	m->state_fd = -1;
+	m->fd = -1;
+
+	if (!(m->name = strdup(ctrl)) || !(p = path_new()) ||
+	    !(m->dev = path_append(p, "%s/%s", ddc.dev ? ddc.dev : "/dev", ctrl))) {
+		vlog_err("ddc: out of memory");
+		free(m->name);
+		return NULL;
+	}
+
+	/* without a cache, as when listing, every process asks the monitor */
+	if (conf->cache_prefix && (p = path_new()) &&
+	    (m->state_path = path_append(p, "%s.%s.vcp", conf->cache_prefix, ctrl)) &&
+	    (m->state_fd = open(m->state_path, O_RDWR | O_CREAT | O_CLOEXEC,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+		vlog_warning("open '%s': %m", m->state_path);
+
+	if (m->state_path && (p = path_new()))
+		m->lock_path = path_append(p, "%s.lock", m->state_path);
+
+	ddc.num_mons++;
+	ddc_lock(m, true);
+	ddc_lock(m, false);
+	return m;
+}
+
+/**
+ * ddc_mon_fd:
+ * @fd:		fd handed out by open()
+ *
+ * Returns: the monitor the fd was handed out for, or NULL
+ **/
+static struct ddc_mon *ddc_mon_fd(int fd)
+{
+	for (size_t i = 0; i < ddc.num_mons; i++)
+		if (fd >= 0 && ddc.mons[i].fd == fd)
+			return &ddc.mons[i];
+
+	return NULL;
+}
+
+/**
+ * ddc_value:
+ * @m:		monitor to read
+ * @field:	LIGHT_BRIGHTNESS or LIGHT_MAX_BRIGHTNESS
+ *
+ * Returns: the field, from the cache if it is fresh, or -errno on failure
+ **/
+static int64_t ddc_value(struct ddc_mon *m, LIGHT_FIELD field)
+{
+	int64_t now = ddc_wall(), val = -EIO;
+	struct ddc_state *st = &m->st;
+
+	ddc_lock(m, true);
+
+	if (field == LIGHT_MAX_BRIGHTNESS && st->max >= 0 && now - st->max_at < DDC_MAX_MSEC)
+		val = st->max > 0 ? st->max : -ENODEV;
+	else if (field == LIGHT_BRIGHTNESS && st->cur >= 0 &&
+		 (st->seq != st->sent || now - st->cur_at < DDC_CUR_MSEC))
+		val = st->cur;
+	else if (ddc_get(m))
+		val = field == LIGHT_MAX_BRIGHTNESS ? st->max : st->cur;
+	else if (field == LIGHT_MAX_BRIGHTNESS && st->max < 0)
+		/* remembered, so that buses without a monitor are not asked again */
+		st->max = 0, st->max_at = now, val = -ENODEV;
+
+	ddc_store(m);
+	ddc_lock(m, false);
+	return val;
+}
+
+/**
+ * ddc_flush:
+ * @m:		monitor to send the queued values to
+ *
+ * Runs in a process of its own, which sends the latest queued value
+ * whenever the monitor is ready, until no value is left.
+ **/
+static void ddc_flush(struct ddc_mon *m)
+{
+	uint64_t seq;
+
+	/* a lock of its own, the one of the parent is shared with it */
+	close(m->state_fd);
+
+	if ((m->state_fd = open(m->state_path, O_RDWR | O_CLOEXEC)) < 0)
+		_exit(EXIT_FAILURE);
+
+	for (;;) {
+		ddc_lock(m, true);
+
+		if (m->st.sent == m->st.seq)
+			break;
+
+		if (m->st.ready > ddc_mono()) {
+			ddc_lock(m, false);
+			ddc_sleep_until(m->st.ready);
+			continue;
+		}
+
+		seq = m->st.seq;
+		vlog_debug("ddc: sending %" PRId64 " to '%s'", m->st.pending, m->name);
+
+		/* the value the monitor is at is unknown after a failure */
+		if (!ddc_set(m, m->st.pending))
+			m->st.cur_at = 0;
+
+		m->st.sent = seq;
+		ddc_store(m);
+		ddc_lock(m, false);
+	}
+
+	m->st.flusher = 0;
+	ddc_store(m);
+	ddc_lock(m, false);
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * ddc_defer:
+ * @m:		monitor with a queued value, its lock held
+ *
+ * Hands the queued value over to a double forked process, which
+ * sends it once the monitor is ready.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool ddc_defer(struct ddc_mon *m)
+{
+	int status;
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		vlog_err("fork: %m");
+		return false;
+	}
+
+	if (pid == 0) {
+		if ((pid = fork()) != 0)
+			_exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+		ddc_flush(m);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != EXIT_SUCCESS) {
+		vlog_err("ddc: could not queue a value for '%s'", m->name);
+		return false;
+	}
+
+	m->st.flusher = 1;
+	return true;
+}
+
+/**
+ * ddc_parse:
+ * @opts:	comma separated key=value options
+ * @rest:	where to store the options of the sysfs backend
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool ddc_parse(const char *opts, char *rest)
+{
+	while (*opts) {
+		size_t len = strcspn(opts, ",");
+		int n;
+
+		if (strncmp(opts, "dev=", 4) == 0) {
+			free(ddc.dev);
+			if (!(ddc.dev = strndup(opts + 4, len - 4))) {
+				vlog_err("strndup: %m");
+				return false;
+			}
+		} else if (strncmp(opts, "bus=", 4) == 0) {
+			const char *s = opts + 4;
+
+			for (ddc.num_buses = 0; ddc.num_buses < DDC_BUSES_MAX; s += n + 1) {
+				if (sscanf(s, "%d%n", &ddc.buses[ddc.num_buses++], &n) != 1) {
+					vlog_err("ddc: bad value for 'bus'");
+					return false;
+				}
+				if (s[n] != '/')
+					break;
+			}
+		} else {
+			strncat(rest, opts, len + 1);
+		}
+
+		opts += len;
+		if (*opts == ',')
+			opts++;
+	}
+
+	return true;
+}
+
+static bool ddc_init(struct light_conf *conf, const char *opts)
+{
+	burn_o char *rest = calloc(1, strlen(opts) + 2);
+
+	if (!rest) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	return ddc_parse(opts, rest) && backend_sysfs.init(conf, rest);
+}
+
+static void *ddc_iter_new(struct light_conf *conf)
+{
+	struct ddc_iter *it = calloc(1, sizeof(*it));
+
+	if (!it) {
+		vlog_err("calloc: %m");
+		return NULL;
+	}
+
+	it->conf = conf;
+
+	if (!(it->sys = backend_sysfs.iter_new(conf))) {
+		free(it);
+		return NULL;
+	}
+
+	/* a system without i2c devices has no monitors */
+	if (conf->target == LIGHT_BACKLIGHT)
+		it->dev = opendir(ddc.dev ? ddc.dev : "/dev");
+
+	return it;
+}
+
+/**
+ * ddc_adapter:
+ * @conf:	configuration object holding the sysfs root
+ * @bus:	name of the bus
+ *
+ * Returns: true unless the adapter of the bus is known not to reach displays
+ **/
+static bool ddc_adapter(struct light_conf *conf, const char *bus)
+{
+	char path[PATH_MAX], name[32];
+	burn_file file = NULL;
+
+	snprintf(path, sizeof(path), "%s/i2c-dev/%s/name",
+			conf->sys_root ? conf->sys_root : "/sys/class", bus);
+
+	if (!(file = fopen(path, "r")) || !fgets(name, sizeof(name), file))
+		/* cppcheck-suppress resourceLeak */
+		return true;
+
+	/* such as memory modules and sensors */
+	/* cppcheck-suppress resourceLeak */
+	return strncmp(name, "SMBus", 5) != 0;
+}
+
+static char *ddc_iter_next(void *iter)
+{
+	struct ddc_iter *it = iter;
+	struct dirent *ent;
+	struct ddc_mon *m;
+	char *c;
+
+	if ((c = backend_sysfs.iter_next(it->sys)))
+		return c;
+
+	while (it->dev && (ent = readdir(it->dev))) {
+		if (!ddc_is_mon(it->conf, ent->d_name) || !ddc_adapter(it->conf, ent->d_name))
+			continue;
+
+		if ((m = ddc_mon(it->conf, ent->d_name)) &&
+		    ddc_value(m, LIGHT_MAX_BRIGHTNESS) > 0)
+			return strdup(ent->d_name);
+	}
+
+	return NULL;
+}
+
+static void ddc_iter_free(void *iter)
+{
+	struct ddc_iter *it = iter;
+
+	backend_sysfs.iter_free(it->sys);
+	if (it->dev)
+		closedir(it->dev);
+	free(it);
+}
+
+static int64_t ddc_read(struct light_conf *conf, const char *ctrl, LIGHT_FIELD field)
+{
+	struct ddc_mon *m;
+
+	if (!ddc_is_mon(conf, ctrl))
+		return backend_sysfs.read(conf, ctrl, field);
+
+	if (!(m = ddc_mon(conf, ctrl)))
+		return -ENOMEM;
+
+	return ddc_value(m, field);
+}
+
+static int ddc_open(struct light_conf *conf, const char *ctrl)
+{
+	struct ddc_mon *m;
+
+	if (!ddc_is_mon(conf, ctrl))
+		return backend_sysfs.open(conf, ctrl);
+
+	if (!(m = ddc_mon(conf, ctrl)))
+		return -1;
+
+	/* the callers lock a file of their own rather than the shared state,
+	 * so that a value written to it as text can not clobber the state */
+	if (!m->lock_path) {
+		vlog_err("ddc: '%s' needs a cache directory", ctrl);
+		return -1;
+	}
+
+	/* an fd handed out earlier has been closed, if it is handed out again */
+	for (size_t i = 0; i < ddc.num_mons; i++)
+		if (ddc.mons[i].fd >= 0 && fcntl(ddc.mons[i].fd, F_GETFD) < 0)
+			ddc.mons[i].fd = -1;
+
+	if ((m->fd = file_open(m->lock_path, O_RDWR)) < 0)
+		return -1;
+
+	for (size_t i = 0; i < ddc.num_mons; i++)
+		if (&ddc.mons[i] != m && ddc.mons[i].fd == m->fd)
+			ddc.mons[i].fd = -1;
+
+	return m->fd;
+}
+
+static bool ddc_write(int fd, int64_t val)
+{
+	struct ddc_mon *m = ddc_mon_fd(fd);
+	bool ok = true;
+
+	if (!m)
+		return file_rewrite(fd, val);
+
+	ddc_lock(m, true);
+
+	if (val < 0 || (m->st.max > 0 && val > m->st.max)) {
+		vlog_err("ddc: invalid write");
+		ddc_lock(m, false);
+		return false;
+	}
+
+	m->st.pending = val;
+	m->st.cur = val;
+	m->st.cur_at = ddc_wall();
+	m->st.seq++;
+
+	/* queued behind a value that is sent as soon as the monitor is ready */
+	if (m->st.flusher && m->st.ready + DDC_GAP_NSEC > ddc_mono()) {
+		vlog_debug("ddc: %" PRId64 " queued for '%s'", val, m->name);
+	} else if (m->st.ready > ddc_mono() && m->state_fd >= 0 && ddc_defer(m)) {
+		vlog_debug("ddc: %" PRId64 " deferred for '%s'", val, m->name);
+	} else {
+		m->st.flusher = 0;
+		if (!(ok = ddc_set(m, val)))
+			m->st.cur_at = 0;
+		m->st.sent = m->st.seq;
+	}
+
+	ddc_store(m);
+	ddc_lock(m, false);
+	return ok;
+}
+
+static int64_t ddc_read_fd(int fd)
+{
+	struct ddc_mon *m = ddc_mon_fd(fd);
+
+	return m ? ddc_value(m, LIGHT_BRIGHTNESS) : file_read_fd(fd);
+}
+
+static int64_t ddc_read_actual(struct light_conf *conf, const char *ctrl)
+{
+	/* a monitor applies the value it was sent */
+	if (ddc_is_mon(conf, ctrl))
+		return -ENOENT;
+
+	return backend_sysfs.read_actual(conf, ctrl);
+}
+
+static int ddc_notify(struct light_conf *conf, const char *ctrl)
+{
+	if (ddc_is_mon(conf, ctrl))
+		return -1;
+
+	return backend_sysfs.notify(conf, ctrl);
+}
+
+static int ddc_open_color(struct light_conf *conf, const char *ctrl)
+{
+	if (ddc_is_mon(conf, ctrl))
+		return -1;
+
+	return backend_sysfs.open_color(conf, ctrl);
+}
+
+static bool ddc_write_color(int fd, const uint16_t rgb[3])
+{
+	return backend_sysfs.write_color(fd, rgb);
+}
+
+const struct backend backend_ddc = {
+	.name = "ddc",
+	.init = ddc_init,
+	.iter_new = ddc_iter_new,
+	.iter_next = ddc_iter_next,
+	.iter_free = ddc_iter_free,
+	.read = ddc_read,
+	.open = ddc_open,
+	.write = ddc_write,
+	.read_fd = ddc_read_fd,
+	.read_actual = ddc_read_actual,
+	.notify = ddc_notify,
+	.open_color = ddc_open_color,
+	.write_color = ddc_write_color,
+};
@@ -0,0 +1,318 @@
+/* SPDX-License-Identifier: 0BSD */
+
+/* for cfmakeraw() and mkdtemp() */
+#define _DEFAULT_SOURCE
+
+/*
+ * Runs the ddc backend against a monitor emulated behind a pty, which
+ * stands in for /dev/i2c-7. The monitor answers brightness requests and
+ * notes when every command came in. Checks that the monitor is listed
+ * and read, that a burst of increments and a fade only send some of
+ * their values but end up at the last one, and that the commands are
+ * at least DDC_GAP_MSEC apart but not much more when they queue up.
+ * Then checks that a scene and a sequence, which write through the fd
+ * they were handed by open(), reach the monitor and leave it readable.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_BUS "i2c-7"
+#define TEST_MAX 100
+#define TEST_INIT 50
+#define TEST_BURST 10
+#define TEST_FADE_MSEC 300
+#define TEST_CMDS_MAX 256
+/* the gap the backend keeps, and how far off it may be seen */
+#define DDC_GAP_MSEC 50
+#define TEST_EARLY_MSEC 2
+#define TEST_LATE_MSEC 25
+
+struct cmd {
+	int64_t usec;
+	int set;
+	int val;
+};
+
+static const char *bin;
+static char dir[] = "/tmp/brillo-ddc-XXXXXX";
+static char spec[512];
+static int fails;
+
+static int64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void pause_msec(int msec)
+{
+	struct timespec ts = { msec / 1000, (msec % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+}
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "ddc: %s\n", what);
+	fails++;
+}
+
+/* answers the requests of the host, logging them to a file */
+static void emulate(int master, const char *log)
+{
+	uint8_t msg[16], reply[11], sum;
+	int cur = TEST_INIT, out = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	size_t len = 0;
+
+	if (out < 0)
+		_exit(EXIT_FAILURE);
+
+	for (;;) {
+		ssize_t r = read(master, msg + len, 1);
+
+		if (r <= 0) {
+			pause_msec(1);
+			continue;
+		}
+
+		/* resynchronize on the source address */
+		if (len == 0 && msg[0] != 0x51)
+			continue;
+
+		if (++len < 2 || len < (size_t) (msg[1] & 0x7f) + 3)
+			continue;
+
+		sum = 0x6e;
+		for (size_t i = 0; i < len - 1; i++)
+			sum ^= msg[i];
+
+		if (sum != msg[len - 1]) {
+			dprintf(out, "%" PRId64 " bad\n", now_usec());
+		} else if (msg[2] == 0x01 && msg[3] == 0x10) {
+			dprintf(out, "%" PRId64 " get\n", now_usec());
+			memcpy(reply, (uint8_t[]) { 0x6e, 0x88, 0x02, 0x00, 0x10, 0x00,
+					0, TEST_MAX, (uint8_t) (cur >> 8), (uint8_t) cur, 0x50 },
+					sizeof(reply));
+			for (size_t i = 0; i < sizeof(reply) - 1; i++)
+				reply[sizeof(reply) - 1] ^= reply[i];
+			if (write(master, reply, sizeof(reply)) != sizeof(reply))
+				_exit(EXIT_FAILURE);
+		} else if (msg[2] == 0x03 && msg[3] == 0x10) {
+			cur = msg[4] << 8 | msg[5];
+			dprintf(out, "%" PRId64 " set %d\n", now_usec(), cur);
+		}
+
+		len = 0;
+	}
+}
+
+/* runs brillo with the backend and the arguments, its output in out */
+static int run(char *out, size_t size, ...)
+{
+	char *argv[16] = { (char *) bin, "-B", spec, "-s", TEST_BUS };
+	int p[2], status, argc = 5;
+	ssize_t r = 0, n;
+	va_list ap;
+	pid_t pid;
+
+	va_start(ap, size);
+	while (argc < 15 && (argv[argc] = va_arg(ap, char *)))
+		argc++;
+	va_end(ap);
+
+	if (pipe(p) < 0 || (pid = fork()) < 0)
+		return -1;
+
+	if (pid == 0) {
+		dup2(p[1], STDOUT_FILENO);
+		close(p[0]);
+		close(p[1]);
+		execv(bin, argv);
+		_exit(127);
+	}
+
+	close(p[1]);
+
+	/* a process sending queued values holds on to the pipe */
+	while (out && (size_t) r < size - 1 && (n = read(p[0], out + r, size - 1 - (size_t) r)) > 0)
+		r += n;
+
+	if (out)
+		out[r] = '\0';
+
+	close(p[0]);
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* reads the commands the monitor got */
+static size_t commands(const char *log, struct cmd *cmds)
+{
+	char word[8];
+	size_t num = 0;
+	FILE *file = fopen(log, "r");
+
+	while (file && num < TEST_CMDS_MAX &&
+	       fscanf(file, "%" SCNd64 " %7s", &cmds[num].usec, word) == 2) {
+		cmds[num].set = strcmp(word, "set") == 0;
+		if (cmds[num].set && fscanf(file, "%d", &cmds[num].val) != 1)
+			break;
+		if (strcmp(word, "bad") == 0)
+			fail("bad checksum");
+		num++;
+	}
+
+	if (file)
+		fclose(file);
+
+	return num;
+}
+
+int main(int argc, char **argv)
+{
+	char path[256], log[256], out[256], *pts;
+	struct cmd cmds[TEST_CMDS_MAX], more[TEST_CMDS_MAX];
+	struct termios t;
+	size_t num, burst, fade, scene, seq, sets[2] = { 0 };
+	int64_t gap, min = INT64_MAX, late = 0;
+	int master, slave, last[2] = { -1, -1 };
+	pid_t emu;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s BRILLO\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	bin = argv[1];
+
+	if (!mkdtemp(dir) || (master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+	    grantpt(master) < 0 || unlockpt(master) < 0 || !(pts = ptsname(master)) ||
+	    (slave = open(pts, O_RDWR | O_NOCTTY)) < 0 || tcgetattr(slave, &t) < 0) {
+		perror("ddc: setup");
+		return EXIT_FAILURE;
+	}
+
+	/* the slave stays open, so the pty outlives every host */
+	cfmakeraw(&t);
+	tcsetattr(slave, TCSANOW, &t);
+
+	snprintf(path, sizeof(path), "%s/dev", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/dev/" TEST_BUS, dir);
+	if (symlink(pts, path) < 0) {
+		perror("ddc: symlink");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(path, sizeof(path), "%s/sys", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/sys/backlight", dir);
+	mkdir(path, 0755);
+	snprintf(log, sizeof(log), "%s/log", dir);
+	snprintf(spec, sizeof(spec), "ddc:dev=%s/dev,root=%s/sys,cache=%s/cache", dir, dir, dir);
+
+	if ((emu = fork()) == 0)
+		emulate(master, log);
+
+	if (run(out, sizeof(out), "-L", NULL) != 0 || strcmp(out, TEST_BUS "\n") != 0)
+		fail("monitor not listed");
+
+	if (run(out, sizeof(out), "-G", "-r", NULL) != 0 || atoi(out) != TEST_INIT)
+		fail("brightness not read");
+
+	run(NULL, 0, "-S", "80", "-r", NULL);
+	if (run(out, sizeof(out), "-G", "-r", NULL) != 0 || atoi(out) != 80)
+		fail("brightness not cached");
+
+	pause_msec(4 * DDC_GAP_MSEC);
+	burst = commands(log, cmds);
+
+	for (int i = 0; i < TEST_BURST; i++)
+		run(NULL, 0, "-A", "1", "-r", NULL);
+
+	pause_msec(4 * DDC_GAP_MSEC);
+	fade = commands(log, cmds);
+
+	run(NULL, 0, "-u", "300000", "-S", "20", "-r", NULL);
+	pause_msec(4 * DDC_GAP_MSEC);
+	num = commands(log, cmds);
+
+	/* a scene captured at one value and applied from another */
+	run(NULL, 0, "-S", "40", "-r", NULL);
+	run(NULL, 0, "-r", "-N", "ddc", NULL);
+	run(NULL, 0, "-S", "70", "-r", NULL);
+	run(NULL, 0, "-u", "100000", "-n", "ddc", NULL);
+	pause_msec(4 * DDC_GAP_MSEC);
+	scene = commands(log, more);
+
+	if (scene == 0 || !more[scene - 1].set || more[scene - 1].val != 40)
+		fail("scene not sent");
+	if (run(out, sizeof(out), "-G", "-r", NULL) != 0 || atoi(out) != 40)
+		fail("scene not read back");
+
+	run(NULL, 0, "-r", "-Q", "10:0,25:100000", NULL);
+	pause_msec(4 * DDC_GAP_MSEC);
+	seq = commands(log, more);
+
+	if (seq <= scene || !more[seq - 1].set || more[seq - 1].val != 25)
+		fail("sequence not sent");
+	if (run(out, sizeof(out), "-G", "-r", NULL) != 0 || atoi(out) != 25)
+		fail("sequence not read back");
+
+	kill(emu, SIGTERM);
+	waitpid(emu, NULL, 0);
+
+	if (burst == 0 || !cmds[burst - 1].set || cmds[burst - 1].val != 80)
+		fail("value not sent");
+
+	for (size_t i = 1; i < num; i++) {
+		gap = cmds[i].usec - cmds[i - 1].usec;
+		if (gap < min)
+			min = gap;
+		/* sent back to back, a queued value should not wait much longer */
+		if (i > burst && i != fade && cmds[i].set && cmds[i - 1].set && gap > late)
+			late = gap;
+	}
+
+	for (size_t i = burst; i < num; i++) {
+		if (cmds[i].set) {
+			sets[i >= fade]++;
+			last[i >= fade] = cmds[i].val;
+		}
+	}
+
+	if (last[0] != 80 + TEST_BURST || sets[0] >= TEST_BURST)
+		fail("burst not coalesced");
+	if (last[1] != 20 || sets[1] > TEST_FADE_MSEC / DDC_GAP_MSEC + 3)
+		fail("fade not coalesced");
+	if (min < (DDC_GAP_MSEC - TEST_EARLY_MSEC) * 1000)
+		fail("commands too close");
+	if (late > (DDC_GAP_MSEC + TEST_LATE_MSEC) * 1000)
+		fail("queued values waited too long");
+
+	printf("ddc: %zu commands, burst of %d in %zu, fade in %zu, "
+			"gaps from %.1f ms, queued up to %.1f ms, scene and sequence in %zu more\n",
+			num, TEST_BURST, sets[0], sets[1], min / 1000.0, late / 1000.0,
+			seq - num);
+
+	snprintf(path, sizeof(path), "rm -rf '%s'", dir);
+	if (system(path) != 0)
+		fail("cleanup");
+
+	return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -12,10 +12,23 @@
 #include "light.h"
 #include "value.h"
 #include "file.h"
+#include "backend.h"
+#include "fade.h"
+#include "pub.h"
+#include "scene.h"
+#include "frame.h"
+#include "meta.h"
+#include "level.h"
+#include "hist.h"
+#include "listen.h"
+#include "arb.h"
+#include "follow.h"
+#include "adapt.h"
+#include "policy.h"
+#include "persist.h"
+#include "seq.h"
 #include "exec.h"
 
-static int64_t exec_get_min(struct light_conf *conf);
-static bool exec_write(struct light_conf *conf, LIGHT_FIELD field, int64_t val_old, int64_t val_new);
 static bool exec_restore(struct light_conf *conf);
 
 /**
@@ -25,7 +38,7 @@ static bool exec_restore(struct light_conf *conf);
  *
  * Returns: negative value on failure, raw max value on success
  **/
-static int64_t exec_get_max(struct light_conf *conf)
+int64_t exec_get_max(struct light_conf *conf)
 {
 	if (conf->cached_max != 0)
 		return conf->cached_max;
@@ -33,19 +46,17 @@ static int64_t exec_get_max(struct light_conf *conf)
 }
 
 /**
- * exec_open:
- * @conf:	configuration object
- * @field:	field to access
- * @flags:	flags to pass to open
+ * exec_get_val:
  *
- * Opens a given field with the flags specified.
+ * Determines the brightness from cache, or by fetching it.
  *
- * Returns: an fd on success, negative value on failure
+ * Returns: negative value on failure, raw value on success
  **/
-static int exec_open(struct light_conf *conf, LIGHT_FIELD field, int flags)
+static int64_t exec_get_val(struct light_conf *conf)
 {
-	burn_o char *path = light_path_new(conf, field);
-	return path ? file_open(path, flags) : -1;
+	if (conf->cached_val >= 0)
+		return conf->cached_val;
+	return light_fetch(conf, LIGHT_BRIGHTNESS);
 }
 
 /**
@@ -66,7 +77,7 @@ static bool exec_get(struct light_conf *conf)
 
 	switch (conf->field) {
 	case LIGHT_BRIGHTNESS:
-		raw_val = light_fetch(conf, LIGHT_BRIGHTNESS);
+		raw_val = exec_get_val(conf);
 		break;
 	case LIGHT_MAX_BRIGHTNESS:
 		raw_val = max;
@@ -94,34 +105,145 @@ static bool exec_get(struct light_conf *conf)
 }
 
 /**
- * exec_set:
+ * exec_duration:
+ * @conf:	configuration object holding the rate
+ * @curr:	current raw value
+ * @next:	raw value to write
+ * @max:	raw maximum value
+ *
+ * Works out how long moving between the raw values takes at the
+ * requested rate, within the shortest and longest duration.
+ *
+ * Returns: duration in microseconds
+ **/
+int64_t exec_duration(struct light_conf *conf, int64_t curr, int64_t next,
+		int64_t max)
+{
+	LIGHT_VAL_MODE mode = conf->rate_mode;
+	int64_t dist, usec;
+
+	if (conf->rate <= 0)
+		return conf->usec;
+
+	/* there is no logarithm of zero, nor a scale to a maximum of one */
+	if (mode == LIGHT_PERCENT_EXPONENTIAL) {
+		if (max <= 1)
+			mode = LIGHT_PERCENT;
+		curr = curr < 1 ? 1 : curr;
+		next = next < 1 ? 1 : next;
+	}
+
+	dist = value_from_raw(mode, next, max) - value_from_raw(mode, curr, max);
+	usec = (dist < 0 ? -dist : dist) * 1000000 / conf->rate;
+
+	if (usec < conf->rate_min)
+		usec = conf->rate_min;
+	else if (usec > conf->rate_max)
+		usec = conf->rate_max;
+
+	vlog_info("fading over %" PRId64 " us", usec);
+	return usec;
+}
+
+/**
+ * exec_fade:
  * @conf:	configuration object to operate on
+ * @fd:		opened and locked fd of the field
+ * @start:	current raw value
+ * @end:	raw value to eventually write
+ * @max:	raw maximum value
  *
- * Sets the minimum cap or brightness value.
+ * Writes the new value through the backend, publishing every
+ * step of the brightness if the shared memory page exists. The
+ * end value is written once if the firmware ramps to it anyway.
  *
  * Returns: true on success, false on failure
  **/
-static bool exec_set(struct light_conf *conf)
+static bool exec_fade(struct light_conf *conf, int fd, int64_t start,
+		int64_t end, int64_t max)
 {
-	int64_t new_value, curr_value, new_raw, max, curr_raw = -1, mincap = 0;
-	burn_fd fd = exec_open(conf, conf->field, O_WRONLY);
+	bool ret;
+	struct pub pub;
+	bool brightness = conf->field == LIGHT_BRIGHTNESS;
+	bool publish = brightness && pub_attach(&pub, conf, max);
+	bool ramp = brightness && conf->ramp_usec > 0;
+	struct file_hooks hooks = {
+		.rewrite = brightness ? conf->backend->write : NULL,
+		.step = publish ? pub_step : NULL,
+		.data = &pub,
+		.levels = brightness ? conf->levels : NULL,
+		.num_levels = conf->num_levels,
+		.ramp = ramp,
+	};
+
+	if (conf->detach && conf->usec > 0 && !ramp)
+		ret = fade_detach(conf, fd, start, end, &hooks);
+	else
+		ret = file_write(fd, start, end, conf->usec, &hooks);
 
-	if (fd < 0)
-		return false;
+	if (ret && ramp && conf->settle && level_settle(conf) < 0)
+		ret = false;
 
-	if (conf->field == LIGHT_MIN_CAP)
-		curr_raw = exec_get_min(conf);
-	else
-		mincap = exec_get_min(conf);
+	if (publish)
+		pub_detach(&pub);
 
-	if (conf->field != LIGHT_MIN_CAP)
-		curr_raw = light_fetch(conf, conf->field);
+	return ret;
+}
 
-	if (curr_raw < 0)
-		return false;
+/**
+ * exec_snap:
+ * @conf:	configuration object holding the levels
+ * @curr:	current raw value
+ * @raw:	raw value asked for
+ * @mincap:	raw minimum cap
+ * @max:	raw maximum value
+ *
+ * Picks the level to write. Increments and decrements always move
+ * to another level, and the caps are rounded to levels.
+ *
+ * Returns: the raw value to write
+ **/
+static int64_t exec_snap(struct light_conf *conf, int64_t curr, int64_t raw,
+		int64_t mincap, int64_t max)
+{
+	const int64_t *lv = conf->levels;
+	size_t n = conf->num_levels;
+	size_t i = value_level(lv, n, curr);
+	size_t lo = value_level(lv, n, mincap);
+	size_t hi = value_level(lv, n, max);
+	int64_t next = value_snap(lv, n, raw);
+
+	if (lv[lo] < mincap && lo + 1 < n)
+		lo++;
+
+	if (conf->op_mode == LIGHT_ADD && next <= lv[i] && i + 1 < n)
+		next = lv[i + 1];
+	else if (conf->op_mode == LIGHT_SUB && next >= lv[i] && i > 0)
+		next = lv[i - 1];
+
+	return value_clamp(next, lv[lo], lv[hi]);
+}
 
-	if ((max = exec_get_max(conf)) < 0)
-		return false;
+/**
+ * exec_target:
+ * @conf:	configuration object holding the operation and value
+ * @curr_raw:	raw value the operation starts from
+ * @mincap:	raw minimum cap
+ * @max:	raw maximum value
+ *
+ * Works out the raw value that the operation moves to, between the
+ * minimum cap and the cap of a running policy.
+ *
+ * Returns: the raw value to write, or -1 on failure
+ **/
+int64_t exec_target(struct light_conf *conf, int64_t curr_raw, int64_t mincap,
+		int64_t max)
+{
+	int64_t new_value, curr_value, new_raw, cap = max;
+
+	/* a running policy lowers the ceiling, never below the minimum */
+	if (conf->field == LIGHT_BRIGHTNESS && (cap = policy_cap(conf, max)) < mincap)
+		cap = mincap;
 
 	new_value = conf->value;
 	curr_value = value_from_raw(conf->val_mode, curr_raw, max);
@@ -141,23 +263,173 @@ static bool exec_set(struct light_conf *conf)
 			new_value += curr_value;
 			break;
 		case LIGHT_SET:
+		case LIGHT_RESTORE:
 			break;
 		default:
-			return false;
+			return -1;
 		}
 	} else if (conf->field != LIGHT_MIN_CAP) {
-		return false;
+		return -1;
 	}
 
 	new_raw = value_to_raw(conf->val_mode, new_value, max);
 
+	/* calibrated controllers only take some values */
+	if (conf->field == LIGHT_BRIGHTNESS && level_load(conf, max))
+		return exec_snap(conf, curr_raw, new_raw, mincap, cap);
+
 	/* Force any increment to result in some change, however small */
 	if (conf->op_mode == LIGHT_ADD && new_raw <= curr_raw)
 		new_raw += 1;
 
-	new_raw = value_clamp(new_raw, mincap, max);
+	return value_clamp(new_raw, mincap, cap);
+}
+
+/**
+ * exec_plan:
+ * @conf:	configuration object to operate on
+ * @fd:		locked fd of the brightness, unused for the minimum cap
+ * @curr:	where to store the current raw value
+ * @next:	where to store the raw value to write
+ * @max:	where to store the raw maximum value
+ *
+ * Works out the raw value that sets the minimum cap or brightness.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool exec_plan(struct light_conf *conf, int fd, int64_t *curr,
+		int64_t *next, int64_t *max)
+{
+	int64_t curr_raw = -1, mincap = 0;
+
+	/* the current value is read through the locked fd, as opening
+	 * and closing the file again would release the lock */
+	if (conf->field == LIGHT_MIN_CAP) {
+		curr_raw = exec_get_min(conf);
+	} else {
+		mincap = exec_get_min(conf);
+		curr_raw = conf->backend->read_fd(fd);
+		level_load_ramp(conf);
+	}
+
+	if (curr_raw < 0)
+		return false;
+
+	if ((*max = exec_get_max(conf)) < 0)
+		return false;
+
+	*curr = curr_raw;
+	*next = exec_target(conf, curr_raw, mincap, *max);
+
+	return *next >= 0;
+}
+
+/**
+ * exec_prepare:
+ * @conf:	configuration object to operate on
+ * @curr:	where to store the current raw value
+ * @next:	where to store the raw value to write
+ * @max:	where to store the raw maximum value
+ *
+ * Opens and locks the field, and works out the raw value to write.
+ *
+ * Returns: locked fd on success, -1 on failure
+ **/
+int exec_prepare(struct light_conf *conf, int64_t *curr, int64_t *next,
+		int64_t *max)
+{
+	int fd;
+
+	/* a new detached request supersedes the running fade */
+	if (conf->detach && !fade_stop(conf))
+		return -1;
+
+	if ((fd = conf->backend->open(conf, conf->ctrl)) < 0)
+		return -1;
+
+	if (!exec_plan(conf, fd, curr, next, max)) {
+		file_close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * exec_set:
+ * @conf:	configuration object to operate on
+ *
+ * Sets the minimum cap or brightness value. A change that arbitration
+ * drops is no failure, it is reported in conf->dropped instead.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool exec_set(struct light_conf *conf)
+{
+	int64_t curr, next, max;
+	file_locked_fd fd = -1;
+
+	conf->dropped = false;
+
+	/* the minimum cap is kept in the metadata store */
+	if (conf->field == LIGHT_MIN_CAP)
+		return exec_plan(conf, -1, &curr, &next, &max) &&
+			meta_set(conf, LIGHT_MIN_CAP, next, max);
+
+	/* a dropped request leaves the controller alone */
+	if (!arb_allow(conf)) {
+		conf->dropped = true;
+		return true;
+	}
+
+	if ((fd = exec_prepare(conf, &curr, &next, &max)) < 0)
+		return false;
+
+	conf->usec = exec_duration(conf, curr, next, max);
 
-	return file_write(fd, curr_raw, new_raw, conf->usec);
+	if (!exec_fade(conf, fd, curr, next, max))
+		return false;
+
+	/* only a change that was made is recorded */
+	if (conf->field == LIGHT_BRIGHTNESS)
+		hist_append(conf, conf->op_mode, curr, next, max);
+
+	return true;
+}
+
+/**
+ * exec_all_fetch:
+ * @conf:	configuration object holding the operation
+ * @iter:	iterator over every selected controller
+ *
+ * Reads the attributes the operation needs of every controller at
+ * once, rather than one controller after another. Writes are left
+ * to each controller in turn, under its lock.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool exec_all_fetch(struct light_conf *conf, struct ctrl_iter *iter)
+{
+	switch (conf->op_mode) {
+	case LIGHT_GET:
+		if (conf->field == LIGHT_BRIGHTNESS &&
+		    !ctrl_iter_fetch(iter, conf, LIGHT_BRIGHTNESS))
+			return false;
+		break;
+	case LIGHT_SAVE:
+		if (!ctrl_iter_fetch(iter, conf, LIGHT_BRIGHTNESS))
+			return false;
+		break;
+	case LIGHT_SET:
+	case LIGHT_ADD:
+	case LIGHT_SUB:
+	case LIGHT_RESTORE:
+		break;
+	default:
+		return true;
+	}
+
+	return ctrl_iter_fetch(iter, conf, LIGHT_MAX_BRIGHTNESS);
 }
 
 /**
@@ -172,17 +444,22 @@ static bool exec_set(struct light_conf *conf)
 bool exec_all(struct light_conf *conf)
 {
 	bool ret = true;
-	burn_dir dir = opendir(conf->sys_prefix);
+	int64_t val;
+	burn_iter iter = ctrl_iter_new(conf);
 
-	if (!dir) {
-		vlog_err("opendir: %m");
+	if (!iter || !exec_all_fetch(conf, iter))
 		return false;
-	}
 
 	/* Change the controller mode so exec_op() does its thing */
 	conf->ctrl_mode = LIGHT_CTRL_SPECIFY;
 
-	while ((conf->ctrl = ctrl_iter_next(dir))) {
+	while ((conf->ctrl = ctrl_iter_next(iter))) {
+		/* a failed read is tried again by the operation */
+		val = ctrl_iter_value(iter, LIGHT_MAX_BRIGHTNESS);
+		conf->cached_max = val > 0 ? val : 0;
+		val = ctrl_iter_value(iter, LIGHT_BRIGHTNESS);
+		conf->cached_val = val >= 0 ? val : -1;
+
 		if (conf->op_mode == LIGHT_GET)
 			fprintf(stdout, "%s\t", conf->ctrl);
 		if (!exec_op(conf))
@@ -190,6 +467,8 @@ bool exec_all(struct light_conf *conf)
 		free(conf->ctrl);
 	}
 
+	conf->cached_max = 0;
+	conf->cached_val = -1;
 	return ret;
 }
 
@@ -197,14 +476,14 @@ bool exec_all(struct light_conf *conf)
  * exec_save:
  * @conf:	configuration object
  *
- * Saves current value to the cache file.
+ * Saves current value to the metadata store.
  **/
 static bool exec_save(struct light_conf *conf)
 {
-	int64_t curr = light_fetch(conf, LIGHT_BRIGHTNESS);
-	if (curr < 0)
+	int64_t max, curr = exec_get_val(conf);
+	if (curr < 0 || (max = exec_get_max(conf)) < 0)
 		return false;
-	return exec_write(conf, LIGHT_SAVERESTORE, curr, curr);
+	return meta_set(conf, LIGHT_SAVERESTORE, curr, max);
 }
 
 /**
@@ -217,8 +496,34 @@ static bool exec_save(struct light_conf *conf)
  **/
 bool exec_op(struct light_conf *conf)
 {
-	if (info_print(conf->op_mode, conf->sys_prefix, false))
-		return info_print(conf->op_mode, conf->sys_prefix, true);
+	if (info_print(conf, false))
+		return info_print(conf, true);
+
+	/* these handle every selected controller at once */
+	if (conf->op_mode == LIGHT_PUBLISH)
+		return pub_watch(conf);
+	if (conf->op_mode == LIGHT_SCENE_APPLY)
+		return scene_apply(conf);
+	if (conf->op_mode == LIGHT_SCENE_SAVE)
+		return scene_save(conf);
+	if (conf->op_mode == LIGHT_FRAMES)
+		return frame_play(conf);
+	if (conf->op_mode == LIGHT_HIST_CREATE)
+		return hist_create(conf);
+	if (conf->op_mode == LIGHT_HIST_EXPORT)
+		return hist_export(conf);
+	if (conf->op_mode == LIGHT_LISTEN)
+		return listen_run(conf);
+	if (conf->op_mode == LIGHT_FOLLOW)
+		return follow_run(conf);
+	if (conf->op_mode == LIGHT_ADAPT)
+		return adapt_run(conf);
+	if (conf->op_mode == LIGHT_POLICY)
+		return policy_run(conf);
+	if (conf->op_mode == LIGHT_PERSIST)
+		return persist_run(conf);
+	if (conf->op_mode == LIGHT_SEQUENCE)
+		return seq_play(conf);
 
 	if (conf->ctrl_mode == LIGHT_CTRL_ALL)
 		return exec_all(conf);
@@ -232,6 +537,12 @@ bool exec_op(struct light_conf *conf)
 		return exec_get(conf);
 	case LIGHT_RESTORE:
 		return exec_restore(conf);
+	case LIGHT_WAIT:
+		return fade_wait(conf);
+	case LIGHT_QUERY:
+		return fade_query(conf);
+	case LIGHT_CALIBRATE:
+		return level_calibrate(conf);
 	case LIGHT_SET:
 	case LIGHT_SUB:
 	case LIGHT_ADD:
@@ -253,8 +564,8 @@ bool exec_op(struct light_conf *conf)
  * @conf:	configuration object to generate path from
  * @type:	field being accessed
  *
- * Generates a path in /sys or /etc for a given operation and
- * stores it in the string pointed to by buffer.
+ * Generates a path in the cache directory for a given field.
+ * Controller fields are accessed through the backend instead.
  *
  * WARNING: this function allocates memory, but does not free it.
  *          free the data pointed to by the return value after use.
@@ -264,31 +575,39 @@ bool exec_op(struct light_conf *conf)
 char *light_path_new(struct light_conf *conf, LIGHT_FIELD type)
 {
 	char *p;
-	const char *fmt, *prefix;
+	const char *fmt;
 
 	if (!path_component(conf->ctrl))
 		return NULL;
 
-	if (type == LIGHT_BRIGHTNESS || type == LIGHT_MAX_BRIGHTNESS)
-		prefix = conf->sys_prefix;
-	else if (type == LIGHT_MIN_CAP || type == LIGHT_SAVERESTORE)
-		prefix = conf->cache_prefix;
-	else
-		return NULL;
-
 	switch (type) {
-	case LIGHT_BRIGHTNESS:
-		fmt = "%s/%s/brightness";
-		break;
-	case LIGHT_MAX_BRIGHTNESS:
-		fmt = "%s/%s/max_brightness";
-		break;
 	case LIGHT_MIN_CAP:
 		fmt = "%s.%s.mincap";
 		break;
 	case LIGHT_SAVERESTORE:
 		fmt = "%s.%s.brightness";
 		break;
+	case LIGHT_FADE:
+		fmt = "%s.%s.fade";
+		break;
+	case LIGHT_LEVELS:
+		fmt = "%s.%s.levels";
+		break;
+	case LIGHT_RAMP:
+		fmt = "%s.%s.ramp";
+		break;
+	case LIGHT_CLAIM:
+		fmt = "%s.%s.claim";
+		break;
+	case LIGHT_CURVE:
+		fmt = "%s.%s.curve";
+		break;
+	case LIGHT_CAP:
+		fmt = "%s.%s.cap";
+		break;
+	case LIGHT_CAP_POLICY:
+		fmt = "%s.%s.policy";
+		break;
 	default:
 		return NULL;
 	}
@@ -296,7 +615,7 @@ char *light_path_new(struct light_conf *conf, LIGHT_FIELD type)
 	if (!(p = path_new()))
 		return NULL;
 
-	return path_append(p, fmt, prefix, conf->ctrl);
+	return path_append(p, fmt, conf->cache_prefix, conf->ctrl);
 }
 
 /**
@@ -304,32 +623,19 @@ char *light_path_new(struct light_conf *conf, LIGHT_FIELD type)
  * @conf:	configuration object to fetch from
  * @field:	field to fetch value from
  *
- * Fetches value from the appropriate path.
+ * Fetches value from the backend or the metadata store.
  *
  * Returns: value on success, -errno on failure
  **/
 int64_t light_fetch(struct light_conf *conf, LIGHT_FIELD field)
 {
-	burn_o char *path = light_path_new(conf, field);
-	return path ? file_read(path) : -ENOMEM;
-}
+	if (field == LIGHT_BRIGHTNESS || field == LIGHT_MAX_BRIGHTNESS)
+		return conf->backend->read(conf, conf->ctrl, field);
 
-/**
- * exec_write:
- * @conf:	configuration object to operate on
- * @field:	field to write value into
- * @val_old:	old value
- * @val_new:	new value
- *
- * Writes a value for a given controller and field.
- *
- * Returns: true if write was successful, otherwise false
- **/
-static bool exec_write(struct light_conf *conf, LIGHT_FIELD field,
-		int64_t val_old, int64_t val_new)
-{
-	burn_fd fd = exec_open(conf, field, O_WRONLY);
-	return fd > 0 ? file_write(fd, val_old, val_new, conf->usec) : false;
+	if (field == LIGHT_MIN_CAP || field == LIGHT_SAVERESTORE)
+		return meta_read(conf, field);
+
+	return -EINVAL;
 }
 
 /**
@@ -338,7 +644,7 @@ static bool exec_write(struct light_conf *conf, LIGHT_FIELD field,
  *
  * Returns: the mincap if it is available, otherwise 0
  **/
-static int64_t exec_get_min(struct light_conf *conf)
+int64_t exec_get_min(struct light_conf *conf)
 {
 	int64_t mincap = light_fetch(conf, LIGHT_MIN_CAP);
 	if (mincap == -ENOENT)
@@ -353,17 +659,24 @@ static int64_t exec_get_min(struct light_conf *conf)
  * exec_restore:
  * @conf:	configuration object to operate on
  *
- * Restores the brightness value for a given controller.
+ * Restores the brightness value for a given controller,
+ * scaled to the current maximum if it changed since the save.
  *
  * Returns: true if write was successful, otherwise false
  **/
 static bool exec_restore(struct light_conf *conf)
 {
-	int64_t val = light_fetch(conf, LIGHT_SAVERESTORE);
+	struct meta_data data;
+	int64_t max, val;
+
+	if (!meta_get(conf, &data) || (max = exec_get_max(conf)) < 0)
+		return false;
+
+	if ((val = data.saved) >= 0 && data.saved_max > 0 && data.saved_max != max)
+		val = val * max / data.saved_max;
 
 	conf->value = val;
 	conf->val_mode = LIGHT_RAW;
-	conf->op_mode = LIGHT_SET;
 
 	return val >= 0 ? exec_set(conf) : false;
 }
@@ -8,6 +8,15 @@
 #include "light.h"
 
 bool exec_op(struct light_conf *conf);
+int exec_prepare(struct light_conf *conf, int64_t *curr, int64_t *next,
+		int64_t *max)
+	__attribute__ ((warn_unused_result));
+int64_t exec_get_max(struct light_conf *conf);
+int64_t exec_get_min(struct light_conf *conf);
+int64_t exec_target(struct light_conf *conf, int64_t curr_raw, int64_t mincap,
+		int64_t max);
+int64_t exec_duration(struct light_conf *conf, int64_t curr, int64_t next,
+		int64_t max);
 char *light_path_new(struct light_conf *conf, LIGHT_FIELD type)
 	__attribute__ ((warn_unused_result));
 int64_t light_fetch(struct light_conf *conf, LIGHT_FIELD field);
@@ -0,0 +1,273 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "light.h"
+#include "file.h"
+#include "exec.h"
+#include "fade.h"
+#include "metrics.h"
+
+#define FADE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+/**
+ * fade_child:
+ * @path:	path of the fade pid file
+ * @fd:		controller fd inherited from the caller
+ * @pipe_fd:	write end of the handshake pipe
+ * @start:	starting value
+ * @end:	value to eventually write
+ * @usec:	time used to smooth the write
+ * @hooks:	functions used for each step
+ *
+ * Body of the detached fade process. Records its pid in the
+ * (locked) pid file, takes over the controller lock once the
+ * caller releases it, reports back over the pipe and fades.
+ *
+ * Returns: does not return
+ **/
+static void fade_child(const char *path, int fd, int pipe_fd,
+		int64_t start, int64_t end, int64_t usec,
+		const struct file_hooks *hooks)
+{
+	int null, pid_fd;
+	pid_t pid = getpid();
+
+	/* the caller reports what it counted itself */
+	metrics_reset();
+
+	if ((pid_fd = open(path, O_RDWR | O_CREAT, FADE_MODE)) < 0) {
+		vlog_err("open '%s': %m", path);
+		_exit(EXIT_FAILURE);
+	}
+
+	/* held until exit, this is what waiters block on */
+	if (lockf(pid_fd, F_LOCK, 0) < 0 || ftruncate(pid_fd, 0) < 0 ||
+	    dprintf(pid_fd, "%d", (int) pid) < 0) {
+		vlog_err("pid file '%s': %m", path);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (lockf(fd, F_LOCK, 0) < 0) {
+		vlog_err("lockf: %m");
+		_exit(EXIT_FAILURE);
+	}
+
+	if (write(pipe_fd, &pid, sizeof(pid)) != sizeof(pid))
+		_exit(EXIT_FAILURE);
+
+	close(pipe_fd);
+
+	/* do not hold on to the caller's terminal or pipes */
+	if ((null = open("/dev/null", O_RDWR)) >= 0) {
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		if (null > STDERR_FILENO)
+			close(null);
+	}
+
+	if (!file_write(fd, start, end, usec, hooks)) {
+		metrics_flush();
+		_exit(EXIT_FAILURE);
+	}
+
+	metrics_flush();
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * fade_detach:
+ * @conf:	configuration object of the controller
+ * @fd:		opened and locked controller fd
+ * @start:	starting value
+ * @end:	value to eventually write
+ * @hooks:	functions used for each step
+ *
+ * Hands the fade over to a double forked process and returns
+ * as soon as that process holds the controller lock.
+ *
+ * Returns: true if the fade was started, false on failure
+ **/
+bool fade_detach(struct light_conf *conf, int fd, int64_t start, int64_t end,
+		const struct file_hooks *hooks)
+{
+	int p[2], status;
+	pid_t pid;
+	ssize_t r;
+	burn_o char *path = light_path_new(conf, LIGHT_FADE);
+
+	if (!path)
+		return false;
+
+	if (pipe(p) < 0) {
+		vlog_err("pipe: %m");
+		return false;
+	}
+
+	if ((pid = fork()) < 0) {
+		vlog_err("fork: %m");
+		close(p[0]);
+		close(p[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		close(p[0]);
+		if (setsid() < 0)
+			_exit(EXIT_FAILURE);
+		if ((pid = fork()) != 0)
+			_exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+		fade_child(path, fd, p[1], start, end, conf->usec, hooks);
+	}
+
+	close(p[1]);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != EXIT_SUCCESS) {
+		vlog_err("could not detach fade");
+		close(p[0]);
+		return false;
+	}
+
+	/* let the fade process take over the controller lock */
+	if (lockf(fd, F_ULOCK, 0) < 0)
+		vlog_warning("lockf: %m");
+
+	r = read(p[0], &pid, sizeof(pid));
+	close(p[0]);
+
+	if (r != sizeof(pid)) {
+		vlog_err("detached fade failed to start");
+		return false;
+	}
+
+	vlog_notice("detached fade on '%s' (pid %d)", conf->ctrl, (int) pid);
+	return true;
+}
+
+/**
+ * fade_running:
+ * @conf:	configuration object of the controller
+ *
+ * Checks for a detached fade on the controller.
+ *
+ * Returns: pid of the fade, 0 if none is running, negative value on failure
+ **/
+static pid_t fade_running(struct light_conf *conf)
+{
+	int64_t pid;
+	burn_o char *path = light_path_new(conf, LIGHT_FADE);
+	burn_fd fd = path ? open(path, O_RDWR) : -1;
+
+	if (!path)
+		return -1;
+
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		vlog_err("open '%s': %m", path);
+		return -1;
+	}
+
+	if (lockf(fd, F_TEST, 0) == 0)
+		return 0;
+
+	if (errno != EACCES && errno != EAGAIN) {
+		vlog_err("lockf '%s': %m", path);
+		return -1;
+	}
+
+	if ((pid = file_read(path)) <= 0) {
+		vlog_err("no pid in '%s'", path);
+		return -1;
+	}
+
+	return (pid_t) pid;
+}
+
+/**
+ * fade_wait:
+ * @conf:	configuration object of the controller
+ *
+ * Blocks until a detached fade on the controller is done.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool fade_wait(struct light_conf *conf)
+{
+	burn_o char *path = light_path_new(conf, LIGHT_FADE);
+	burn_fd fd = path ? open(path, O_RDWR) : -1;
+
+	if (!path)
+		return false;
+
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return true;
+		vlog_err("open '%s': %m", path);
+		return false;
+	}
+
+	if (lockf(fd, F_LOCK, 0) < 0) {
+		vlog_err("lockf '%s': %m", path);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * fade_stop:
+ * @conf:	configuration object of the controller
+ *
+ * Terminates a detached fade on the controller, if any,
+ * so that a new one can take its place.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool fade_stop(struct light_conf *conf)
+{
+	pid_t pid = fade_running(conf);
+
+	if (pid <= 0)
+		return pid == 0;
+
+	vlog_notice("stopping detached fade (pid %d)", (int) pid);
+
+	if (kill(pid, SIGTERM) < 0 && errno != ESRCH) {
+		vlog_err("kill: %m");
+		return false;
+	}
+
+	return fade_wait(conf);
+}
+
+/**
+ * fade_query:
+ * @conf:	configuration object of the controller
+ *
+ * Prints the pid of a detached fade on the controller, or 0 if
+ * none is running.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool fade_query(struct light_conf *conf)
+{
+	pid_t pid = fade_running(conf);
+
+	if (pid < 0)
+		return false;
+
+	printf("%d\n", (int) pid);
+	return true;
+}
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef FADE_H
+#define FADE_H
+
+#include <stdbool.h>
+
+#include "light.h"
+#include "file.h"
+
+bool fade_detach(struct light_conf *conf, int fd, int64_t start, int64_t end,
+		const struct file_hooks *hooks);
+bool fade_stop(struct light_conf *conf);
+bool fade_wait(struct light_conf *conf);
+bool fade_query(struct light_conf *conf);
+
+#endif /* FADE_H */
@@ -6,64 +6,43 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
 #include "burno.h"
 #include "vlog.h"
+#include "value.h"
+#include "clk.h"
+#include "probe.h"
+#include "metrics.h"
 #include "file.h"
 
 #define FILE_MODE_DEFAULT (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
 
-#define SMOOTH_WRITES_PER_SECOND 50
-#define SMOOTH_ITER_DURATION 1e9 / SMOOTH_WRITES_PER_SECOND
-
 /**
  * file_write_sleep:
  * @nsec:	nanoseconds to sleep for
  * @t0:		initial time spec to compare to
  *
- * Sleeps for nsec nanoseconds, subtracted by how much time
- * has passed since the time stored in t0.
+ * Sleeps until nsec nanoseconds have passed since the time stored in t0.
  *
  * Returns: true on success, false on failure
  **/
 static bool file_write_sleep(long nsec, struct timespec t0)
 {
-	struct timespec t_sleep, t1;
-
-	t_sleep.tv_sec = 0;
-	t_sleep.tv_nsec = nsec;
+	struct timespec t1;
 
 	/* get current time so that we can compare to t0 */
-	if (clock_gettime(CLOCK_MONOTONIC_RAW, &t1) < 0) {
-		vlog_err("clock_gettime: %m");
-		return false;
-	}
+	clk_now(&t1);
 
 	if ((t1.tv_sec - t0.tv_sec) > 1) {
 		vlog_warning("time diff greater than 1 second, skipping sleep");
 		return true;
 	}
 
-	if ((t1.tv_nsec - t0.tv_nsec) < 0)
-		t_sleep.tv_nsec -= (t1.tv_nsec - t0.tv_nsec + 1e9);
-	else
-		t_sleep.tv_nsec -= (t1.tv_nsec - t0.tv_nsec);
-
-	if (t_sleep.tv_nsec <= 0)
-		return true;
-
-	/* don't overload nanosleep() */
-	if (t_sleep.tv_nsec >= 1e9)
-		t_sleep.tv_nsec = 1e9 - 1;
-
-	if (nanosleep(&t_sleep, NULL) < 0) {
-		vlog_err("nanosleep: %m");
-		return false;
-	}
-
-	return true;
+	clk_add(&t0, nsec);
+	return clk_sleep_until(&t0);
 }
 
 /**
@@ -75,72 +54,348 @@ static bool file_write_sleep(long nsec, struct timespec t0)
  *
  * Returns: true on success, false on failure
  **/
-static bool file_rewrite(int fd, int64_t val)
+bool file_rewrite(int fd, int64_t val)
 {
 	if (val < 0)
 		val = 0;
 
-	if (ftruncate(fd, 0) < 0) {
+	PROBE2(rewrite_start, fd, val);
+
+	/* regular files, such as the cache, also need the offset reset */
+	if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
 		vlog_err("ftruncate: %m");
+		METRICS_COUNT(METRICS_WRITE_ERRORS);
 		return false;
 	}
 
 	if (dprintf(fd, "%" PRId64, val) < 0) {
 		vlog_err("dprintf: %" PRId64, val);
+		METRICS_COUNT(METRICS_WRITE_ERRORS);
 		return false;
 	}
 
 	/* flush all data to disk so the change takes effect */
 	if (fsync(fd) != 0) {
 		vlog_err("fsync: %m");
+		METRICS_COUNT(METRICS_WRITE_ERRORS);
 		return false;
 	}
 
+	PROBE2(rewrite_end, fd, val);
+	METRICS_COUNT(METRICS_WRITES);
+
+	return true;
+}
+
+/**
+ * file_step:
+ * @f:		file being written to
+ * @i:		index of the write
+ * @num_writes:	number of writes after the first one
+ *
+ * Returns: the value of the given write
+ **/
+static int64_t file_step(const struct file_fade *f, int64_t i, int64_t num_writes)
+{
+	if (i == num_writes)
+		return f->end;
+	return ((f->start * num_writes) + ((f->end - f->start) * i)) / num_writes;
+}
+
+/**
+ * file_write_steps:
+ * @fades:	files to write to, with their start and end values
+ * @num:	number of files
+ * @usec:	time used to smooth the write
+ * @num_writes:	number of writes after the first one
+ *
+ * Returns: true on success, false on failure.
+ **/
+static bool file_write_steps(const struct file_fade *fades, size_t num,
+		int64_t usec, int64_t num_writes)
+{
+	struct timespec t0;
+
+	for (int64_t i = 0; i <= num_writes; i++) {
+		/* save current time to account for the time
+		 * taken to perform the write operation */
+		clk_now(&t0);
+
+		for (size_t j = 0; j < num; j++) {
+			const struct file_fade *f = &fades[j];
+			const struct file_hooks *hooks = f->hooks;
+			int64_t next_value = file_step(f, usec == 0 ? num_writes : i, num_writes);
+
+			if (hooks && hooks->ramp) {
+				if (i > 0)
+					continue;
+				next_value = f->end;
+			}
+
+			/* write the closest level, unless it is already in effect */
+			if (hooks && hooks->levels) {
+				const int64_t *lv = hooks->levels;
+				size_t n = hooks->num_levels;
+				int64_t prev = usec != 0 && i > 0 ?
+					value_snap(lv, n, file_step(f, i - 1, num_writes)) :
+					lv[value_level(lv, n, f->start)];
+
+				if ((next_value = value_snap(lv, n, next_value)) == prev)
+					continue;
+			}
+
+			if (!(hooks && hooks->rewrite ? hooks->rewrite : file_rewrite)(f->fd, next_value))
+				return false;
+
+			if (hooks && hooks->step)
+				hooks->step(hooks->data, next_value);
+		}
+
+		/* nothing is left to pace after the last write */
+		if (i < num_writes && !file_write_sleep(SMOOTH_ITER_DURATION, t0))
+			return false;
+	}
+
 	return true;
 }
 
+/**
+ * file_write_all:
+ * @fades:	files to write to, with their start and end values
+ * @num:	number of files
+ * @usec:	time used to smooth the write
+ *
+ * Writes to every file in lockstep, optionally smoothing
+ * the operation over usec microseconds.
+ *
+ * Returns: true on success, false on failure.
+ **/
+bool file_write_all(const struct file_fade *fades, size_t num, int64_t usec)
+{
+	bool ret, ramp = true;
+	struct timespec t0, t1;
+
+	for (size_t j = 0; j < num; j++) {
+		vlog_notice("Writing (raw) value: %" PRId64, fades[j].end);
+		ramp = ramp && fades[j].hooks && fades[j].hooks->ramp;
+	}
+
+	/* nothing is left to pace if every firmware ramps by itself */
+	if (ramp)
+		usec = 0;
+
+	int64_t num_writes = usec * SMOOTH_WRITES_PER_SECOND / 1e6;
+
+	PROBE4(fade_plan, num, usec, num_writes, (int64_t) (SMOOTH_ITER_DURATION));
+	clk_now(&t0);
+	ret = file_write_steps(fades, num, usec, num_writes);
+	PROBE3(fade_done, num, usec, ret);
+
+	if (ret && num_writes > 0) {
+		int64_t late;
+
+		clk_now(&t1);
+		late = (int64_t) (t1.tv_sec - t0.tv_sec) * 1000000 +
+			(t1.tv_nsec - t0.tv_nsec) / 1000 -
+			num_writes * (int64_t) (SMOOTH_ITER_DURATION) / 1000;
+
+		METRICS_COUNT(METRICS_FADES);
+		METRICS_OBSERVE(METRICS_FADE_OVERRUN, late > 0 ? late : 0);
+	}
+
+	return ret;
+}
+
 /**
  * file_write:
  * @fd:		file descriptor to write to
  * @start:	starting value
  * @end:	value to eventually write
  * @usec:	time used to smooth the write
+ * @hooks:	optional functions used for each step, may be NULL
  *
  * Writes to the file pointed to by fd, optionally smoothing
  * the operation over usec microseconds.
  *
  * Returns: true on success, false on failure.
  **/
-bool file_write(int fd, int64_t start, int64_t end, int64_t usec)
+bool file_write(int fd, int64_t start, int64_t end, int64_t usec,
+		const struct file_hooks *hooks)
 {
-	struct timespec t0;
+	struct file_fade fade = {
+		.fd = fd,
+		.start = start,
+		.end = end,
+		.hooks = hooks,
+	};
+
+	return file_write_all(&fade, 1, usec);
+}
 
-	vlog_notice("Writing (raw) value: %" PRId64, end);
+#define FILE_EASE_ONE ((int64_t) 1 << 16)
 
-	int64_t num_writes = usec * SMOOTH_WRITES_PER_SECOND / 1e6;
+/**
+ * file_ease:
+ * @ease:	easing of the keyframe
+ * @p:		time into the keyframe, out of FILE_EASE_ONE
+ *
+ * Returns: distance covered towards the keyframe, out of FILE_EASE_ONE
+ **/
+static int64_t file_ease(FILE_EASE ease, int64_t p)
+{
+	int64_t q = FILE_EASE_ONE - p;
+
+	switch (ease) {
+	case FILE_EASE_IN:
+		return p * p / FILE_EASE_ONE;
+	case FILE_EASE_OUT:
+		return FILE_EASE_ONE - q * q / FILE_EASE_ONE;
+	case FILE_EASE_IN_OUT:
+		return p * p / FILE_EASE_ONE * (3 * FILE_EASE_ONE - 2 * p) / FILE_EASE_ONE;
+	case FILE_EASE_STEP:
+		return p < FILE_EASE_ONE ? 0 : FILE_EASE_ONE;
+	default:
+		return p;
+	}
+}
 
-	for (int64_t i = 0; i <= num_writes; i++) {
-		int64_t next_value;
+/**
+ * file_behind:
+ * @due:	absolute time something was due
+ *
+ * Returns: nanoseconds since it was due, negative if it is not due yet
+ **/
+static int64_t file_behind(const struct timespec *due)
+{
+	struct timespec now;
 
-		/* save current time to account for the time
-		 * taken to perform the write operation */
-		clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	clk_now(&now);
+	return (int64_t) (now.tv_sec - due->tv_sec) * 1000000000 +
+		(now.tv_nsec - due->tv_nsec);
+}
+
+/**
+ * file_write_key:
+ * @tracks:	files to write to
+ * @num:	number of files
+ * @key:	keyframe being played
+ * @k:		index of the keyframe
+ * @p:		time into the keyframe, out of FILE_EASE_ONE
+ *
+ * Writes the value every file has at the given time, unless
+ * it is the value written last.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool file_write_key(struct file_track *tracks, size_t num,
+		const struct file_key *key, size_t k, int64_t p)
+{
+	int64_t e = file_ease(key->ease, p);
 
-		if (usec == 0 || i == num_writes)
-			next_value = end;
-		else
-			next_value = ((start * num_writes) + ((end - start) * i)) / num_writes;
+	for (size_t j = 0; j < num; j++) {
+		struct file_track *t = &tracks[j];
+		const struct file_hooks *hooks = t->hooks;
+		int64_t from = k > 0 ? t->vals[k - 1] : t->start;
+		int64_t val = from + (t->vals[k] - from) * e / FILE_EASE_ONE;
 
-		if (!file_rewrite(fd, next_value))
-			return false;
+		/* the firmware ramps to the keyframe by itself */
+		if (hooks && hooks->ramp)
+			val = t->vals[k];
+
+		if (hooks && hooks->levels)
+			val = value_snap(hooks->levels, hooks->num_levels, val);
 
-		if (!file_write_sleep(SMOOTH_ITER_DURATION, t0))
+		if (val == t->written)
+			continue;
+
+		if (!(hooks && hooks->rewrite ? hooks->rewrite : file_rewrite)(t->fd, val))
 			return false;
+
+		t->written = val;
+
+		if (hooks && hooks->step)
+			hooks->step(hooks->data, val);
 	}
 
 	return true;
 }
 
+/**
+ * file_write_keys:
+ * @tracks:	files to write to, with their start and keyframe values
+ * @num:	number of files
+ * @keys:	duration and easing of every keyframe
+ * @num_keys:	number of keyframes
+ * @repeat:	number of times the keyframes are played, 0 for ever
+ *
+ * Plays keyframes on every file in lockstep. Each keyframe moves from
+ * the previous value, or from the start value for the first one, and
+ * a repetition starts from the last keyframe. Every write is scheduled
+ * from the time the sequence started, so slow writes do not delay the
+ * keyframes after them: writes that fell behind by a whole step are
+ * skipped, except the last write of every keyframe.
+ *
+ * Returns: true on success, false on failure.
+ **/
+bool file_write_keys(struct file_track *tracks, size_t num,
+		const struct file_key *keys, size_t num_keys, int64_t repeat)
+{
+	struct timespec t0, due;
+	/* nanoseconds from t0 to the start of the keyframe */
+	int64_t off = 0, late;
+	int64_t step = (int64_t) (SMOOTH_ITER_DURATION);
+
+	for (size_t j = 0; j < num; j++) {
+		const struct file_hooks *hooks = tracks[j].hooks;
+
+		tracks[j].written = hooks && hooks->levels ?
+			value_snap(hooks->levels, hooks->num_levels, tracks[j].start) :
+			tracks[j].start;
+	}
+
+	clk_now(&t0);
+
+	for (int64_t r = 0; repeat == 0 || r < repeat; r++) {
+		for (size_t k = 0; k < num_keys; k++) {
+			int64_t len = keys[k].usec * 1000;
+
+			for (int64_t t = step < len ? step : len; ; t += step) {
+				if (t > len)
+					t = len;
+
+				due = t0;
+				clk_add(&due, off + t);
+
+				if (t < len && file_behind(&due) >= step)
+					continue;
+
+				if (!clk_sleep_until(&due) ||
+				    !file_write_key(tracks, num, &keys[k], k,
+						len > 0 ? t * FILE_EASE_ONE / len : FILE_EASE_ONE))
+					return false;
+
+				if (t == len)
+					break;
+			}
+
+			off += len;
+		}
+
+		/* a repetition starts from the last keyframe */
+		for (size_t j = 0; j < num; j++)
+			tracks[j].start = tracks[j].vals[num_keys - 1];
+	}
+
+	due = t0;
+	clk_add(&due, off);
+	late = file_behind(&due) / 1000;
+
+	METRICS_COUNT(METRICS_FADES);
+	METRICS_OBSERVE(METRICS_FADE_OVERRUN, late > 0 ? late : 0);
+
+	return true;
+}
+
 /**
  * file_open:
  * @path:	path to open
@@ -153,21 +408,49 @@ bool file_write(int fd, int64_t start, int64_t end, int64_t usec)
 int file_open(const char *const path, int mode)
 {
 	int fd;
+	int64_t wait;
+	struct timespec t0, t1;
 
-	if ((fd = open(path, mode | O_TRUNC | O_CREAT | O_SYNC, FILE_MODE_DEFAULT)) < 0) {
+	/* no O_TRUNC: the contents may only change once the lock is held,
+	 * file_rewrite() truncates the file when it writes to it */
+	if ((fd = open(path, mode | O_CREAT | O_SYNC, FILE_MODE_DEFAULT)) < 0) {
 		vlog_err("open '%s': %m", path);
 		return -1;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
 	if (lockf(fd, F_LOCK, 0) < 0) {
 		vlog_err("lockf '%s': %m", path);
 		close(fd);
 		return -1;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wait = (int64_t) (t1.tv_sec - t0.tv_sec) * 1000000 +
+		(t1.tv_nsec - t0.tv_nsec) / 1000;
+	vlog_debug("waited %" PRId64 " us for lock on '%s'", wait, path);
+	PROBE3(lock_acquire, path, fd, wait);
+	METRICS_OBSERVE(METRICS_LOCK_WAIT, wait);
+
 	return fd;
 }
 
+/**
+ * file_close:
+ * @fd:		file descriptor from file_open(), or -1
+ *
+ * Releases the lock taken by file_open() and closes the fd.
+ **/
+void file_close(int fd)
+{
+	if (fd < 0)
+		return;
+
+	PROBE1(lock_release, fd);
+	close(fd);
+}
+
 /**
  * file_read:
  * @path:	path to read value from
@@ -195,3 +478,38 @@ int64_t file_read(const char *const path)
 	/* cppcheck-suppress resourceLeak */
 	return value;
 }
+
+/**
+ * file_read_fd:
+ * @fd:		file descriptor to read value from
+ *
+ * Reads a value through an fd from file_open(), which must be opened
+ * for reading. Closing any other fd of the file, as file_read() does,
+ * would release the lock. Empty files read as missing.
+ *
+ * Returns: value, or -errno on error
+ */
+int64_t file_read_fd(int fd)
+{
+	char buf[32];
+	char *end;
+	ssize_t len;
+	int64_t value;
+
+	if ((len = pread(fd, buf, sizeof(buf) - 1, 0)) < 0)
+		return -errno;
+
+	if (len == 0)
+		return -ENOENT;
+
+	buf[len] = '\0';
+	errno = 0;
+	value = strtoll(buf, &end, 10);
+
+	if (errno != 0)
+		return -errno;
+	if (end == buf)
+		return -EINVAL;
+
+	return value;
+}
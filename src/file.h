@@ -7,8 +7,71 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-bool file_write(int fd, int64_t start, int64_t end, int64_t usec);
+#define SMOOTH_WRITES_PER_SECOND 50
+#define SMOOTH_ITER_DURATION 1e9 / SMOOTH_WRITES_PER_SECOND
+
+struct file_hooks {
+	/* writes a single value, file_rewrite() if unset */
+	bool (*rewrite)(int fd, int64_t val);
+	/* called after every written value */
+	void (*step)(void *data, int64_t val);
+	void *data;
+	/* sorted raw values that take effect, every value if NULL */
+	const int64_t *levels;
+	size_t num_levels;
+	/* the firmware ramps by itself, only the end value is written */
+	bool ramp;
+};
+
+struct file_fade {
+	int fd;
+	int64_t start;
+	int64_t end;
+	const struct file_hooks *hooks;
+};
+
+/* how a keyframe moves from the previous value to its own */
+typedef enum FILE_EASE {
+	FILE_EASE_LINEAR = 0,
+	FILE_EASE_IN,
+	FILE_EASE_OUT,
+	FILE_EASE_IN_OUT,
+	/* holds the previous value until the keyframe ends */
+	FILE_EASE_STEP
+} FILE_EASE;
+
+struct file_key {
+	int64_t usec;
+	FILE_EASE ease;
+};
+
+struct file_track {
+	int fd;
+	int64_t start;
+	/* raw value of every keyframe */
+	const int64_t *vals;
+	const struct file_hooks *hooks;
+	/* last value written, kept by file_write_keys() */
+	int64_t written;
+};
+
+/* releases the lock of an fd from file_open() when leaving the scope */
+#define file_locked_fd __attribute__((cleanup(file__close))) int
+
+bool file_write_all(const struct file_fade *fades, size_t num, int64_t usec);
+bool file_write(int fd, int64_t start, int64_t end, int64_t usec,
+		const struct file_hooks *hooks);
+bool file_write_keys(struct file_track *tracks, size_t num,
+		const struct file_key *keys, size_t num_keys, int64_t repeat);
+bool file_rewrite(int fd, int64_t val);
 int file_open(char const *path, int mode);
+void file_close(int fd);
+
+static inline void file__close(int *fd)
+{
+	file_close(*fd);
+}
 int64_t file_read(char const *path);
+int64_t file_read_fd(int fd);
 
 #endif /* FILE_H */
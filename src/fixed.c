@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: 0BSD */
+
+#include "fixed.h"
+
+/* 2^(2^-(i + 1)) with 31 fraction bits */
+static const uint64_t fixed_roots[FIXED_SHIFT] = {
+	3037000500, 2553802834, 2341847524, 2242560872,
+	2194507417, 2170868212, 2159144272, 2153306067,
+	2150392887, 2148937775, 2148210589, 2147847087,
+	2147665360, 2147574502, 2147529075, 2147506361,
+	2147495005, 2147489326, 2147486487, 2147485068,
+	2147484358, 2147484003, 2147483825, 2147483737,
+	2147483692, 2147483670, 2147483659, 2147483654,
+	2147483651, 2147483649, 2147483649, 2147483648,
+};
+
+/**
+ * fixed_log2:
+ * @x:	value to take the logarithm of, at least 1
+ *
+ * Computes the base 2 logarithm one fraction bit at a time,
+ * by repeatedly squaring the mantissa.
+ *
+ * Returns: the logarithm with FIXED_SHIFT fraction bits
+ **/
+uint64_t fixed_log2(uint64_t x)
+{
+	int exp = 63 - __builtin_clzll(x);
+	uint64_t ret = (uint64_t) exp << FIXED_SHIFT;
+	/* mantissa in [1, 2) with 31 fraction bits */
+	uint64_t m = exp > 31 ? x >> (exp - 31) : x << (31 - exp);
+
+	for (int bit = FIXED_SHIFT - 1; bit >= 0; bit--) {
+		m = (m * m + (1ULL << 30)) >> 31;
+		if (m >= 1ULL << 32) {
+			m >>= 1;
+			ret |= 1ULL << bit;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * fixed_exp2:
+ * @e:	exponent with FIXED_SHIFT fraction bits, below 63
+ *
+ * Computes the power of 2 by multiplying the roots of 2 that
+ * make up the fraction of the exponent.
+ *
+ * Returns: the power of 2, rounded down
+ **/
+uint64_t fixed_exp2(uint64_t e)
+{
+	unsigned int exp = e >> FIXED_SHIFT;
+	uint64_t r = 1ULL << 31;
+
+	for (int i = 0; i < FIXED_SHIFT; i++)
+		if (e & (1ULL << (FIXED_SHIFT - 1 - i)))
+			r = (r * fixed_roots[i] + (1ULL << 30)) >> 31;
+
+	return exp >= 31 ? r << (exp - 31) : r >> (31 - exp);
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: 0BSD */
+
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <stdint.h>
+
+/* fraction bits of the fixed-point logarithms */
+#define FIXED_SHIFT 32
+
+uint64_t fixed_log2(uint64_t x);
+uint64_t fixed_exp2(uint64_t e);
+
+#endif /* FIXED_H */
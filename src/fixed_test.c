@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: 0BSD */
+
+/*
+ * Compares the fixed-point exponential percentages against the
+ * floating-point formulas they replace. Every percentage and every
+ * raw value is checked for the maxima up to 4096 and around every
+ * power of 2 up to 2^24, and the extremes for every maximum up to
+ * 2^24. Results may differ by one unit, where the rounding of
+ * either side crosses an integer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "value.h"
+
+#define TEST_MAX_ALL	4096
+#define TEST_MAX_BITS	24
+
+static uint64_t checks, fails;
+static int64_t worst;
+
+static int64_t ref_log_pct(int64_t raw, int64_t max)
+{
+	return (int64_t) ((log((double) raw) / log((double) max)) * VALUE_PCT_MAX);
+}
+
+static int64_t ref_exp_raw(int64_t val, int64_t max)
+{
+	return (int64_t) (exp((double) val * log((double) max) / VALUE_PCT_MAX));
+}
+
+static int64_t ref_to_raw(int64_t val, int64_t max)
+{
+	int64_t value = ref_exp_raw(val, max);
+
+	if (ref_log_pct(value, max) == 0)
+		return ref_to_raw(val + (VALUE_PCT_MAX / 200), max);
+
+	return value;
+}
+
+static void check(const char *what, int64_t a, int64_t b, int64_t arg,
+		int64_t max)
+{
+	int64_t diff = a > b ? a - b : b - a;
+
+	checks++;
+
+	if (diff > worst)
+		worst = diff;
+
+	if (diff > 1 && fails++ < 10)
+		fprintf(stderr, "%s(%" PRId64 ", %" PRId64 "): %" PRId64
+				" instead of %" PRId64 "\n", what, arg, max, a, b);
+}
+
+static void check_pct(int64_t val, int64_t max)
+{
+	check("to_raw", value_to_raw(LIGHT_PERCENT_EXPONENTIAL, val, max),
+			ref_to_raw(val, max), val, max);
+}
+
+static void check_raw(int64_t raw, int64_t max)
+{
+	check("from_raw", value_from_raw(LIGHT_PERCENT_EXPONENTIAL, raw, max),
+			ref_log_pct(raw, max), raw, max);
+}
+
+static void check_max(int64_t max)
+{
+	for (int64_t val = 0; val <= VALUE_PCT_MAX; val++)
+		check_pct(val, max);
+
+	for (int64_t raw = 1; raw <= max; raw++)
+		check_raw(raw, max);
+}
+
+int main(void)
+{
+	for (int64_t max = 2; max <= TEST_MAX_ALL; max++)
+		check_max(max);
+
+	for (int bits = 13; bits <= TEST_MAX_BITS; bits++) {
+		check_max((INT64_C(1) << bits) - 1);
+		check_max(INT64_C(1) << bits);
+		check_max((INT64_C(1) << bits) + 1);
+	}
+
+	for (int64_t max = TEST_MAX_ALL + 1; max <= INT64_C(1) << TEST_MAX_BITS; max++) {
+		check_pct(1, max);
+		check_pct(VALUE_PCT_MAX / 2, max);
+		check_pct(VALUE_PCT_MAX - 1, max);
+		check_pct(VALUE_PCT_MAX, max);
+		check_raw(2, max);
+		check_raw(max / 2, max);
+		check_raw(max - 1, max);
+		check_raw(max, max);
+	}
+
+	printf("checks: %" PRIu64 ", failures: %" PRIu64 ", largest difference: %" PRId64 "\n",
+			checks, fails, worst);
+
+	return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
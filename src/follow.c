@@ -0,0 +1,406 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "ctrl.h"
+#include "light.h"
+#include "value.h"
+#include "backend.h"
+#include "init.h"
+#include "file.h"
+#include "exec.h"
+#include "pub.h"
+#include "arb.h"
+#include "policy.h"
+#include "probe.h"
+#include "metrics.h"
+#include "follow.h"
+
+/*
+ * Follow mode mirrors the brightness of one controller, the source, onto
+ * the selected controllers. The level of the source on the exponential
+ * scale is mapped through the curve of each controller, kept in
+ * <cache>/<target>.<ctrl>.curve:
+ *
+ *	offset <percent>
+ *	<source percent> <controller percent>
+ *	...
+ *
+ * Both are optional, the points are joined by straight lines and must be
+ * in increasing order. The source is read again before every write, so a
+ * slow controller gets the latest value instead of every value in turn.
+ */
+
+/* the source is read this often, as not every driver notifies changes */
+#define FOLLOW_POLL_MSEC 500
+/* a controller locked by someone else is tried again this soon */
+#define FOLLOW_RETRY_MSEC 20
+#define FOLLOW_POINTS_MAX 32
+
+struct follow_ctrl {
+	struct light_conf *conf;
+	int fd;
+	int64_t max;
+	int64_t mincap;
+	/* raw value last written, or -1 */
+	int64_t last;
+	int64_t offset;
+	int64_t points[FOLLOW_POINTS_MAX][2];
+	size_t num_points;
+	struct pub pub;
+	bool publish;
+};
+
+struct follow {
+	struct light_conf *conf;
+	struct light_conf *src;
+	int64_t src_max;
+	struct follow_ctrl *ctrls;
+	size_t num;
+};
+
+/**
+ * follow_pct:
+ * @str:	percentage, which may be negative
+ * @pct:	where to store the percentage, scaled to VALUE_PCT_MAX
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool follow_pct(const char *str, int64_t *pct)
+{
+	double val;
+
+	if (sscanf(str, "%lf", &val) != 1 || val < -100 || val > 100)
+		return false;
+
+	*pct = (int64_t) (val * (VALUE_PCT_MAX / 100));
+	return true;
+}
+
+/**
+ * follow_load:
+ * @fc:		controller to load the curve of
+ *
+ * Returns: true on success or if there is no curve, false on failure
+ **/
+static bool follow_load(struct follow_ctrl *fc)
+{
+	char line[128], in[32], out[32];
+	int64_t p[2];
+	size_t num = 0;
+	burn_o char *path = light_path_new(fc->conf, LIGHT_CURVE);
+	burn_file file = path ? fopen(path, "r") : NULL;
+
+	if (!file)
+		return path != NULL;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+			continue;
+
+		if (sscanf(line, "offset %31s", in) == 1) {
+			if (!follow_pct(in, &fc->offset))
+				break;
+			continue;
+		}
+
+		if (sscanf(line, "%31s %31s", in, out) != 2 ||
+		    !follow_pct(in, &p[0]) || !follow_pct(out, &p[1]) ||
+		    p[0] < 0 || p[1] < 0 || num >= FOLLOW_POINTS_MAX ||
+		    (num > 0 && p[0] <= fc->points[num - 1][0]))
+			break;
+
+		fc->points[num][0] = p[0];
+		fc->points[num][1] = p[1];
+		num++;
+	}
+
+	if (!feof(file)) {
+		line[strcspn(line, "\n")] = '\0';
+		vlog_err("'%s' is not a curve: '%s'", path, line);
+		/* cppcheck-suppress resourceLeak */
+		return false;
+	}
+
+	fc->num_points = num;
+	/* cppcheck-suppress resourceLeak */
+	return true;
+}
+
+/**
+ * follow_map:
+ * @fc:		controller to map the level for
+ * @pct:	level of the source on the exponential scale
+ *
+ * Returns: raw value of the controller, between the minimum cap and the
+ * cap of a running policy
+ **/
+static int64_t follow_map(const struct follow_ctrl *fc, int64_t pct)
+{
+	const int64_t (*p)[2] = fc->points;
+	size_t n = fc->num_points, i = 0;
+	int64_t cap;
+
+	if (n > 0) {
+		while (i < n && pct > p[i][0])
+			i++;
+
+		if (i == 0)
+			pct = p[0][1];
+		else if (i == n)
+			pct = p[n - 1][1];
+		else
+			pct = p[i - 1][1] + (p[i][1] - p[i - 1][1]) *
+				(pct - p[i - 1][0]) / (p[i][0] - p[i - 1][0]);
+	}
+
+	pct = VALUE_CLAMP_PCT(pct + fc->offset);
+
+	/* a running policy lowers the ceiling, never below the minimum */
+	if ((cap = policy_cap(fc->conf, fc->max)) < fc->mincap)
+		cap = fc->mincap;
+
+	return value_clamp(value_to_raw(LIGHT_PERCENT_EXPONENTIAL, pct, fc->max),
+			fc->mincap, cap);
+}
+
+/**
+ * follow_unlock:
+ * @fc:		locked controller to unlock, keeping it open
+ **/
+static void follow_unlock(struct follow_ctrl *fc)
+{
+	PROBE1(lock_release, fc->fd);
+
+	if (lockf(fc->fd, F_ULOCK, 0) < 0)
+		vlog_warning("lockf: %m");
+}
+
+/**
+ * follow_add:
+ * @f:		follower state
+ * @ctrl:	name of the controller to add
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool follow_add(struct follow *f, const char *ctrl)
+{
+	struct follow_ctrl *fc, *ctrls;
+
+	if (strcmp(ctrl, f->src->ctrl) == 0)
+		return true;
+
+	if (!(ctrls = realloc(f->ctrls, (f->num + 1) * sizeof(*ctrls)))) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	f->ctrls = ctrls;
+	fc = memset(&ctrls[f->num], 0, sizeof(*fc));
+	fc->fd = -1;
+	fc->last = -1;
+
+	if (!(fc->conf = init_ctrl_conf(f->conf, f->conf->target, LIGHT_SET, ctrl)))
+		return false;
+
+	f->num++;
+
+	if ((fc->max = exec_get_max(fc->conf)) <= 0 ||
+	    (fc->mincap = exec_get_min(fc->conf)) < 0 || !follow_load(fc))
+		return false;
+
+	if ((fc->fd = fc->conf->backend->open(fc->conf, ctrl)) < 0)
+		return false;
+
+	/* the lock is only taken to write */
+	follow_unlock(fc);
+
+	fc->publish = pub_attach(&fc->pub, fc->conf, fc->max);
+	vlog_notice("'%s' follows '%s'", ctrl, f->src->ctrl);
+	return true;
+}
+
+/**
+ * follow_read:
+ * @f:		follower state
+ *
+ * Returns: level of the source on the exponential scale, or -1 on failure
+ **/
+static int64_t follow_read(struct follow *f)
+{
+	struct light_conf *s = f->src;
+	int64_t raw = s->backend->read_actual(s, s->ctrl);
+
+	if (raw == -ENOENT)
+		raw = s->backend->read(s, s->ctrl, LIGHT_BRIGHTNESS);
+
+	if (raw < 0) {
+		vlog_err("can not read '%s'", s->ctrl);
+		return -1;
+	}
+
+	return value_from_raw(LIGHT_PERCENT_EXPONENTIAL, raw, f->src_max);
+}
+
+/**
+ * follow_push:
+ * @f:		follower state
+ * @retry:	set if a controller is left to try again
+ *
+ * Writes the level of the source to every controller that is not at it.
+ *
+ * Returns: number of controllers written, or -1 on failure
+ **/
+static int follow_push(struct follow *f, bool *retry)
+{
+	int num = 0;
+
+	for (size_t i = 0; i < f->num; i++) {
+		struct follow_ctrl *fc = &f->ctrls[i];
+		int64_t raw, pct = follow_read(f);
+
+		if (pct < 0)
+			return -1;
+
+		if ((raw = follow_map(fc, pct)) == fc->last)
+			continue;
+
+		/* a dropped value is not tried again */
+		if (!arb_allow(fc->conf)) {
+			fc->last = raw;
+			continue;
+		}
+
+		/* such as during a fade, which is left to finish */
+		if (lockf(fc->fd, F_TLOCK, 0) < 0) {
+			*retry = true;
+			continue;
+		}
+
+		PROBE3(lock_acquire, fc->conf->ctrl, fc->fd, 0);
+
+		if (fc->conf->backend->write(fc->fd, raw)) {
+			fc->last = raw;
+			num++;
+			if (fc->publish)
+				pub_step(&fc->pub, raw);
+		} else {
+			*retry = true;
+		}
+
+		follow_unlock(fc);
+	}
+
+	return num;
+}
+
+/**
+ * follow_loop:
+ * @f:		follower state
+ *
+ * Returns: false on failure, does not return otherwise
+ **/
+static bool follow_loop(struct follow *f)
+{
+	struct pollfd pfd = {
+		.fd = f->src->backend->notify(f->src, f->src->ctrl),
+		.events = POLLPRI,
+	};
+	bool retry;
+	int num, timeout, mt;
+
+	/* reading the attribute arms the notification */
+	if (pfd.fd >= 0)
+		file_read_fd(pfd.fd);
+
+	for (;;) {
+		retry = false;
+
+		/* the source may have moved on while slow controllers
+		 * were written, until it stays put */
+		while ((num = follow_push(f, &retry)) > 0)
+			;
+
+		if (num < 0)
+			break;
+
+		metrics_tick();
+
+		timeout = retry ? FOLLOW_RETRY_MSEC : FOLLOW_POLL_MSEC;
+		if ((mt = metrics_timeout()) >= 0 && mt < timeout)
+			timeout = mt;
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			vlog_err("poll: %m");
+			break;
+		}
+
+		if (pfd.revents & (POLLPRI | POLLERR))
+			file_read_fd(pfd.fd);
+	}
+
+	if (pfd.fd >= 0)
+		close(pfd.fd);
+
+	return false;
+}
+
+/**
+ * follow_run:
+ * @conf:	configuration object holding the source and the selection
+ *
+ * Mirrors the source onto the selected controllers whenever it changes.
+ *
+ * Returns: false on failure, does not return otherwise
+ **/
+bool follow_run(struct light_conf *conf)
+{
+	bool ret = false;
+	struct follow f = { .conf = conf };
+
+	if (!(f.src = init_ctrl_conf(conf, conf->target, LIGHT_SET, conf->follow)))
+		return false;
+
+	if ((f.src_max = exec_get_max(f.src)) <= 0) {
+		vlog_err("can not follow '%s'", conf->follow);
+	} else if (conf->ctrl_mode == LIGHT_CTRL_ALL) {
+		burn_iter iter = ctrl_iter_new(conf);
+		char *c;
+
+		ret = iter != NULL;
+		while (ret && (c = ctrl_iter_next(iter))) {
+			ret = follow_add(&f, c);
+			free(c);
+		}
+	} else {
+		ret = follow_add(&f, conf->ctrl);
+	}
+
+	if (ret && f.num == 0) {
+		vlog_err("no controller to follow '%s' with", conf->follow);
+		ret = false;
+	}
+
+	if (ret)
+		ret = follow_loop(&f);
+
+	for (size_t i = 0; i < f.num; i++) {
+		struct follow_ctrl *fc = &f.ctrls[i];
+
+		if (fc->publish)
+			pub_detach(&fc->pub);
+		if (fc->fd >= 0)
+			close(fc->fd);
+		light_free(&fc->conf);
+	}
+
+	free(f.ctrls);
+	light_free(&f.src);
+	return ret;
+}
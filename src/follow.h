@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <stdbool.h>
+
+#include "light.h"
+
+bool follow_run(struct light_conf *conf);
+
+#endif /* FOLLOW_H */
@@ -0,0 +1,513 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "value.h"
+#include "light.h"
+#include "backend.h"
+#include "clk.h"
+#include "file.h"
+#include "policy.h"
+#include "frame.h"
+
+/*
+ * Frames set the color and brightness of many LEDs at once. They are
+ * read either as text, one LED per line and frames separated by empty
+ * lines:
+ *
+ *	<led>,<red>,<green>,<blue>[,<raw brightness>]
+ *
+ * or in a compact binary form, little endian throughout:
+ *
+ *	header:	"\x7f" "BLF", u8 version, u8 reserved, u16 number of LEDs
+ *	names:	per LED, u8 length followed by the name
+ *	frames:	u16 number of entries, then per entry:
+ *		u16 LED index, u8 red, u8 green, u8 blue, u8 reserved,
+ *		u16 raw brightness (0xffff leaves it unchanged)
+ *
+ * Colors range from 0 to 255. LEDs not mentioned in a frame keep
+ * their values, and only values that changed are written.
+ */
+
+#define FRAME_MAGIC "\x7f" "BLF"
+#define FRAME_VERSION 1
+#define FRAME_KEEP 0xffff
+/* how often the caps of a running policy are read again */
+#define FRAME_CAP_NSEC 1000000000
+
+typedef uint16_t frame_vec __attribute__((vector_size(16)));
+
+#define FRAME_LANES (sizeof(frame_vec) / sizeof(uint16_t))
+
+struct frame_led {
+	char name[NAME_MAX + 1];
+	int fd;
+	int color_fd;
+	int64_t max;
+	/* raw cap of a running policy, or max */
+	int64_t cap;
+	int64_t bright;
+	int64_t written;
+	uint16_t written_rgb[3];
+	bool color_written;
+};
+
+struct frames {
+	struct light_conf *conf;
+	struct frame_led *leds;
+	size_t num;
+	size_t cap;
+	size_t hint;
+	/* when the caps are read again */
+	struct timespec cap_at;
+	/* colors as given and as scaled, one array per channel */
+	uint16_t *rgb[3];
+	uint16_t *scaled[3];
+	uint16_t scale;
+	size_t num_frames;
+	size_t num_writes;
+};
+
+/**
+ * frame_scale:
+ * @dst:	where to store the scaled values
+ * @src:	values to scale
+ * @num:	number of values, a multiple of FRAME_LANES
+ * @k:		factor in 256ths
+ *
+ * Scales a channel by the global brightness, a vector at a time.
+ **/
+static void frame_scale(uint16_t *dst, const uint16_t *src, size_t num, uint16_t k)
+{
+	for (size_t i = 0; i < num; i += FRAME_LANES) {
+		frame_vec v;
+
+		memcpy(&v, src + i, sizeof(v));
+		v = (v * k) >> 8;
+		memcpy(dst + i, &v, sizeof(v));
+	}
+}
+
+/**
+ * frame_grow:
+ * @fr:		frame state
+ *
+ * Makes room for one more LED.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool frame_grow(struct frames *fr)
+{
+	size_t cap = fr->cap ? fr->cap * 2 : 8 * FRAME_LANES;
+	struct frame_led *leds;
+
+	if (fr->num < fr->cap)
+		return true;
+
+	if (!(leds = realloc(fr->leds, cap * sizeof(*leds)))) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	fr->leds = leds;
+
+	for (int c = 0; c < 3; c++) {
+		uint16_t *rgb = realloc(fr->rgb[c], cap * sizeof(*rgb));
+		uint16_t *scaled;
+
+		if (rgb)
+			fr->rgb[c] = rgb;
+		if (!rgb || !(scaled = realloc(fr->scaled[c], cap * sizeof(*scaled)))) {
+			vlog_err("realloc: %m");
+			return false;
+		}
+
+		fr->scaled[c] = scaled;
+		memset(fr->rgb[c] + fr->cap, 0, (cap - fr->cap) * sizeof(*rgb));
+	}
+
+	fr->cap = cap;
+	return true;
+}
+
+/**
+ * frame_cap:
+ * @fr:		frame state
+ * @led:	LED to read the cap of
+ *
+ * Returns: raw cap stored by a running policy, or the maximum without one
+ **/
+static int64_t frame_cap(struct frames *fr, const struct frame_led *led)
+{
+	char *ctrl = fr->conf->ctrl;
+	int64_t cap;
+
+	fr->conf->ctrl = (char *) led->name;
+	cap = policy_cap(fr->conf, led->max);
+	fr->conf->ctrl = ctrl;
+
+	return cap;
+}
+
+/**
+ * frame_led:
+ * @fr:		frame state
+ * @name:	name of the LED
+ *
+ * Looks up an LED, opening it the first time it is mentioned.
+ *
+ * Returns: index of the LED, or -1 on failure
+ **/
+static ssize_t frame_led(struct frames *fr, const char *name)
+{
+	const struct backend *b = fr->conf->backend;
+	struct frame_led *led;
+
+	/* frames tend to list LEDs in the same order */
+	if (fr->hint < fr->num && strcmp(fr->leds[fr->hint].name, name) == 0)
+		return fr->hint++;
+
+	for (size_t i = 0; i < fr->num; i++)
+		if (strcmp(fr->leds[i].name, name) == 0)
+			return (fr->hint = i + 1) - 1;
+
+	if (!path_component(name) || !frame_grow(fr))
+		return -1;
+
+	led = &fr->leds[fr->num];
+	snprintf(led->name, sizeof(led->name), "%s", name);
+	led->bright = -1;
+	led->written = -1;
+	led->color_written = false;
+	led->color_fd = -1;
+
+	if ((led->max = b->read(fr->conf, name, LIGHT_MAX_BRIGHTNESS)) <= 0 ||
+	    (led->fd = b->open(fr->conf, name)) < 0) {
+		vlog_err("can't open LED '%s'", name);
+		return -1;
+	}
+
+	led->color_fd = b->open_color(fr->conf, name);
+	led->cap = frame_cap(fr, led);
+
+	fr->hint = fr->num + 1;
+	return fr->num++;
+}
+
+/**
+ * frame_set:
+ * @fr:		frame state
+ * @i:		index of the LED
+ * @rgb:	color of the LED
+ * @bright:	raw brightness of the LED, or negative to keep it
+ **/
+static void frame_set(struct frames *fr, size_t i, const unsigned rgb[3], int64_t bright)
+{
+	for (int c = 0; c < 3; c++)
+		fr->rgb[c][i] = rgb[c] > 255 ? 255 : rgb[c];
+
+	if (bright >= 0)
+		fr->leds[i].bright = value_clamp(bright, 0, fr->leds[i].max);
+}
+
+/**
+ * frame_flush:
+ * @fr:		frame state
+ *
+ * Scales the colors and writes every value that changed
+ * since the previous frame, the brightness kept below the cap of
+ * a running policy.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool frame_flush(struct frames *fr)
+{
+	const struct backend *b = fr->conf->backend;
+	size_t lanes = (fr->num + FRAME_LANES - 1) / FRAME_LANES * FRAME_LANES;
+	struct timespec now;
+
+	clk_now(&now);
+
+	/* a frame is written far more often than a policy moves its caps */
+	if (now.tv_sec > fr->cap_at.tv_sec ||
+	    (now.tv_sec == fr->cap_at.tv_sec && now.tv_nsec >= fr->cap_at.tv_nsec)) {
+		for (size_t i = 0; i < fr->num; i++)
+			fr->leds[i].cap = frame_cap(fr, &fr->leds[i]);
+		fr->cap_at = now;
+		clk_add(&fr->cap_at, FRAME_CAP_NSEC);
+	}
+
+	for (int c = 0; c < 3; c++)
+		frame_scale(fr->scaled[c], fr->rgb[c], lanes, fr->scale);
+
+	for (size_t i = 0; i < fr->num; i++) {
+		struct frame_led *led = &fr->leds[i];
+		int64_t bright;
+
+		if (led->color_fd >= 0) {
+			uint16_t rgb[3];
+
+			for (int c = 0; c < 3; c++)
+				rgb[c] = led->max == 255 ? fr->scaled[c][i] :
+					(uint16_t) (fr->scaled[c][i] * led->max / 255);
+
+			if (!led->color_written || memcmp(rgb, led->written_rgb, sizeof(rgb))) {
+				if (!b->write_color(led->color_fd, rgb))
+					return false;
+				memcpy(led->written_rgb, rgb, sizeof(rgb));
+				led->color_written = true;
+				fr->num_writes++;
+			}
+		}
+
+		/* the brightness as given is kept, to go back to it once the cap is lifted */
+		bright = led->bright < led->cap ? led->bright : led->cap;
+
+		if (bright >= 0 && bright != led->written) {
+			if (!b->write(led->fd, bright))
+				return false;
+			led->written = bright;
+			fr->num_writes++;
+		}
+	}
+
+	fr->num_frames++;
+	return true;
+}
+
+/**
+ * frame_pace:
+ * @fr:		frame state
+ * @next:	absolute time the next frame is due
+ *
+ * Waits for the next frame to be due, if a frame period is set.
+ **/
+static void frame_pace(struct frames *fr, struct timespec *next)
+{
+	int64_t usec = fr->conf->usec;
+
+	if (usec <= 0)
+		return;
+
+	clk_add(next, usec * 1000);
+	clk_sleep_until(next);
+}
+
+/**
+ * frame_u16:
+ * @p:		little endian bytes
+ *
+ * Returns: the decoded value
+ **/
+static unsigned frame_u16(const unsigned char *p)
+{
+	return p[0] | (unsigned) p[1] << 8;
+}
+
+/**
+ * frame_read_bin:
+ * @fr:		frame state
+ * @file:	input positioned after the magic
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool frame_read_bin(struct frames *fr, FILE *file)
+{
+	unsigned char hdr[4], entry[8];
+	char name[NAME_MAX + 1];
+	size_t num_leds;
+	burn_o ssize_t *index = NULL;
+	struct timespec next;
+
+	if (fread(hdr, 1, 4, file) != 4 || hdr[0] != FRAME_VERSION) {
+		vlog_err("unsupported frame header");
+		return false;
+	}
+
+	num_leds = frame_u16(hdr + 2);
+
+	if (!(index = calloc(num_leds + 1, sizeof(*index)))) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	/* open every LED up front */
+	for (size_t i = 0; i < num_leds; i++) {
+		int len = getc(file);
+
+		if (len == EOF || fread(name, 1, len, file) != (size_t) len) {
+			vlog_err("truncated frame header");
+			return false;
+		}
+
+		name[len] = '\0';
+
+		if ((index[i] = frame_led(fr, name)) < 0)
+			return false;
+	}
+
+	clk_now(&next);
+
+	while (fread(hdr, 1, 2, file) == 2) {
+		size_t num = frame_u16(hdr);
+
+		for (size_t i = 0; i < num; i++) {
+			unsigned rgb[3];
+			unsigned led, bright;
+
+			if (fread(entry, 1, sizeof(entry), file) != sizeof(entry)) {
+				vlog_err("truncated frame");
+				return false;
+			}
+
+			if ((led = frame_u16(entry)) >= num_leds) {
+				vlog_err("frame entry for unknown LED %u", led);
+				return false;
+			}
+
+			rgb[0] = entry[2];
+			rgb[1] = entry[3];
+			rgb[2] = entry[4];
+			bright = frame_u16(entry + 6);
+
+			frame_set(fr, index[led], rgb, bright == FRAME_KEEP ? -1 : (int64_t) bright);
+		}
+
+		if (!frame_flush(fr))
+			return false;
+
+		frame_pace(fr, &next);
+	}
+
+	return true;
+}
+
+/**
+ * frame_read_csv:
+ * @fr:		frame state
+ * @file:	input
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool frame_read_csv(struct frames *fr, FILE *file)
+{
+	char line[NAME_MAX + 64], name[NAME_MAX + 1];
+	bool pending = false;
+	size_t lineno = 0;
+	struct timespec next;
+
+	clk_now(&next);
+
+	while (fgets(line, sizeof(line), file)) {
+		unsigned rgb[3];
+		int64_t bright = -1;
+		ssize_t led;
+		int n;
+
+		lineno++;
+
+		if (line[0] == '#')
+			continue;
+
+		if (line[0] == '\n' || line[0] == '\r') {
+			if (pending && !frame_flush(fr))
+				return false;
+			if (pending)
+				frame_pace(fr, &next);
+			pending = false;
+			continue;
+		}
+
+		n = sscanf(line, "%255[^,],%u,%u,%u,%" SCNd64,
+				name, &rgb[0], &rgb[1], &rgb[2], &bright);
+
+		if (n < 4) {
+			vlog_err("frame line %zu: malformed entry", lineno);
+			return false;
+		}
+
+		if ((led = frame_led(fr, name)) < 0)
+			return false;
+
+		frame_set(fr, led, rgb, bright);
+		pending = true;
+	}
+
+	return !pending || frame_flush(fr);
+}
+
+/**
+ * frame_play:
+ * @conf:	configuration object holding the frame file
+ *
+ * Reads frames from a file, or standard input for "-", and applies
+ * them one after the other, spaced out by the usec of conf.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool frame_play(struct light_conf *conf)
+{
+	bool ret;
+	int c;
+	char magic[sizeof(FRAME_MAGIC) - 1];
+	struct timespec t0, t1;
+	struct frames fr = {
+		.conf = conf,
+		.scale = (uint16_t) (conf->frame_scale * 256 / VALUE_PCT_MAX),
+	};
+	bool is_stdin = strcmp(conf->frames, "-") == 0;
+	FILE *file = is_stdin ? stdin : fopen(conf->frames, "rb");
+
+	if (!file) {
+		vlog_err("open '%s': %m", conf->frames);
+		return false;
+	}
+
+	clk_now(&t0);
+
+	/* no LED name starts with the first byte of the magic */
+	if ((c = getc(file)) == FRAME_MAGIC[0]) {
+		ret = fread(magic + 1, 1, sizeof(magic) - 1, file) == sizeof(magic) - 1 &&
+			memcmp(magic + 1, FRAME_MAGIC + 1, sizeof(magic) - 1) == 0;
+		if (!ret)
+			vlog_err("unrecognized frame file");
+		else
+			ret = frame_read_bin(&fr, file);
+	} else {
+		ungetc(c, file);
+		ret = frame_read_csv(&fr, file);
+	}
+
+	clk_now(&t1);
+
+	if (fr.num_frames > 0) {
+		double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		vlog_info("%zu frames on %zu LEDs, %zu writes in %.3f s (%.1f fps)",
+				fr.num_frames, fr.num, fr.num_writes, sec,
+				sec > 0 ? fr.num_frames / sec : 0);
+	}
+
+	for (size_t i = 0; i < fr.num; i++) {
+		file_close(fr.leds[i].fd);
+		file_close(fr.leds[i].color_fd);
+	}
+
+	for (int i = 0; i < 3; i++) {
+		free(fr.rgb[i]);
+		free(fr.scaled[i]);
+	}
+
+	free(fr.leds);
+
+	if (!is_stdin)
+		fclose(file);
+
+	return ret;
+}
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdbool.h>
+
+#include "light.h"
+
+bool frame_play(struct light_conf *conf);
+
+#endif /* FRAME_H */
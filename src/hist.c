@@ -0,0 +1,476 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "light.h"
+#include "hist.h"
+
+/*
+ * The history is a ring of fixed-size records in <cache>/<target>.history,
+ * recorded only while the file exists. Writers claim a record by bumping
+ * the sequence counter of the ring, so appending takes no lock and no
+ * fsync. A record is valid once its seq field holds its sequence number
+ * plus one. Controllers are stored as indexes into a name table, which
+ * has room for the LEDs of a large keyboard and is only written to when
+ * a controller is first recorded.
+ */
+
+#define HIST_MAGIC 0x74736968
+#define HIST_VERSION 2
+#define HIST_CTRLS 1024
+#define HIST_NAME_MAX 64
+#define HIST_HEAD_SIZE 4096
+#define HIST_RECS 8192
+#define HIST_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+struct hist_rec {
+	uint64_t seq;
+	/* wall clock time, in microseconds since the epoch */
+	int64_t usec;
+	int32_t old_raw;
+	int32_t new_raw;
+	int32_t max;
+	uint32_t fade_usec;
+	uint16_t ctrl;
+	uint8_t op;
+	uint8_t source;
+	uint32_t reserved;
+};
+
+struct hist_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_recs;
+	uint32_t num_ctrls;
+	uint64_t next;
+	/* an append only writes to the first page and that of its record */
+	uint8_t reserved[HIST_HEAD_SIZE - 24];
+	char ctrls[HIST_CTRLS][HIST_NAME_MAX];
+	struct hist_rec recs[HIST_RECS];
+};
+
+/* the ring of the target stays mapped for appending until exit */
+static struct hist_map {
+	char path[PATH_MAX];
+	int fd;
+	struct hist_ring *ring;
+	/* a controller that can not be recorded is only warned about once */
+	bool warned;
+} hist_map;
+
+static const char *hist_ops[] = {
+	[LIGHT_SET] = "set",
+	[LIGHT_ADD] = "add",
+	[LIGHT_SUB] = "sub",
+	[LIGHT_RESTORE] = "restore",
+	[LIGHT_SCENE_APPLY] = "scene",
+};
+
+static const char *hist_sources[] = {
+	[HIST_FOREGROUND] = "foreground",
+	[HIST_DETACHED] = "detached",
+};
+
+/**
+ * hist_open:
+ * @conf:	configuration object holding the cache prefix
+ * @flags:	flags to pass to open
+ * @ring:	where to store the mapped ring
+ *
+ * Opens and maps the history of the target.
+ *
+ * Returns: fd of the ring, or -1 on failure
+ **/
+static int hist_open(struct light_conf *conf, int flags, struct hist_ring **ring)
+{
+	int fd;
+	struct hist_ring *r;
+	burn_o char *path = path_new();
+
+	if (!path || !(path = path_append(path, "%s.history", conf->cache_prefix)))
+		return -1;
+
+	if ((fd = open(path, flags, HIST_MODE)) < 0) {
+		/* recording is off unless the ring exists */
+		if (errno != ENOENT || (flags & O_CREAT))
+			vlog_err("open '%s': %m", path);
+		return -1;
+	}
+
+	if ((flags & O_CREAT) && (lockf(fd, F_LOCK, 0) < 0 || ftruncate(fd, sizeof(*r)) < 0)) {
+		vlog_err("'%s': %m", path);
+		close(fd);
+		return -1;
+	}
+
+	r = mmap(NULL, sizeof(*r), PROT_READ | ((flags & O_ACCMODE) == O_RDONLY ? 0 : PROT_WRITE),
+			MAP_SHARED, fd, 0);
+
+	if (r == MAP_FAILED) {
+		vlog_err("mmap '%s': %m", path);
+		close(fd);
+		return -1;
+	}
+
+	/* a history of an earlier layout is started over */
+	if ((flags & O_CREAT) && r->magic == HIST_MAGIC &&
+	    (r->version != HIST_VERSION || r->num_recs != HIST_RECS)) {
+		vlog_notice("starting '%s' over", path);
+		memset(r, 0, sizeof(*r));
+	}
+
+	if ((flags & O_CREAT) && r->magic == 0) {
+		r->version = HIST_VERSION;
+		r->num_recs = HIST_RECS;
+		__atomic_store_n(&r->magic, HIST_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	if (r->magic != HIST_MAGIC || r->version != HIST_VERSION || r->num_recs != HIST_RECS) {
+		vlog_err("'%s' has an unknown layout, see -R", path);
+		munmap(r, sizeof(*r));
+		close(fd);
+		return -1;
+	}
+
+	*ring = r;
+	return fd;
+}
+
+/**
+ * hist_ctrl:
+ * @ring:	mapped ring
+ * @fd:		fd of the ring
+ * @ctrl:	controller name
+ *
+ * Returns: index of the controller in the name table, or -1 on failure
+ **/
+static int hist_ctrl(struct hist_ring *ring, int fd, const char *ctrl)
+{
+	uint32_t i, num = __atomic_load_n(&ring->num_ctrls, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < num && i < HIST_CTRLS; i++)
+		if (strncmp(ring->ctrls[i], ctrl, HIST_NAME_MAX) == 0)
+			return i;
+
+	if (strlen(ctrl) >= HIST_NAME_MAX) {
+		if (!hist_map.warned)
+			vlog_warning("'%s' is too long a name to record", ctrl);
+		hist_map.warned = true;
+		return -1;
+	}
+
+	if (lockf(fd, F_LOCK, 0) < 0)
+		return -1;
+
+	/* another writer may have added it meanwhile */
+	for (i = 0; i < ring->num_ctrls && i < HIST_CTRLS; i++)
+		if (strncmp(ring->ctrls[i], ctrl, HIST_NAME_MAX) == 0)
+			break;
+
+	if (i == ring->num_ctrls && i < HIST_CTRLS) {
+		strncpy(ring->ctrls[i], ctrl, HIST_NAME_MAX);
+		__atomic_store_n(&ring->num_ctrls, i + 1, __ATOMIC_RELEASE);
+	}
+
+	lockf(fd, F_ULOCK, 0);
+
+	if (i >= HIST_CTRLS) {
+		if (!hist_map.warned)
+			vlog_warning("history has no room for '%s', %d controllers are recorded",
+					ctrl, HIST_CTRLS);
+		hist_map.warned = true;
+		return -1;
+	}
+
+	return (int) i;
+}
+
+/**
+ * hist_append:
+ * @conf:	configuration object of the controller
+ * @op:		operation causing the change
+ * @old_raw:	raw value before the change
+ * @new_raw:	raw value after the change
+ * @max:	raw maximum value
+ *
+ * Records a change in the history, if it exists.
+ **/
+void hist_append(struct light_conf *conf, LIGHT_OP_MODE op, int64_t old_raw,
+		int64_t new_raw, int64_t max)
+{
+	struct hist_ring *ring;
+	struct hist_rec *rec;
+	struct timespec now;
+	uint64_t seq;
+	int ctrl;
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s.history", conf->cache_prefix) >= PATH_MAX)
+		return;
+
+	/* open the ring once per target, or find once that there is none */
+	if (strcmp(hist_map.path, path) != 0) {
+		if (hist_map.ring) {
+			munmap(hist_map.ring, sizeof(*hist_map.ring));
+			close(hist_map.fd);
+			hist_map.ring = NULL;
+		}
+
+		memcpy(hist_map.path, path, sizeof(path));
+		hist_map.fd = hist_open(conf, O_RDWR, &hist_map.ring);
+	}
+
+	if (!(ring = hist_map.ring))
+		return;
+
+	if ((ctrl = hist_ctrl(ring, hist_map.fd, conf->ctrl)) >= 0) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		seq = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+		rec = &ring->recs[seq % HIST_RECS];
+
+		__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		rec->usec = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+		rec->old_raw = (int32_t) old_raw;
+		rec->new_raw = (int32_t) new_raw;
+		rec->max = (int32_t) max;
+		rec->fade_usec = (uint32_t) (conf->usec > UINT32_MAX ? UINT32_MAX : conf->usec);
+		rec->ctrl = (uint16_t) ctrl;
+		rec->op = (uint8_t) op;
+		rec->source = conf->detach && conf->usec > 0 ? HIST_DETACHED : HIST_FOREGROUND;
+
+		__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * hist_create:
+ * @conf:	configuration object holding the cache prefix
+ *
+ * Creates the history of the target, which turns recording on.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool hist_create(struct light_conf *conf)
+{
+	struct hist_ring *ring;
+	burn_fd fd = hist_open(conf, O_RDWR | O_CREAT, &ring);
+
+	if (fd < 0)
+		return false;
+
+	munmap(ring, sizeof(*ring));
+	return true;
+}
+
+/**
+ * hist_read:
+ * @ring:	mapped ring
+ * @seq:	sequence number of the record
+ * @rec:	where to copy the record
+ *
+ * Returns: true if the record is valid, otherwise false
+ **/
+static bool hist_read(const struct hist_ring *ring, uint64_t seq, struct hist_rec *rec)
+{
+	const struct hist_rec *r = &ring->recs[seq % HIST_RECS];
+
+	if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq + 1)
+		return false;
+
+	memcpy(rec, r, sizeof(*rec));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	/* the record may have been reused while it was copied */
+	return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq + 1 &&
+		rec->ctrl < HIST_CTRLS && rec->op < sizeof(hist_ops) / sizeof(*hist_ops) &&
+		hist_ops[rec->op] && rec->source <= HIST_DETACHED;
+}
+
+struct hist_level {
+	int64_t raw;
+	int64_t max;
+	int64_t usec;
+};
+
+struct hist_sum {
+	int64_t last_usec;
+	int64_t last_raw;
+	int64_t last_max;
+	size_t counts[LIGHT_CALIBRATE + 1];
+	size_t fades;
+	struct hist_level *levels;
+	size_t num_levels;
+};
+
+/**
+ * hist_hold:
+ * @sum:	summary of a controller
+ * @until:	time the last value was replaced
+ *
+ * Adds the time the last value was held for.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool hist_hold(struct hist_sum *sum, int64_t until)
+{
+	size_t i;
+	struct hist_level *l;
+
+	if (sum->last_raw < 0 || until <= sum->last_usec)
+		return true;
+
+	for (i = 0; i < sum->num_levels; i++)
+		if (sum->levels[i].raw == sum->last_raw && sum->levels[i].max == sum->last_max)
+			break;
+
+	if (i == sum->num_levels) {
+		if (!(l = realloc(sum->levels, (i + 1) * sizeof(*l)))) {
+			vlog_err("realloc: %m");
+			return false;
+		}
+		sum->levels = l;
+		sum->levels[i] = (struct hist_level) { sum->last_raw, sum->last_max, 0 };
+		sum->num_levels++;
+	}
+
+	sum->levels[i].usec += until - sum->last_usec;
+	return true;
+}
+
+/**
+ * hist_summary:
+ * @ring:	mapped ring
+ * @first:	sequence number of the oldest record
+ * @last:	sequence number after the newest record
+ *
+ * Prints the time spent at every value and the number of
+ * changes of each kind, per controller.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool hist_summary(const struct hist_ring *ring, uint64_t first, uint64_t last)
+{
+	bool ret = true;
+	burn_o struct hist_sum *sums = calloc(HIST_CTRLS, sizeof(*sums));
+	struct hist_rec rec;
+	struct timespec now;
+	int64_t now_usec;
+
+	if (!sums) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	for (size_t c = 0; c < HIST_CTRLS; c++)
+		sums[c].last_raw = -1;
+
+	for (uint64_t seq = first; seq < last && ret; seq++) {
+		struct hist_sum *sum;
+
+		if (!hist_read(ring, seq, &rec))
+			continue;
+
+		sum = &sums[rec.ctrl];
+		ret = hist_hold(sum, rec.usec);
+		sum->last_usec = rec.usec;
+		sum->last_raw = rec.new_raw;
+		sum->last_max = rec.max;
+		sum->counts[rec.op]++;
+		sum->fades += rec.fade_usec > 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	now_usec = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	printf("controller,raw,max,percent,seconds,share\n");
+
+	for (size_t c = 0; c < HIST_CTRLS; c++) {
+		struct hist_sum *sum = &sums[c];
+		int64_t total = 0;
+
+		if (ret)
+			ret = hist_hold(sum, now_usec);
+
+		for (size_t i = 0; i < sum->num_levels; i++)
+			total += sum->levels[i].usec;
+
+		for (size_t i = 0; i < sum->num_levels && total > 0; i++) {
+			const struct hist_level *l = &sum->levels[i];
+
+			printf("%.*s,%" PRId64 ",%" PRId64 ",%.2f,%.3f,%.4f\n",
+					HIST_NAME_MAX, ring->ctrls[c], l->raw, l->max,
+					l->max > 0 ? 100.0 * l->raw / l->max : 0.0,
+					l->usec / 1e6, (double) l->usec / total);
+		}
+
+		if (sum->last_raw >= 0)
+			printf("# %.*s: %zu set, %zu add, %zu sub, %zu restore, %zu scene, %zu fades\n",
+					HIST_NAME_MAX, ring->ctrls[c],
+					sum->counts[LIGHT_SET], sum->counts[LIGHT_ADD],
+					sum->counts[LIGHT_SUB], sum->counts[LIGHT_RESTORE],
+					sum->counts[LIGHT_SCENE_APPLY], sum->fades);
+
+		free(sum->levels);
+	}
+
+	return ret;
+}
+
+/**
+ * hist_export:
+ * @conf:	configuration object holding the export format
+ *
+ * Prints the history of the target as CSV records or as a summary.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool hist_export(struct light_conf *conf)
+{
+	bool ret = true;
+	struct hist_ring *ring;
+	struct hist_rec rec;
+	uint64_t first, last;
+	burn_fd fd = hist_open(conf, O_RDONLY, &ring);
+
+	if (fd < 0) {
+		vlog_err("no history recorded, see -R");
+		return false;
+	}
+
+	last = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+	first = last > HIST_RECS ? last - HIST_RECS : 0;
+
+	if (strcmp(conf->export, "summary") == 0) {
+		ret = hist_summary(ring, first, last);
+	} else {
+		printf("time,controller,op,source,old,new,max,fade_usec\n");
+
+		for (uint64_t seq = first; seq < last; seq++) {
+			if (!hist_read(ring, seq, &rec))
+				continue;
+
+			printf("%" PRId64 ".%06" PRId64 ",%.*s,%s,%s,%" PRId32 ",%" PRId32 ",%" PRId32 ",%" PRIu32 "\n",
+					rec.usec / 1000000, rec.usec % 1000000,
+					HIST_NAME_MAX, ring->ctrls[rec.ctrl],
+					hist_ops[rec.op], hist_sources[rec.source],
+					rec.old_raw, rec.new_raw, rec.max, rec.fade_usec);
+		}
+	}
+
+	munmap(ring, sizeof(*ring));
+	return ret;
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "light.h"
+
+typedef enum HIST_SOURCE {
+	HIST_FOREGROUND = 0,
+	HIST_DETACHED
+} HIST_SOURCE;
+
+void hist_append(struct light_conf *conf, LIGHT_OP_MODE op, int64_t old_raw,
+		int64_t new_raw, int64_t max);
+bool hist_create(struct light_conf *conf);
+bool hist_export(struct light_conf *conf);
+
+#endif /* HIST_H */
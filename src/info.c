@@ -10,23 +10,21 @@
 
 /**
  * info_list:
- * @prefix:	sysfs prefix to walk through
+ * @conf:	configuration object holding the backend and filters
  *
- * Prints controller names in the specified prefix.
+ * Prints controller names of the backend.
  *
  * Returns: false if could not list controllers or no
  *	      controllers found, otherwise true
  **/
-bool info_list(char *prefix)
+bool info_list(struct light_conf *conf)
 {
-	burn_dir dir = opendir(prefix);
+	burn_iter iter = ctrl_iter_new(conf);
 
-	if (!dir) {
-		vlog_err("opendir: %m");
+	if (!iter)
 		return false;
-	}
 
-	for (char *c; (c = ctrl_iter_next(dir)); free(c))
+	for (char *c; (c = ctrl_iter_next(iter)); free(c))
 		printf("%s\n", c);
 
 	return true;
@@ -47,8 +45,7 @@ bool info_help(void)
 
 /**
  * info_print:
- * @op:		operation mode to use
- * @prefix:	sysfs prefix to hand to list controllers
+ * @conf:	configuration object holding the operation mode
  * @exec:	whether or not to take action
  *
  * If exec is true, prints information
@@ -56,9 +53,9 @@ bool info_help(void)
  *
  * Returns: true if op_mode is an info mode, otherwise false
  **/
-bool info_print(LIGHT_OP_MODE op, char *prefix, bool exec)
+bool info_print(struct light_conf *conf, bool exec)
 {
-	switch (op) {
+	switch (conf->op_mode) {
 		case LIGHT_PRINT_HELP:
 			if (exec)
 				info_help();
@@ -69,7 +66,7 @@ bool info_print(LIGHT_OP_MODE op, char *prefix, bool exec)
 			break;
 		case LIGHT_LIST_CTRL:
 			if (exec)
-				info_list(prefix);
+				info_list(conf);
 			break;
 		default:
 			return false;
@@ -2,6 +2,7 @@
 
 #include <sys/stat.h>
 #include <errno.h>
+#include <string.h>
 
 #include "common.h"
 #include "vlog.h"
@@ -9,27 +10,30 @@
 #include "info.h"
 #include "ctrl.h"
 #include "light.h"
+#include "init.h"
 
 /**
  * init_sys:
+ * @root:	directory holding the device classes, or NULL
  * @tgt:	either "leds" or "backlight"
  *
  * Initializes the sysfs prefix string.
  *
  * Returns: pointer to allocated prefix, or NULL on failure
  **/
-static char *init_sys(const char *tgt)
+static char *init_sys(const char *root, const char *tgt)
 {
 	char *s;
 
 	if (!(s = path_new()))
 		return NULL;
 
-	return path_append(s, "/sys/class/%s", tgt);
+	return path_append(s, "%s/%s", root ? root : "/sys/class", tgt);
 }
 
 /**
  * init_cache:
+ * @root:	cache directory to use instead of the default, or NULL
  * @tgt:	either "leds" or "backlight"
  *
  * Initializes the cache prefix string,
@@ -37,13 +41,15 @@ static char *init_sys(const char *tgt)
  *
  * Returns: pointer to allocated prefix, or NULL on failure
  **/
-static char *init_cache(const char * const tgt)
+static char *init_cache(const char *root, const char * const tgt)
 {
 	char *s;
 	const char *env, *dirfmt;
 	int r;
 
-	if ((geteuid() == 0 && (env = "/var/cache")) || 
+	if ((env = root))
+		dirfmt = "%s";
+	else if ((geteuid() == 0 && (env = "/var/cache")) || 
 	    (env = getenv("XDG_CACHE_HOME")))
 		dirfmt = "%s/" PROG;
 	else if ((env = getenv("HOME")))
@@ -89,19 +95,74 @@ bool init_strings(struct light_conf *conf)
 	else
 		return false;
 
-	if (!(conf->sys_prefix = init_sys(tgt)))
+	if (!(conf->sys_prefix = init_sys(conf->sys_root, tgt)))
 		return false;
 
-	/* info mode needs no more initialization */
-	if (info_print(conf->op_mode, conf->sys_prefix, false))
+	/* info mode needs no more initialization, but listing asks backends
+	 * that keep what they know about their controllers in the cache */
+	if (info_print(conf, false)) {
+		if (conf->op_mode == LIGHT_LIST_CTRL)
+			conf->cache_prefix = init_cache(conf->cache_root, tgt);
 		return true;
+	}
 
-	if (!(conf->cache_prefix = init_cache(tgt)))
+	if (!(conf->cache_prefix = init_cache(conf->cache_root, tgt)))
 		return false;
 
+	/* these name their own controllers, or need none */
+	if (conf->op_mode == LIGHT_SCENE_APPLY || conf->op_mode == LIGHT_FRAMES ||
+	    conf->op_mode == LIGHT_HIST_CREATE || conf->op_mode == LIGHT_HIST_EXPORT)
+		return true;
+
 	/* Make sure we have a valid controller before we proceed */
 	if ((conf->ctrl_mode == LIGHT_CTRL_ALL) || conf->ctrl || ctrl_auto(conf))
 		return true;
 
 	return false;
 }
+
+/**
+ * init_ctrl_conf:
+ * @conf:	configuration object of the invocation
+ * @target:	target of the controller
+ * @op:		operation to adjust the brightness of the controller with
+ * @ctrl:	name of the controller, or NULL to select one automatically
+ *
+ * Creates the configuration object of a single controller, for the
+ * operations that handle every controller with an object of its own.
+ *
+ * Returns: initialized configuration object, or NULL on failure
+ **/
+struct light_conf *init_ctrl_conf(const struct light_conf *conf, LIGHT_TARGET target,
+		LIGHT_OP_MODE op, const char *ctrl)
+{
+	struct light_conf *c = light_conf_clone(conf);
+
+	if (!c)
+		return NULL;
+
+	/* the patterns select controllers of the target of the invocation */
+	if (target != conf->target) {
+		free(c->ctrl_globs);
+		c->ctrl_globs = NULL;
+		c->ctrl_globs_len = 0;
+	}
+
+	c->target = target;
+	c->op_mode = op;
+	c->ctrl_mode = ctrl ? LIGHT_CTRL_SPECIFY : LIGHT_CTRL_AUTO;
+	c->field = LIGHT_BRIGHTNESS;
+
+	if (ctrl && !(c->ctrl = strdup(ctrl))) {
+		vlog_err("strdup: %m");
+		light_free(&c);
+		return NULL;
+	}
+
+	if (!init_strings(c)) {
+		light_free(&c);
+		return NULL;
+	}
+
+	return c;
+}
@@ -5,6 +5,10 @@
 
 #include <stdbool.h>
 
+#include "light.h"
+
 bool init_strings(struct light_conf *conf);
+struct light_conf *init_ctrl_conf(const struct light_conf *conf, LIGHT_TARGET target,
+		LIGHT_OP_MODE op, const char *ctrl);
 
 #endif /* INIT_H */
@@ -0,0 +1,382 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "light.h"
+#include "backend.h"
+#include "clk.h"
+#include "file.h"
+#include "exec.h"
+#include "level.h"
+
+/*
+ * Many firmware controllers only change at a few of their raw values.
+ * Calibration writes the raw range, reads back what the hardware applied
+ * and keeps the first raw value of every distinct result, the levels,
+ * in <cache>/<target>.<ctrl>.levels:
+ *
+ *	max <raw maximum>
+ *	<level>
+ *	...
+ *
+ * Some firmware also ramps to every written value by itself. Before the
+ * sweep, calibration writes a single step and samples the applied value.
+ * If it passes through values in between, the time the ramp took is kept
+ * in <cache>/<target>.<ctrl>.ramp, and smooth adjustments of the
+ * controller become a single write.
+ */
+
+/* raw values written by a sweep, at most */
+#define LEVEL_SWEEP_MAX 1024
+/* reads of the applied value before it is taken as settled */
+#define LEVEL_SETTLE_TRIES 20
+#define LEVEL_SETTLE_USEC 1000
+/* longest ramp that is measured, and the samples it must be still for */
+#define LEVEL_RAMP_WINDOW_USEC 500000
+#define LEVEL_RAMP_STILL 10
+/* values in between the ramp must pass through to be told from a delay */
+#define LEVEL_RAMP_MIN_STEPS 2
+
+/**
+ * level_load:
+ * @conf:	configuration object holding the controller
+ * @max:	raw maximum of the controller
+ *
+ * Loads the levels of the controller into conf. Levels of
+ * a different maximum are stale and ignored.
+ *
+ * Returns: true if levels were loaded, otherwise false
+ **/
+bool level_load(struct light_conf *conf, int64_t max)
+{
+	int64_t val, file_max, *levels = NULL;
+	size_t num = 0;
+	burn_o char *path = light_path_new(conf, LIGHT_LEVELS);
+	burn_file file = path ? fopen(path, "r") : NULL;
+
+	free(conf->levels);
+	conf->levels = NULL;
+	conf->num_levels = 0;
+
+	if (!file)
+		return false;
+
+	if (fscanf(file, "max %" SCNd64, &file_max) != 1 || file_max != max) {
+		vlog_warning("ignoring stale levels of '%s'", conf->ctrl);
+		/* cppcheck-suppress resourceLeak */
+		return false;
+	}
+
+	while (fscanf(file, "%" SCNd64, &val) == 1) {
+		int64_t *l;
+
+		/* levels must be sorted and in range */
+		if (val < 0 || val > max || (num > 0 && val <= levels[num - 1]))
+			break;
+
+		if (!(l = realloc(levels, (num + 1) * sizeof(*l)))) {
+			vlog_err("realloc: %m");
+			break;
+		}
+
+		levels = l;
+		levels[num++] = val;
+	}
+
+	if (num == 0 || !feof(file)) {
+		vlog_warning("ignoring malformed levels of '%s'", conf->ctrl);
+		free(levels);
+		/* cppcheck-suppress resourceLeak */
+		return false;
+	}
+
+	conf->levels = levels;
+	conf->num_levels = num;
+
+	/* cppcheck-suppress resourceLeak */
+	return true;
+}
+
+/**
+ * level_load_ramp:
+ * @conf:	configuration object holding the controller
+ *
+ * Loads how long the firmware of the controller ramps into conf.
+ **/
+void level_load_ramp(struct light_conf *conf)
+{
+	burn_o char *path = light_path_new(conf, LIGHT_RAMP);
+	int64_t usec = path ? file_read(path) : -ENOMEM;
+
+	conf->ramp_usec = usec > 0 ? usec : 0;
+}
+
+/**
+ * level_settle:
+ * @conf:	configuration object holding the controller
+ *
+ * Waits for the applied value to stop changing, after
+ * the firmware ramp if it has one.
+ *
+ * Returns: the applied value, or -errno on failure
+ **/
+int64_t level_settle(struct light_conf *conf)
+{
+	int64_t prev, val;
+
+	if (conf->ramp_usec > 0)
+		clk_sleep(conf->ramp_usec * 1000);
+
+	val = conf->backend->read_actual(conf, conf->ctrl);
+
+	for (int i = 0; i < LEVEL_SETTLE_TRIES && val >= 0; i++) {
+		clk_sleep(LEVEL_SETTLE_USEC * 1000);
+		prev = val;
+		if ((val = conf->backend->read_actual(conf, conf->ctrl)) == prev)
+			break;
+	}
+
+	return val;
+}
+
+/**
+ * level_save:
+ * @conf:	configuration object holding the controller
+ * @max:	raw maximum of the controller
+ * @levels:	levels found
+ * @num:	number of levels
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool level_save(struct light_conf *conf, int64_t max,
+		const int64_t *levels, size_t num)
+{
+	burn_o char *path = light_path_new(conf, LIGHT_LEVELS);
+	burn_o char *tmp = path ? path_new() : NULL;
+	burn_file file = NULL;
+
+	if (!path || !tmp || !(tmp = path_append(tmp, "%s.tmp", path)))
+		return false;
+
+	if (!(file = fopen(tmp, "w"))) {
+		vlog_err("open '%s': %m", tmp);
+		return false;
+	}
+
+	fprintf(file, "max %" PRId64 "\n", max);
+	for (size_t i = 0; i < num; i++)
+		fprintf(file, "%" PRId64 "\n", levels[i]);
+
+	if (fflush(file) != 0 || fsync(fileno(file)) != 0 || rename(tmp, path) != 0) {
+		vlog_err("save '%s': %m", path);
+		unlink(tmp);
+		/* cppcheck-suppress resourceLeak */
+		return false;
+	}
+
+	/* cppcheck-suppress resourceLeak */
+	return true;
+}
+
+/**
+ * level_ramp:
+ * @conf:	configuration object holding the controller
+ * @fd:		locked fd of the brightness
+ * @max:	raw maximum of the controller
+ *
+ * Writes a quarter of the raw range away from the applied value, and
+ * samples the applied value until it has been still for a while.
+ *
+ * Returns: microseconds the firmware ramped for, 0 if it does not
+ *          ramp, or -errno on failure
+ **/
+static int64_t level_ramp(struct light_conf *conf, int fd, int64_t max)
+{
+	struct timespec t0, now;
+	int64_t from, to, val, prev, last = 0;
+	size_t steps = 0, still = 0;
+
+	if ((from = level_settle(conf)) < 0)
+		return from;
+
+	/* too few values to tell a ramp apart */
+	if (max < 4 * (LEVEL_RAMP_MIN_STEPS + 1))
+		return 0;
+
+	to = from < max / 2 ? from + max / 4 : from - max / 4;
+
+	if (!conf->backend->write(fd, to))
+		return -EIO;
+
+	clk_now(&t0);
+	prev = from;
+
+	while (still < LEVEL_RAMP_STILL) {
+		int64_t usec;
+
+		clk_sleep(LEVEL_SETTLE_USEC * 1000);
+		clk_now(&now);
+		usec = (int64_t) (now.tv_sec - t0.tv_sec) * 1000000 +
+			(now.tv_nsec - t0.tv_nsec) / 1000;
+
+		if ((val = conf->backend->read_actual(conf, conf->ctrl)) < 0)
+			return val;
+
+		if (val == prev) {
+			still++;
+		} else {
+			/* count the values strictly in between */
+			if (val != to && (val - from) * (to - val) > 0)
+				steps++;
+			still = 0;
+			last = usec;
+		}
+
+		prev = val;
+
+		if (usec >= LEVEL_RAMP_WINDOW_USEC)
+			break;
+	}
+
+	vlog_info("'%s': %zu values in between over %" PRId64 " us",
+			conf->ctrl, steps, last);
+
+	return steps >= LEVEL_RAMP_MIN_STEPS ? (last > 0 ? last : 1) : 0;
+}
+
+/**
+ * level_save_ramp:
+ * @conf:	configuration object holding the controller
+ * @usec:	microseconds the firmware ramps for, 0 if it does not
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool level_save_ramp(struct light_conf *conf, int64_t usec)
+{
+	burn_o char *path = light_path_new(conf, LIGHT_RAMP);
+	burn_o char *tmp = path ? path_new() : NULL;
+	burn_file file = NULL;
+
+	if (!path || !tmp || !(tmp = path_append(tmp, "%s.tmp", path)))
+		return false;
+
+	if (usec == 0) {
+		if (unlink(path) < 0 && errno != ENOENT)
+			vlog_warning("unlink '%s': %m", path);
+		/* cppcheck-suppress resourceLeak */
+		return true;
+	}
+
+	if (!(file = fopen(tmp, "w"))) {
+		vlog_err("open '%s': %m", tmp);
+		return false;
+	}
+
+	fprintf(file, "%" PRId64 "\n", usec);
+
+	if (fflush(file) != 0 || fsync(fileno(file)) != 0 || rename(tmp, path) != 0) {
+		vlog_err("save '%s': %m", path);
+		unlink(tmp);
+		/* cppcheck-suppress resourceLeak */
+		return false;
+	}
+
+	/* cppcheck-suppress resourceLeak */
+	return true;
+}
+
+/**
+ * level_calibrate:
+ * @conf:	configuration object holding the controller
+ *
+ * Sweeps the raw range of the controller, stores the levels that
+ * take effect and prints them. The brightness is restored afterwards.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool level_calibrate(struct light_conf *conf)
+{
+	bool ret = true;
+	const struct backend *b = conf->backend;
+	int64_t max, curr, ramp, step, last = -1, raw = 0;
+	size_t num = 0, num_writes = 0;
+	burn_o int64_t *levels = NULL;
+	file_locked_fd fd = b->open(conf, conf->ctrl);
+
+	if (fd < 0 || (curr = b->read_fd(fd)) < 0 ||
+	    (max = b->read(conf, conf->ctrl, LIGHT_MAX_BRIGHTNESS)) <= 0)
+		return false;
+
+	if (b->read_actual(conf, conf->ctrl) < 0) {
+		vlog_err("'%s' does not report the applied brightness", conf->ctrl);
+		return false;
+	}
+
+	conf->ramp_usec = 0;
+
+	if ((ramp = level_ramp(conf, fd, max)) < 0 || !level_save_ramp(conf, ramp)) {
+		b->write(fd, curr);
+		return false;
+	}
+
+	/* the sweep waits for every ramp */
+	if ((conf->ramp_usec = ramp) > 0)
+		printf("%s: firmware ramps over %" PRId64 " us\n", conf->ctrl, ramp);
+
+	step = (max + LEVEL_SWEEP_MAX - 1) / LEVEL_SWEEP_MAX;
+
+	if (!(levels = calloc(max / step + 2, sizeof(*levels)))) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	for (;;) {
+		int64_t actual;
+
+		if (!b->write(fd, raw) || (actual = level_settle(conf)) < 0) {
+			ret = false;
+			break;
+		}
+
+		num_writes++;
+
+		if (actual != last)
+			levels[num++] = raw;
+		last = actual;
+
+		if (raw == max)
+			break;
+		raw = raw + step > max ? max : raw + step;
+	}
+
+	if (!b->write(fd, curr))
+		ret = false;
+
+	if (!ret)
+		return false;
+
+	vlog_info("'%s': %zu levels in %zu writes", conf->ctrl, num, num_writes);
+
+	if (num == num_writes) {
+		burn_o char *path = light_path_new(conf, LIGHT_LEVELS);
+
+		/* every value takes effect, nothing to snap to */
+		if (path && unlink(path) < 0 && errno != ENOENT)
+			vlog_warning("unlink '%s': %m", path);
+		printf("%s: every raw value takes effect\n", conf->ctrl);
+		return true;
+	}
+
+	printf("%s:", conf->ctrl);
+	for (size_t i = 0; i < num; i++)
+		printf(" %" PRId64, levels[i]);
+	printf("\n");
+
+	return level_save(conf, max, levels, num);
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "light.h"
+
+bool level_load(struct light_conf *conf, int64_t max);
+void level_load_ramp(struct light_conf *conf);
+int64_t level_settle(struct light_conf *conf);
+bool level_calibrate(struct light_conf *conf);
+
+#endif /* LEVEL_H */
@@ -2,8 +2,11 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "light.h"
+#include "backend.h"
+#include "value.h"
 #include "vlog.h"
 
 /**
@@ -22,7 +25,24 @@ struct light_conf *light_new(void)
 		return NULL;
 	}
 
+	conf->backend = &backend_sysfs;
 	conf->ctrl = NULL;
+	conf->ctrl_globs = NULL;
+	conf->ctrl_globs_len = 0;
+	conf->devices = NULL;
+	conf->num_devices = 0;
+	conf->step = 0;
+	conf->ctrl_type = NULL;
+	conf->scene = NULL;
+	conf->frames = NULL;
+	conf->export = NULL;
+	conf->follow = NULL;
+	conf->adapt = NULL;
+	conf->sequence = NULL;
+	conf->frame_scale = VALUE_PCT_MAX;
+	conf->ctrl_min_max = 0;
+	conf->sys_root = NULL;
+	conf->cache_root = NULL;
 	conf->sys_prefix = NULL;
 	conf->cache_prefix = NULL;
 	conf->ctrl_mode = LIGHT_CTRL_UNSET;
@@ -32,11 +52,78 @@ struct light_conf *light_new(void)
 	conf->field = LIGHT_FIELD_UNSET;
 	conf->value = 0;
 	conf->usec = 0;
+	conf->rate = 0;
+	conf->rate_min = 0;
+	conf->rate_max = LIGHT_RATE_MAX_USEC;
+	conf->rate_mode = LIGHT_PERCENT;
 	conf->cached_max = 0;
+	conf->cached_val = -1;
+	conf->levels = NULL;
+	conf->num_levels = 0;
+	conf->ramp_usec = 0;
+	conf->settle = false;
+	conf->detach = false;
+	conf->source = NULL;
+	conf->priority = 0;
+	conf->hold = 0;
 
 	return conf;
 }
 
+/**
+ * light_conf_clone:
+ * @conf:	configuration object to copy
+ *
+ * Creates a configuration object with the settings of another one,
+ * for operations that handle controllers with their own objects.
+ * The controller, input devices, levels and cached values are left
+ * out, and the paths are worked out again by init_strings().
+ *
+ * Returns: light configuration object, or NULL on memory error
+ **/
+struct light_conf *light_conf_clone(const struct light_conf *conf)
+{
+	struct light_conf *c = light_new();
+
+	if (!c)
+		return NULL;
+
+	*c = *conf;
+	c->ctrl = NULL;
+	c->ctrl_globs = NULL;
+	c->devices = NULL;
+	c->num_devices = 0;
+	c->sys_root = NULL;
+	c->cache_root = NULL;
+	c->sys_prefix = NULL;
+	c->cache_prefix = NULL;
+	c->cached_max = 0;
+	c->cached_val = -1;
+	c->levels = NULL;
+	c->num_levels = 0;
+
+	/* the patterns themselves belong to the command line */
+	if (conf->ctrl_globs_len > 0 &&
+	    !(c->ctrl_globs = malloc(conf->ctrl_globs_len * sizeof(*c->ctrl_globs)))) {
+		vlog_err("malloc: %m");
+		light_free(&c);
+		return NULL;
+	}
+
+	if (c->ctrl_globs)
+		memcpy(c->ctrl_globs, conf->ctrl_globs,
+				conf->ctrl_globs_len * sizeof(*c->ctrl_globs));
+
+	if ((conf->sys_root && !(c->sys_root = strdup(conf->sys_root))) ||
+	    (conf->cache_root && !(c->cache_root = strdup(conf->cache_root)))) {
+		vlog_err("strdup: %m");
+		light_free(&c);
+		return NULL;
+	}
+
+	return c;
+}
+
 /**
  * light_defaults:
  * @conf:	configuration object to populate
@@ -5,13 +5,21 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef enum LIGHT_FIELD {
 	LIGHT_FIELD_UNSET = 0,
 	LIGHT_BRIGHTNESS,
 	LIGHT_MAX_BRIGHTNESS,
 	LIGHT_MIN_CAP,
-	LIGHT_SAVERESTORE
+	LIGHT_SAVERESTORE,
+	LIGHT_FADE,
+	LIGHT_LEVELS,
+	LIGHT_RAMP,
+	LIGHT_CLAIM,
+	LIGHT_CURVE,
+	LIGHT_CAP,
+	LIGHT_CAP_POLICY
 } LIGHT_FIELD;
 
 typedef enum LIGHT_TARGET {
@@ -37,7 +45,22 @@ typedef enum LIGHT_OP_MODE {
 	LIGHT_PRINT_VERSION,	/* Prints version info and exits */
 	LIGHT_LIST_CTRL,
 	LIGHT_RESTORE,
-	LIGHT_SAVE
+	LIGHT_SAVE,
+	LIGHT_WAIT,
+	LIGHT_QUERY,
+	LIGHT_PUBLISH,
+	LIGHT_SCENE_APPLY,
+	LIGHT_SCENE_SAVE,
+	LIGHT_FRAMES,
+	LIGHT_HIST_CREATE,
+	LIGHT_HIST_EXPORT,
+	LIGHT_LISTEN,
+	LIGHT_FOLLOW,
+	LIGHT_ADAPT,
+	LIGHT_POLICY,
+	LIGHT_PERSIST,
+	LIGHT_SEQUENCE,
+	LIGHT_CALIBRATE
 } LIGHT_OP_MODE;
 
 typedef enum LIGHT_VAL_MODE {
@@ -47,10 +70,35 @@ typedef enum LIGHT_VAL_MODE {
 	LIGHT_PERCENT_EXPONENTIAL
 } LIGHT_VAL_MODE;
 
+struct backend;
+
+#define LIGHT_RATE_MAX_USEC 1000000
+
 struct light_conf {
+	const struct backend *backend;
+	char *sys_root;
+	char *cache_root;
 	char *sys_prefix;
 	char *cache_prefix;
 	char *ctrl;
+	char **ctrl_globs;
+	size_t ctrl_globs_len;
+	/* input devices to listen to for brightness keys */
+	char **devices;
+	size_t num_devices;
+	int64_t step;
+	const char *ctrl_type;
+	const char *scene;
+	const char *frames;
+	const char *export;
+	/* controller to mirror onto the selected ones */
+	const char *follow;
+	/* picture the brightness adapts to */
+	const char *adapt;
+	/* keyframes played on the selected controllers */
+	const char *sequence;
+	int64_t frame_scale;
+	int64_t ctrl_min_max;
 	LIGHT_CTRL_MODE ctrl_mode;
 	LIGHT_OP_MODE op_mode;
 	LIGHT_VAL_MODE val_mode;
@@ -58,7 +106,29 @@ struct light_conf {
 	LIGHT_FIELD field;
 	int64_t value;
 	int64_t usec;
+	/* fade speed in percent per second, 0 for a fixed duration */
+	int64_t rate;
+	int64_t rate_min;
+	int64_t rate_max;
+	LIGHT_VAL_MODE rate_mode;
 	int64_t cached_max;
+	/* brightness read along with the other controllers, or -1 */
+	int64_t cached_val;
+	/* effective raw values of the controller, if calibrated */
+	int64_t *levels;
+	size_t num_levels;
+	/* microseconds the firmware takes to reach a written value, if it ramps */
+	int64_t ramp_usec;
+	/* wait for the applied value to settle after a single write */
+	bool settle;
+	bool detach;
+	/* who asks for the change, and how much it takes precedence */
+	const char *source;
+	int64_t priority;
+	/* microseconds the change holds the controller against lower priorities */
+	int64_t hold;
+	/* set once a change was dropped for a claim of a higher priority */
+	bool dropped;
 };
 
 static inline void light_free(struct light_conf **conf)
@@ -66,14 +136,20 @@ static inline void light_free(struct light_conf **conf)
 	if (!(*conf))
 		return;
 	free((*conf)->ctrl);
+	free((*conf)->ctrl_globs);
+	free((*conf)->devices);
+	free((*conf)->sys_root);
+	free((*conf)->cache_root);
 	free((*conf)->sys_prefix);
 	free((*conf)->cache_prefix);
+	free((*conf)->levels);
 	free(*conf);
 }
 
 #define light_t __attribute__((cleanup(light_free))) struct light_conf *
 
 struct light_conf *light_new(void);
+struct light_conf *light_conf_clone(const struct light_conf *conf);
 void light_defaults(struct light_conf *conf);
 
 #endif				/* LIGHT_H */
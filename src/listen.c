@@ -0,0 +1,682 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <linux/input.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "ctrl.h"
+#include "light.h"
+#include "value.h"
+#include "backend.h"
+#include "init.h"
+#include "file.h"
+#include "exec.h"
+#include "fade.h"
+#include "pub.h"
+#include "clk.h"
+#include "hist.h"
+#include "level.h"
+#include "arb.h"
+#include "probe.h"
+#include "metrics.h"
+#include "listen.h"
+
+/*
+ * Brightness keys are read from input devices as struct input_event
+ * records. Character devices and pipes are handled as events arrive,
+ * regular files hold recorded events that are replayed at the times
+ * they were recorded at.
+ *
+ * Every key press or repeat moves the target of a fade, which goes on
+ * from wherever the controller is at, so that holding a key results
+ * in a single smooth adjustment. Controllers stay open, and are only
+ * locked while they fade.
+ */
+
+#define LISTEN_EVENTS 64
+#define LISTEN_PERIOD ((int64_t) (SMOOTH_ITER_DURATION))
+
+static const struct {
+	unsigned short code;
+	LIGHT_TARGET target;
+	LIGHT_OP_MODE op;
+} listen_keys[] = {
+	{ KEY_BRIGHTNESSUP, LIGHT_BACKLIGHT, LIGHT_ADD },
+	{ KEY_BRIGHTNESSDOWN, LIGHT_BACKLIGHT, LIGHT_SUB },
+	{ KEY_KBDILLUMUP, LIGHT_KEYBOARD, LIGHT_ADD },
+	{ KEY_KBDILLUMDOWN, LIGHT_KEYBOARD, LIGHT_SUB },
+};
+
+struct listen_ctrl {
+	struct light_conf *conf;
+	struct pub pub;
+	bool publish;
+	int fd;
+	int64_t max;
+	/* raw value last written or read */
+	int64_t last;
+	int64_t from;
+	int64_t to;
+	/* index of the next step, out of steps */
+	int64_t step;
+	int64_t steps;
+	/* time of the first step */
+	struct timespec t0;
+	bool active;
+};
+
+struct listen_target {
+	bool resolved;
+	struct listen_ctrl *ctrls;
+	size_t num;
+};
+
+struct listen_dev {
+	const char *path;
+	int fd;
+	/* events arrive as they happen, rather than being recorded */
+	bool live;
+	/* ev holds a recorded event that is not due yet */
+	bool pending;
+	struct input_event ev;
+};
+
+struct listen {
+	struct light_conf *conf;
+	/* indexed by LIGHT_TARGET */
+	struct listen_target targets[LIGHT_KEYBOARD + 1];
+	struct listen_dev *devs;
+	size_t num_devs;
+	/* difference of the clock to the time of recorded events */
+	bool synced;
+	int64_t offset;
+};
+
+/**
+ * listen_nsec:
+ * @ts:		time to convert
+ *
+ * Returns: the time in nanoseconds
+ **/
+static int64_t listen_nsec(const struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/**
+ * listen_add:
+ * @l:		listener state
+ * @t:		target to add the controller to
+ * @target:	target of the controller
+ * @ctrl:	name of the controller, or NULL to select one automatically
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool listen_add(struct listen *l, struct listen_target *t, LIGHT_TARGET target,
+		const char *ctrl)
+{
+	struct listen_ctrl *lc, *ctrls = realloc(t->ctrls, (t->num + 1) * sizeof(*ctrls));
+
+	if (!ctrls) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	t->ctrls = ctrls;
+	lc = memset(&ctrls[t->num], 0, sizeof(*lc));
+	lc->fd = -1;
+
+	if (!(lc->conf = init_ctrl_conf(l->conf, target, LIGHT_ADD, ctrl)))
+		return false;
+
+	lc->conf->value = l->conf->step;
+
+	t->num++;
+	return true;
+}
+
+/**
+ * listen_resolve:
+ * @l:		listener state
+ * @target:	target of the key
+ *
+ * Selects the controllers of a target the first time one of its keys
+ * is pressed. The target of the invocation uses its own selection,
+ * the other one is selected automatically.
+ *
+ * Returns: the controllers of the target
+ **/
+static struct listen_target *listen_resolve(struct listen *l, LIGHT_TARGET target)
+{
+	struct light_conf *conf = l->conf;
+	struct listen_target *t = &l->targets[target];
+
+	if (t->resolved)
+		return t;
+
+	t->resolved = true;
+
+	if (target != conf->target) {
+		listen_add(l, t, target, NULL);
+	} else if (conf->ctrl_mode != LIGHT_CTRL_ALL) {
+		listen_add(l, t, target, conf->ctrl);
+	} else {
+		burn_iter iter = ctrl_iter_new(conf);
+
+		for (char *ctrl; iter && (ctrl = ctrl_iter_next(iter)); free(ctrl))
+			listen_add(l, t, target, ctrl);
+	}
+
+	if (t->num == 0)
+		vlog_warning("no controller for %s keys",
+				target == LIGHT_BACKLIGHT ? "brightness" : "keyboard");
+
+	return t;
+}
+
+/**
+ * listen_lock:
+ * @lc:		opened controller to lock
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool listen_lock(struct listen_ctrl *lc)
+{
+	int64_t wait;
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (lockf(lc->fd, F_LOCK, 0) < 0)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wait = (int64_t) (t1.tv_sec - t0.tv_sec) * 1000000 +
+		(t1.tv_nsec - t0.tv_nsec) / 1000;
+	PROBE3(lock_acquire, lc->conf->ctrl, lc->fd, wait);
+	METRICS_OBSERVE(METRICS_LOCK_WAIT, wait);
+
+	return true;
+}
+
+/**
+ * listen_unlock:
+ * @lc:		locked controller to unlock, keeping it open
+ **/
+static void listen_unlock(struct listen_ctrl *lc)
+{
+	PROBE1(lock_release, lc->fd);
+
+	if (lockf(lc->fd, F_ULOCK, 0) < 0)
+		vlog_warning("lockf: %m");
+}
+
+/**
+ * listen_open:
+ * @lc:		controller to open
+ *
+ * Opens the controller once, and keeps it open but unlocked.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool listen_open(struct listen_ctrl *lc)
+{
+	struct light_conf *c = lc->conf;
+
+	if (lc->fd >= 0)
+		return true;
+
+	if ((lc->max = exec_get_max(c)) <= 0)
+		return false;
+
+	if ((lc->fd = c->backend->open(c, c->ctrl)) < 0)
+		return false;
+
+	level_load_ramp(c);
+	listen_unlock(lc);
+
+	lc->publish = pub_attach(&lc->pub, c, lc->max);
+	vlog_notice("listening for '%s'", c->ctrl);
+	return true;
+}
+
+/**
+ * listen_key:
+ * @l:		listener state
+ * @lc:		controller to adjust
+ * @op:		LIGHT_ADD or LIGHT_SUB
+ * @now:	current time
+ *
+ * Moves the target of the fade by one step, starting a fade from the
+ * current value if none is running.
+ **/
+static void listen_key(struct listen *l, struct listen_ctrl *lc, LIGHT_OP_MODE op,
+		const struct timespec *now)
+{
+	struct light_conf *c = lc->conf;
+	int64_t base, to, usec;
+
+	if (!listen_open(lc) || !arb_allow(c))
+		return;
+
+	if (!lc->active) {
+		/* a key press supersedes a detached fade */
+		if (!fade_stop(c) || !listen_lock(lc)) {
+			vlog_err("can not lock '%s'", c->ctrl);
+			return;
+		}
+
+		if ((lc->last = c->backend->read_fd(lc->fd)) < 0) {
+			listen_unlock(lc);
+			return;
+		}
+	}
+
+	/* repeats step on from the target, not from where the fade is */
+	base = lc->active ? lc->to : lc->last;
+
+	c->op_mode = op;
+	c->value = l->conf->step;
+
+	if ((to = exec_target(c, base, exec_get_min(c), lc->max)) < 0) {
+		if (!lc->active)
+			listen_unlock(lc);
+		return;
+	}
+
+	hist_append(c, op, base, to, lc->max);
+
+	usec = exec_duration(c, lc->last, to, lc->max);
+
+	lc->from = lc->last;
+	lc->to = to;
+	lc->steps = usec * SMOOTH_WRITES_PER_SECOND / 1000000;
+	/* the firmware ramps to a single write on its own */
+	lc->steps = lc->steps < 1 || c->ramp_usec > 0 ? 1 : lc->steps;
+	lc->step = 1;
+	lc->t0 = *now;
+	lc->active = true;
+}
+
+/**
+ * listen_due:
+ * @lc:		fading controller
+ *
+ * Returns: time the next step of the fade is due, in nanoseconds
+ **/
+static int64_t listen_due(const struct listen_ctrl *lc)
+{
+	return listen_nsec(&lc->t0) + (lc->step - 1) * LISTEN_PERIOD;
+}
+
+/**
+ * listen_advance:
+ * @lc:		controller to advance
+ * @now:	current time
+ *
+ * Writes the latest step of the fade that is due, skipping
+ * any that have been missed.
+ **/
+static void listen_advance(struct listen_ctrl *lc, const struct timespec *now)
+{
+	struct light_conf *c = lc->conf;
+	int64_t k, val;
+
+	if (!lc->active || listen_due(lc) > listen_nsec(now))
+		return;
+
+	k = (listen_nsec(now) - listen_nsec(&lc->t0)) / LISTEN_PERIOD + 1;
+	k = k > lc->steps ? lc->steps : k;
+	val = lc->from + (lc->to - lc->from) * k / lc->steps;
+
+	if (c->levels)
+		val = value_snap(c->levels, c->num_levels, val);
+
+	if (val != lc->last) {
+		vlog_info("writing %" PRId64 " to '%s'", val, c->ctrl);
+		if (c->backend->write(lc->fd, val)) {
+			lc->last = val;
+			if (lc->publish)
+				pub_step(&lc->pub, val);
+		}
+	}
+
+	lc->step = k + 1;
+
+	if (k == lc->steps) {
+		int64_t late = listen_nsec(now) - listen_nsec(&lc->t0) -
+			(lc->steps - 1) * LISTEN_PERIOD;
+
+		lc->active = false;
+		listen_unlock(lc);
+		METRICS_COUNT(METRICS_FADES);
+		METRICS_OBSERVE(METRICS_FADE_OVERRUN, late / 1000);
+	}
+}
+
+/**
+ * listen_event:
+ * @l:		listener state
+ * @ev:		input event
+ * @now:	current time
+ **/
+static void listen_event(struct listen *l, const struct input_event *ev,
+		const struct timespec *now)
+{
+	/* presses and repeats, but not releases */
+	if (ev->type != EV_KEY || ev->value == 0)
+		return;
+
+	for (size_t i = 0; i < sizeof(listen_keys) / sizeof(*listen_keys); i++) {
+		struct listen_target *t;
+
+		if (listen_keys[i].code != ev->code)
+			continue;
+
+		vlog_debug("key %u %s", ev->code, ev->value == 2 ? "repeat" : "press");
+
+		t = listen_resolve(l, listen_keys[i].target);
+
+		for (size_t j = 0; j < t->num; j++)
+			listen_key(l, &t->ctrls[j], listen_keys[i].op, now);
+	}
+}
+
+/**
+ * listen_close:
+ * @dev:	device to close
+ **/
+static void listen_close(struct listen_dev *dev)
+{
+	vlog_info("closing '%s'", dev->path);
+	close(dev->fd);
+	dev->fd = -1;
+	dev->pending = false;
+}
+
+/**
+ * listen_read:
+ * @dev:	device to read from
+ * @evs:	where to store the events
+ * @num:	number of events that fit
+ *
+ * Returns: number of events read, 0 at the end, or -1 if none are ready
+ **/
+static ssize_t listen_read(struct listen_dev *dev, struct input_event *evs, size_t num)
+{
+	ssize_t r = read(dev->fd, evs, num * sizeof(*evs));
+
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
+		return -1;
+
+	if (r < 0)
+		vlog_err("read '%s': %m", dev->path);
+	else if (r % sizeof(*evs) != 0)
+		vlog_err("read '%s': partial input event", dev->path);
+
+	if (r <= 0 || r % sizeof(*evs) != 0)
+		return 0;
+
+	return r / sizeof(*evs);
+}
+
+/**
+ * listen_replay:
+ * @l:		listener state
+ * @dev:	device holding recorded events
+ * @now:	current time
+ *
+ * Handles the recorded events that are due, and reads ahead
+ * to the next one.
+ **/
+static void listen_replay(struct listen *l, struct listen_dev *dev,
+		const struct timespec *now)
+{
+	while (dev->fd >= 0) {
+		int64_t t;
+
+		if (!dev->pending) {
+			if (listen_read(dev, &dev->ev, 1) <= 0) {
+				listen_close(dev);
+				return;
+			}
+			dev->pending = true;
+		}
+
+		t = (int64_t) dev->ev.input_event_sec * 1000000000 +
+			(int64_t) dev->ev.input_event_usec * 1000;
+
+		/* the first recorded event happens now */
+		if (!l->synced) {
+			l->offset = listen_nsec(now) - t;
+			l->synced = true;
+		}
+
+		if (t + l->offset > listen_nsec(now))
+			return;
+
+		dev->pending = false;
+		listen_event(l, &dev->ev, now);
+	}
+}
+
+/**
+ * listen_deadline:
+ * @l:		listener state
+ * @deadline:	where to store the time of the next fade step or recorded event
+ *
+ * Returns: true if there is a deadline, false otherwise
+ **/
+static bool listen_deadline(struct listen *l, int64_t *deadline)
+{
+	bool found = false;
+
+	for (size_t i = 0; i < l->num_devs; i++) {
+		struct listen_dev *dev = &l->devs[i];
+		int64_t t;
+
+		if (!dev->pending)
+			continue;
+
+		t = (int64_t) dev->ev.input_event_sec * 1000000000 +
+			(int64_t) dev->ev.input_event_usec * 1000 + l->offset;
+
+		if (!found || t < *deadline)
+			*deadline = t;
+		found = true;
+	}
+
+	for (size_t i = 0; i <= LIGHT_KEYBOARD; i++) {
+		for (size_t j = 0; j < l->targets[i].num; j++) {
+			struct listen_ctrl *lc = &l->targets[i].ctrls[j];
+
+			if (!lc->active)
+				continue;
+
+			if (!found || listen_due(lc) < *deadline)
+				*deadline = listen_due(lc);
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * listen_wait:
+ * @l:		listener state
+ * @pfds:	poll entries of the live devices
+ *
+ * Waits for live events until the next deadline, and handles them.
+ *
+ * Returns: false once there is nothing left to wait for, otherwise true
+ **/
+static bool listen_wait(struct listen *l, struct pollfd *pfds)
+{
+	struct input_event evs[LISTEN_EVENTS];
+	struct timespec now, until;
+	int64_t deadline = 0;
+	bool timed = listen_deadline(l, &deadline);
+	size_t num = 0;
+	int timeout = metrics_timeout();
+
+	for (size_t i = 0; i < l->num_devs; i++) {
+		if (l->devs[i].live && l->devs[i].fd >= 0) {
+			pfds[num].fd = l->devs[i].fd;
+			pfds[num].events = POLLIN;
+			pfds[num++].revents = 0;
+		}
+	}
+
+	if (num == 0) {
+		if (!timed)
+			return false;
+		until.tv_sec = deadline / 1000000000;
+		until.tv_nsec = deadline % 1000000000;
+		return clk_sleep_until(&until);
+	}
+
+	if (timed) {
+		int ms;
+
+		clk_now(&now);
+		deadline -= listen_nsec(&now);
+		ms = deadline <= 0 ? 0 : (int) ((deadline + 999999) / 1000000);
+		timeout = timeout < 0 || ms < timeout ? ms : timeout;
+	}
+
+	if (poll(pfds, num, timeout) < 0 && errno != EINTR) {
+		vlog_err("poll: %m");
+		return false;
+	}
+
+	clk_now(&now);
+
+	for (size_t i = 0, p = 0; i < l->num_devs; i++) {
+		struct listen_dev *dev = &l->devs[i];
+		ssize_t n;
+
+		if (!dev->live || dev->fd < 0 || !pfds[p++].revents)
+			continue;
+
+		while ((n = listen_read(dev, evs, LISTEN_EVENTS)) > 0)
+			for (ssize_t j = 0; j < n; j++)
+				listen_event(l, &evs[j], &now);
+
+		if (n == 0)
+			listen_close(dev);
+	}
+
+	return true;
+}
+
+/**
+ * listen_devs:
+ * @l:		listener state
+ *
+ * Opens the input devices, and finds out how their events arrive.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool listen_devs(struct listen *l)
+{
+	struct light_conf *conf = l->conf;
+
+	if (!(l->devs = calloc(conf->num_devices, sizeof(*l->devs)))) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	for (size_t i = 0; i < conf->num_devices; i++) {
+		struct listen_dev *dev = &l->devs[l->num_devs];
+		struct stat st;
+
+		dev->path = conf->devices[i];
+
+		if ((dev->fd = open(dev->path, O_RDONLY | O_NONBLOCK)) < 0) {
+			vlog_err("open '%s': %m", dev->path);
+			return false;
+		}
+
+		l->num_devs++;
+
+		if (fstat(dev->fd, &st) < 0) {
+			vlog_err("fstat '%s': %m", dev->path);
+			return false;
+		}
+
+		dev->live = !S_ISREG(st.st_mode);
+	}
+
+	return true;
+}
+
+/**
+ * listen_run:
+ * @conf:	configuration object holding the devices and step
+ *
+ * Adjusts the brightness whenever a brightness key is pressed,
+ * until every device has been closed.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool listen_run(struct light_conf *conf)
+{
+	bool ret;
+	struct timespec now;
+	struct listen l = { .conf = conf };
+	burn_o struct pollfd *pfds = calloc(conf->num_devices, sizeof(*pfds));
+
+	if (!pfds) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	if ((ret = listen_devs(&l))) {
+		bool live = false;
+
+		/* pressed keys hold the controllers, replayed ones do not */
+		for (size_t i = 0; i < l.num_devs; i++)
+			live = live || l.devs[i].live;
+		arb_hold(conf, live);
+
+		do {
+			clk_now(&now);
+
+			for (size_t i = 0; i < l.num_devs; i++)
+				if (!l.devs[i].live)
+					listen_replay(&l, &l.devs[i], &now);
+
+			for (size_t i = 0; i <= LIGHT_KEYBOARD; i++)
+				for (size_t j = 0; j < l.targets[i].num; j++)
+					listen_advance(&l.targets[i].ctrls[j], &now);
+
+			metrics_tick();
+		} while (listen_wait(&l, pfds));
+	}
+
+	for (size_t i = 0; i < l.num_devs; i++)
+		if (l.devs[i].fd >= 0)
+			close(l.devs[i].fd);
+
+	for (size_t i = 0; i <= LIGHT_KEYBOARD; i++) {
+		for (size_t j = 0; j < l.targets[i].num; j++) {
+			struct listen_ctrl *lc = &l.targets[i].ctrls[j];
+
+			if (lc->publish)
+				pub_detach(&lc->pub);
+			if (lc->fd >= 0)
+				close(lc->fd);
+			light_free(&lc->conf);
+		}
+		free(l.targets[i].ctrls);
+	}
+
+	free(l.devs);
+	return ret;
+}
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef LISTEN_H
+#define LISTEN_H
+
+#include <stdbool.h>
+
+#include "light.h"
+
+bool listen_run(struct light_conf *conf);
+
+#endif /* LISTEN_H */
@@ -8,9 +8,11 @@
 #include "parse.h"
 #include "init.h"
 #include "exec.h"
+#include "metrics.h"
 
 int main(int argc, char **argv)
 {
+	int ret = EXIT_SUCCESS;
 	light_t ctx = light_new();
 
 	if (!ctx)
@@ -23,13 +25,12 @@ int main(int argc, char **argv)
 
 	if (!(init_strings(ctx))) {
 		vlog_err("initialization failed");
-		return EXIT_FAILURE;
-	}
-
-	if (!exec_op(ctx)) {
+		ret = EXIT_FAILURE;
+	} else if (!exec_op(ctx)) {
 		vlog_err("execution failed");
-		return EXIT_FAILURE;
+		ret = EXIT_FAILURE;
 	}
 
-	return EXIT_SUCCESS;
+	metrics_flush();
+	return ret;
 }
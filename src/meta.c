@@ -0,0 +1,479 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "file.h"
+#include "light.h"
+#include "exec.h"
+#include "meta.h"
+
+/*
+ * Controller metadata is kept in one store per target, the file
+ * <cache>/<target>.meta, mapped into memory. Every controller that was
+ * written to has a record holding two slots. An update writes the older
+ * slot with the next generation and a checksum, so a torn write leaves
+ * the newer slot intact. Readers take the valid slot of the highest
+ * generation. The records follow the header up to the end of the file,
+ * which doubles in size whenever they fill it up; a process that finds
+ * more records than it mapped maps the file again.
+ */
+
+#define META_MAGIC 0x6174656d
+/* version 1 had a fixed room of 256 records, and is otherwise the same */
+#define META_VERSION 2
+#define META_RECS_MIN 64
+#define META_NAME_MAX 128
+#define META_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+struct meta_slot {
+	struct meta_data data;
+	uint32_t sum;
+	uint32_t reserved;
+};
+
+struct meta_rec {
+	char name[META_NAME_MAX];
+	struct meta_slot slots[2];
+};
+
+struct meta_store {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_recs;
+	uint32_t reserved;
+	struct meta_rec recs[];
+};
+
+/* stores stay mapped until exit, one per target */
+static struct meta_map {
+	char path[PATH_MAX];
+	int fd;
+	struct meta_store *store;
+	/* records there is room for in the mapping */
+	uint32_t room;
+} meta_maps[2];
+
+#define META_SIZE(recs) (sizeof(struct meta_store) + (size_t) (recs) * sizeof(struct meta_rec))
+
+/**
+ * meta_sum:
+ * @data:	slot contents
+ *
+ * Returns: FNV-1a hash of the slot contents
+ **/
+static uint32_t meta_sum(const struct meta_data *data)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < sizeof(*data); i++)
+		h = (h ^ p[i]) * 16777619u;
+
+	return h;
+}
+
+/**
+ * meta_slot:
+ * @rec:	record to look at
+ *
+ * Returns: index of the current slot, or -1 if neither is valid
+ **/
+static int meta_slot(const struct meta_rec *rec)
+{
+	int best = -1;
+
+	for (int i = 0; i < 2; i++) {
+		const struct meta_slot *s = &rec->slots[i];
+
+		if (s->data.generation == 0 || s->sum != meta_sum(&s->data))
+			continue;
+		if (best < 0 || s->data.generation > rec->slots[best].data.generation)
+			best = i;
+	}
+
+	return best;
+}
+
+/**
+ * meta_sync:
+ * @addr:	start of the modified range
+ * @len:	length of the modified range
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool meta_sync(void *addr, size_t len)
+{
+	uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) addr & ~(page - 1);
+
+	if (msync((void *) start, (uintptr_t) addr + len - start, MS_SYNC) < 0) {
+		vlog_err("msync: %m");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * meta_remap:
+ * @m:		store to map again
+ *
+ * Maps the whole file of the store, which may have grown since it was
+ * last mapped. Records found before are no longer valid.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool meta_remap(struct meta_map *m)
+{
+	struct meta_store *s;
+	struct stat st;
+	size_t room;
+
+	if (fstat(m->fd, &st) < 0) {
+		vlog_err("fstat '%s': %m", m->path);
+		return false;
+	}
+
+	room = ((size_t) st.st_size - sizeof(*s)) / sizeof(struct meta_rec);
+
+	if (m->store && room <= m->room)
+		return true;
+
+	if ((s = mmap(NULL, META_SIZE(room), PROT_READ | PROT_WRITE, MAP_SHARED,
+					m->fd, 0)) == MAP_FAILED) {
+		vlog_err("mmap '%s': %m", m->path);
+		return false;
+	}
+
+	if (m->store)
+		munmap(m->store, META_SIZE(m->room));
+
+	m->store = s;
+	m->room = (uint32_t) room;
+	return true;
+}
+
+/**
+ * meta_open:
+ * @conf:	configuration object holding the cache prefix and controller
+ *
+ * Opens and maps the store of the target, creating it if needed.
+ *
+ * Returns: the mapped store, or NULL on failure
+ **/
+static struct meta_map *meta_open(struct light_conf *conf)
+{
+	struct meta_map *m = NULL;
+	struct meta_store *s;
+	struct stat st;
+	char path[PATH_MAX];
+	int fd;
+
+	if (strlen(conf->ctrl) >= META_NAME_MAX) {
+		vlog_err("controller name too long for the metadata store");
+		return NULL;
+	}
+
+	if (snprintf(path, sizeof(path), "%s.meta", conf->cache_prefix) >= PATH_MAX) {
+		vlog_err("metadata store path too long");
+		return NULL;
+	}
+
+	for (size_t i = 0; i < sizeof(meta_maps) / sizeof(*meta_maps); i++) {
+		if (!meta_maps[i].store && !m)
+			m = &meta_maps[i];
+		else if (meta_maps[i].store && strcmp(meta_maps[i].path, path) == 0)
+			return &meta_maps[i];
+	}
+
+	if (!m) {
+		vlog_err("too many metadata stores");
+		return NULL;
+	}
+
+	if ((fd = open(path, O_RDWR | O_CREAT, META_MODE)) < 0) {
+		vlog_err("open '%s': %m", path);
+		return NULL;
+	}
+
+	if (lockf(fd, F_LOCK, 0) < 0 || fstat(fd, &st) < 0) {
+		vlog_err("lockf '%s': %m", path);
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size < (off_t) META_SIZE(1) && ftruncate(fd, META_SIZE(META_RECS_MIN)) < 0) {
+		vlog_err("ftruncate '%s': %m", path);
+		close(fd);
+		return NULL;
+	}
+
+	memcpy(m->path, path, sizeof(path));
+	m->fd = fd;
+
+	if (!meta_remap(m)) {
+		close(fd);
+		m->store = NULL;
+		return NULL;
+	}
+
+	s = m->store;
+
+	if (s->magic == 0) {
+		s->version = META_VERSION;
+		s->magic = META_MAGIC;
+		meta_sync(s, sizeof(s->magic) * 4);
+	}
+
+	/* only the room for records changed */
+	if (s->magic == META_MAGIC && s->version == 1) {
+		s->version = META_VERSION;
+		meta_sync(s, sizeof(s->magic) * 4);
+	}
+
+	if (s->magic != META_MAGIC || s->version != META_VERSION) {
+		vlog_err("'%s' is not a metadata store of version %d", path, META_VERSION);
+		munmap(s, META_SIZE(m->room));
+		m->store = NULL;
+		close(fd);
+		return NULL;
+	}
+
+	lockf(fd, F_ULOCK, 0);
+	return m;
+}
+
+/**
+ * meta_find:
+ * @m:		mapped store
+ * @ctrl:	controller name
+ *
+ * Returns: record of the controller, or NULL if there is none
+ **/
+static struct meta_rec *meta_find(struct meta_map *m, const char *ctrl)
+{
+	uint32_t num = __atomic_load_n(&m->store->num_recs, __ATOMIC_ACQUIRE);
+
+	/* grown by another process */
+	if (num > m->room && !meta_remap(m))
+		return NULL;
+
+	for (uint32_t i = 0; i < num && i < m->room; i++)
+		if (strncmp(m->store->recs[i].name, ctrl, META_NAME_MAX) == 0)
+			return &m->store->recs[i];
+
+	return NULL;
+}
+
+/**
+ * meta_legacy:
+ * @conf:	configuration object holding the controller
+ * @field:	field of the old cache file
+ * @path:	where to store the path of the old cache file, or NULL
+ *
+ * Returns: value of the old cache file, or -1 if there is none
+ **/
+static int64_t meta_legacy(struct light_conf *conf, LIGHT_FIELD field, char **path)
+{
+	int64_t val;
+	burn_o char *p = light_path_new(conf, field);
+
+	if (!p || (val = file_read(p)) < 0)
+		return -1;
+
+	if (path) {
+		*path = p;
+		p = NULL;
+	}
+
+	return val;
+}
+
+/**
+ * meta_add:
+ * @m:		mapped store, locked
+ * @conf:	configuration object holding the controller
+ *
+ * Adds a record for the controller, taking over the values of
+ * the old cache files, which are removed. The store is grown if
+ * it is full.
+ *
+ * Returns: the new record, or NULL on failure
+ **/
+static struct meta_rec *meta_add(struct meta_map *m, struct light_conf *conf)
+{
+	struct meta_store *s;
+	struct meta_rec *rec;
+	burn_o char *mincap_path = NULL;
+	burn_o char *saved_path = NULL;
+
+	/* another process may have grown it already */
+	if (m->store->num_recs >= m->room && !meta_remap(m))
+		return NULL;
+
+	if (m->store->num_recs >= m->room &&
+	    (ftruncate(m->fd, (off_t) META_SIZE((size_t) m->room * 2)) < 0 || !meta_remap(m))) {
+		vlog_err("can not grow '%s': %m", m->path);
+		return NULL;
+	}
+
+	s = m->store;
+	rec = &s->recs[s->num_recs];
+	memset(rec, 0, sizeof(*rec));
+	snprintf(rec->name, sizeof(rec->name), "%s", conf->ctrl);
+
+	rec->slots[0].data.mincap = meta_legacy(conf, LIGHT_MIN_CAP, &mincap_path);
+	rec->slots[0].data.saved = meta_legacy(conf, LIGHT_SAVERESTORE, &saved_path);
+	rec->slots[0].data.saved_max = -1;
+	rec->slots[0].data.generation = 1;
+	rec->slots[0].sum = meta_sum(&rec->slots[0].data);
+
+	if (!meta_sync(rec, sizeof(*rec)))
+		return NULL;
+
+	/* publish the record only once it is complete */
+	__atomic_store_n(&s->num_recs, s->num_recs + 1, __ATOMIC_RELEASE);
+
+	if (!meta_sync(&s->num_recs, sizeof(s->num_recs)))
+		return NULL;
+
+	if (mincap_path) {
+		vlog_notice("migrating '%s'", mincap_path);
+		unlink(mincap_path);
+	}
+
+	if (saved_path) {
+		vlog_notice("migrating '%s'", saved_path);
+		unlink(saved_path);
+	}
+
+	return rec;
+}
+
+/**
+ * meta_get:
+ * @conf:	configuration object holding the controller
+ * @data:	where to store the metadata
+ *
+ * A controller without a record has never been written to, and only
+ * the old cache files are read for it, leaving the store alone.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool meta_get(struct light_conf *conf, struct meta_data *data)
+{
+	struct meta_map *m = meta_open(conf);
+	struct meta_rec *rec;
+	int slot;
+
+	if (!m)
+		return false;
+
+	if (!(rec = meta_find(m, conf->ctrl))) {
+		data->mincap = meta_legacy(conf, LIGHT_MIN_CAP, NULL);
+		data->saved = meta_legacy(conf, LIGHT_SAVERESTORE, NULL);
+		data->saved_max = -1;
+		data->generation = 0;
+		return true;
+	}
+
+	if ((slot = meta_slot(rec)) < 0) {
+		vlog_warning("no valid metadata for '%s'", conf->ctrl);
+		data->mincap = data->saved = data->saved_max = -1;
+		data->generation = 0;
+		return true;
+	}
+
+	*data = rec->slots[slot].data;
+	return true;
+}
+
+/**
+ * meta_read:
+ * @conf:	configuration object holding the controller
+ * @field:	LIGHT_MIN_CAP or LIGHT_SAVERESTORE
+ *
+ * Returns: the value, -ENOENT if it is unset, or another -errno on failure
+ **/
+int64_t meta_read(struct light_conf *conf, LIGHT_FIELD field)
+{
+	struct meta_data data;
+	int64_t val;
+
+	if (!meta_get(conf, &data))
+		return -EIO;
+
+	val = field == LIGHT_MIN_CAP ? data.mincap : data.saved;
+	return val < 0 ? -ENOENT : val;
+}
+
+/**
+ * meta_set:
+ * @conf:	configuration object holding the controller
+ * @field:	LIGHT_MIN_CAP or LIGHT_SAVERESTORE
+ * @val:	raw value to store
+ * @max:	raw maximum value of the controller
+ *
+ * Adds a record for the controller on its first write.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool meta_set(struct light_conf *conf, LIGHT_FIELD field, int64_t val, int64_t max)
+{
+	bool ret;
+	struct meta_map *m = meta_open(conf);
+	struct meta_rec *rec;
+	struct meta_slot *next;
+	struct meta_data data;
+	int slot;
+
+	if (!m)
+		return false;
+
+	if (lockf(m->fd, F_LOCK, 0) < 0) {
+		vlog_err("lockf '%s': %m", m->path);
+		return false;
+	}
+
+	/* a record is only ever added with the lock held */
+	if (!(rec = meta_find(m, conf->ctrl)) && !(rec = meta_add(m, conf))) {
+		lockf(m->fd, F_ULOCK, 0);
+		return false;
+	}
+
+	if ((slot = meta_slot(rec)) < 0) {
+		data.mincap = data.saved = data.saved_max = -1;
+		data.generation = 0;
+	} else {
+		data = rec->slots[slot].data;
+	}
+
+	if (field == LIGHT_MIN_CAP) {
+		data.mincap = val;
+	} else {
+		data.saved = val;
+		data.saved_max = max;
+	}
+
+	data.generation++;
+
+	/* overwrite the older slot, the current one stays valid */
+	next = &rec->slots[slot == 0 ? 1 : 0];
+	next->data = data;
+	next->sum = meta_sum(&data);
+
+	ret = meta_sync(next, sizeof(*next));
+
+	lockf(m->fd, F_ULOCK, 0);
+	return ret;
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef META_H
+#define META_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "light.h"
+
+struct meta_data {
+	/* negative if unset */
+	int64_t mincap;
+	int64_t saved;
+	/* raw maximum when the value was saved */
+	int64_t saved_max;
+	uint64_t generation;
+};
+
+bool meta_get(struct light_conf *conf, struct meta_data *data);
+int64_t meta_read(struct light_conf *conf, LIGHT_FIELD field);
+bool meta_set(struct light_conf *conf, LIGHT_FIELD field, int64_t val, int64_t max);
+
+#endif /* META_H */
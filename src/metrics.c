@@ -0,0 +1,380 @@
+/* SPDX-License-Identifier: 0BSD */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "metrics.h"
+
+/*
+ * Every process counts into the metrics struct without any locking, and
+ * adds it to the totals in <dir>/brillo.prom.counts when it flushes. The
+ * totals are a mapped page that is only ever added to atomically, so no
+ * lock is taken for that either. Rendering the totals into brillo.prom
+ * takes a lock and a rename. A process that finds the lock taken leaves
+ * the page dirty, and the process holding it renders again until the
+ * page stays clean, so the file is current once the last one exits.
+ */
+
+/* changes with the layout of struct metrics */
+#define METRICS_MAGIC 0x6d657433
+#define METRICS_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+struct metrics_page {
+	uint32_t magic;
+	uint32_t dirty;
+	struct metrics totals;
+};
+
+struct metrics metrics;
+
+/* textfile collector directory, metrics are only kept in memory if NULL */
+static const char *metrics_dir;
+static struct timespec metrics_last;
+
+/* the totals stay mapped until exit once flushed into */
+static struct metrics_map {
+	int fd;
+	struct metrics_page *page;
+} metrics_map;
+
+struct metrics_info {
+	const char *name;
+	const char *help;
+};
+
+static const struct metrics_info metrics_counters[] = {
+	[METRICS_WRITES] = {"brillo_writes_total",
+		"Brightness values written to controllers."},
+	[METRICS_WRITE_ERRORS] = {"brillo_write_errors_total",
+		"Brightness values the controller driver failed to take."},
+	[METRICS_FADES] = {"brillo_fades_total",
+		"Smooth adjustments completed."},
+	[METRICS_DROPPED] = {"brillo_dropped_total",
+		"Requests dropped while a source of a higher priority held the controller."},
+};
+
+static const struct metrics_info metrics_hists[] = {
+	[METRICS_FADE_OVERRUN] = {"brillo_fade_overrun_seconds",
+		"Time smooth adjustments took beyond their planned duration."},
+	[METRICS_LOCK_WAIT] = {"brillo_lock_wait_seconds",
+		"Time waited for the lock of a controller."},
+	[METRICS_DISCOVERY] = {"brillo_discovery_seconds",
+		"Time taken to choose a controller automatically."},
+};
+
+static const int64_t metrics_bounds[METRICS_NUM_BUCKETS - 1] = {
+	10, 100, 1000, 10000, 100000, 1000000, 10000000,
+};
+
+static const char *const metrics_les[METRICS_NUM_BUCKETS] = {
+	"1e-05", "0.0001", "0.001", "0.01", "0.1", "1", "10", "+Inf",
+};
+
+/**
+ * metrics_observe:
+ * @h:		histogram to add to
+ * @usec:	observed time in microseconds
+ **/
+void metrics_observe(enum metrics_hist h, int64_t usec)
+{
+	size_t i = 0;
+
+	while (i < METRICS_NUM_BUCKETS - 1 && usec > metrics_bounds[i])
+		i++;
+
+	metrics.hists[h].buckets[i]++;
+	metrics.hists[h].sum += usec;
+}
+
+/**
+ * metrics_use:
+ * @dir:	textfile collector directory to write brillo.prom into
+ *
+ * Returns: true on success, false on failure
+ **/
+bool metrics_use(const char *dir)
+{
+#ifdef METRICS_DISABLE
+	(void) dir;
+	vlog_warning("metrics are not built in");
+#else
+	metrics_dir = dir;
+	clock_gettime(CLOCK_MONOTONIC, &metrics_last);
+#endif
+	return true;
+}
+
+/**
+ * metrics_reset:
+ *
+ * Forgets everything counted so far, such as in a new process
+ * that should only report what it does itself.
+ **/
+void metrics_reset(void)
+{
+	memset(&metrics, 0, sizeof(metrics));
+}
+
+/**
+ * metrics_open:
+ *
+ * Opens and maps the totals, creating them if needed.
+ *
+ * Returns: the mapped totals, or NULL on failure
+ **/
+static struct metrics_page *metrics_open(void)
+{
+	int fd;
+	char path[PATH_MAX];
+	struct stat st;
+	struct metrics_page *p;
+	uint32_t zero = 0;
+
+	if (metrics_map.page)
+		return metrics_map.page;
+
+	if (snprintf(path, sizeof(path), "%s/brillo.prom.counts", metrics_dir) >= (int) sizeof(path)) {
+		vlog_err("metrics path too long");
+		return NULL;
+	}
+
+	if ((fd = open(path, O_RDWR | O_CREAT, METRICS_MODE)) < 0) {
+		vlog_err("open '%s': %m", path);
+		return NULL;
+	}
+
+	/* growing a new file with zeros is harmless to concurrent creators */
+	if (fstat(fd, &st) < 0 || (st.st_size < (off_t) sizeof(*p) &&
+	    ftruncate(fd, sizeof(*p)) < 0)) {
+		vlog_err("'%s': %m", path);
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (p == MAP_FAILED) {
+		vlog_err("mmap '%s': %m", path);
+		close(fd);
+		return NULL;
+	}
+
+	__atomic_compare_exchange_n(&p->magic, &zero, METRICS_MAGIC, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+	if (p->magic != METRICS_MAGIC) {
+		vlog_err("'%s' has an unknown layout", path);
+		munmap(p, sizeof(*p));
+		close(fd);
+		return NULL;
+	}
+
+	metrics_map.fd = fd;
+	metrics_map.page = p;
+	return p;
+}
+
+/**
+ * metrics_print:
+ * @file:	file to print into
+ * @m:		totals to print
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool metrics_print(FILE *file, const struct metrics *m)
+{
+	for (size_t c = 0; c < METRICS_NUM_COUNTERS; c++) {
+		const struct metrics_info *info = &metrics_counters[c];
+
+		fprintf(file, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+				info->name, info->help, info->name, info->name,
+				m->counters[c]);
+	}
+
+	for (size_t h = 0; h < METRICS_NUM_HISTS; h++) {
+		const struct metrics_info *info = &metrics_hists[h];
+		uint64_t count = 0;
+
+		fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n",
+				info->name, info->help, info->name);
+
+		for (size_t i = 0; i < METRICS_NUM_BUCKETS; i++) {
+			count += m->hists[h].buckets[i];
+			fprintf(file, "%s_bucket{le=\"%s\"} %" PRIu64 "\n",
+					info->name, metrics_les[i], count);
+		}
+
+		fprintf(file, "%s_sum %" PRId64 ".%06" PRId64 "\n%s_count %" PRIu64 "\n",
+				info->name, m->hists[h].sum / 1000000,
+				m->hists[h].sum % 1000000, info->name, count);
+	}
+
+	return !ferror(file);
+}
+
+/**
+ * metrics_write:
+ * @m:		totals to write
+ *
+ * Writes the totals next to brillo.prom and renames them over it,
+ * so that it is never read half written.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool metrics_write(const struct metrics *m)
+{
+	bool ok;
+	FILE *file;
+	burn_o char *path = path_new();
+	burn_o char *tmp = path_new();
+
+	if (!path || !(path = path_append(path, "%s/brillo.prom", metrics_dir)) ||
+	    !tmp || !(tmp = path_append(tmp, "%s/brillo.prom.%d", metrics_dir, (int) getpid())))
+		return false;
+
+	if (!(file = fopen(tmp, "w"))) {
+		vlog_err("fopen '%s': %m", tmp);
+		return false;
+	}
+
+	ok = metrics_print(file, m);
+
+	if (fclose(file) != 0 || !ok || rename(tmp, path) < 0) {
+		vlog_err("write '%s': %m", path);
+		unlink(tmp);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * metrics_render:
+ * @p:		mapped totals
+ *
+ * Renders the totals into brillo.prom. Only one process renders at
+ * a time, any other leaves it to that one, which renders again for
+ * whatever was added meanwhile.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool metrics_render(struct metrics_page *p)
+{
+	struct metrics m;
+	const uint64_t *src = (const uint64_t *) &p->totals;
+	uint64_t *dst = (uint64_t *) &m;
+	bool ret = true;
+
+	if (lockf(metrics_map.fd, F_TLOCK, 0) < 0)
+		return errno == EACCES || errno == EAGAIN;
+
+	/* whatever is added from here on is left for the next pass */
+	while (ret && __atomic_exchange_n(&p->dirty, 0, __ATOMIC_SEQ_CST)) {
+		for (size_t i = 0; i < sizeof(m) / sizeof(*dst); i++)
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+		if (!(ret = metrics_write(&m)))
+			__atomic_store_n(&p->dirty, 1, __ATOMIC_SEQ_CST);
+	}
+
+	lockf(metrics_map.fd, F_ULOCK, 0);
+	return ret;
+}
+
+/**
+ * metrics_sync:
+ *
+ * Adds the metrics to the totals and starts counting from zero,
+ * then renders the totals if they changed.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool metrics_sync(void)
+{
+	struct metrics_page *p;
+	const uint64_t *src = (const uint64_t *) &metrics;
+	uint64_t *dst;
+
+	if (!metrics_dir)
+		return true;
+
+	clock_gettime(CLOCK_MONOTONIC, &metrics_last);
+
+	if (!(p = metrics_open()))
+		return false;
+
+	dst = (uint64_t *) &p->totals;
+
+	for (size_t i = 0; i < sizeof(metrics) / sizeof(*src); i++) {
+		if (src[i]) {
+			__atomic_fetch_add(&dst[i], src[i], __ATOMIC_RELAXED);
+			__atomic_store_n(&p->dirty, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+
+	metrics_reset();
+
+	if (__atomic_load_n(&p->dirty, __ATOMIC_SEQ_CST))
+		return metrics_render(p);
+
+	return true;
+}
+
+/**
+ * metrics_flush:
+ *
+ * Adds the metrics to the totals in the textfile collector directory,
+ * and renders brillo.prom, on exit.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool metrics_flush(void)
+{
+	return metrics_sync();
+}
+
+/**
+ * metrics_timeout:
+ *
+ * Returns: milliseconds until the metrics are due to be flushed,
+ *          or -1 if they are not written anywhere
+ **/
+int metrics_timeout(void)
+{
+	struct timespec now;
+	int64_t ms;
+
+	if (!metrics_dir)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = METRICS_INTERVAL_SEC * 1000 -
+		((int64_t) (now.tv_sec - metrics_last.tv_sec) * 1000 +
+		 (now.tv_nsec - metrics_last.tv_nsec) / 1000000);
+
+	return ms < 0 ? 0 : (int) ms;
+}
+
+/**
+ * metrics_tick:
+ *
+ * Flushes the metrics every METRICS_INTERVAL_SEC seconds, rendering
+ * what any process added since the last rendering, for long running
+ * operations.
+ **/
+void metrics_tick(void)
+{
+	if (metrics_timeout() == 0)
+		metrics_sync();
+}
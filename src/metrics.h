@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: 0BSD */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Counters and histograms kept in memory while running, and added to a
+ * textfile collector file of the Prometheus node exporter when leaving,
+ * or every METRICS_INTERVAL_SEC seconds in long running operations.
+ * Building with METRICS_DISABLE defined leaves out the accounting.
+ */
+
+#define METRICS_INTERVAL_SEC 15
+
+enum metrics_counter {
+	METRICS_WRITES,
+	METRICS_WRITE_ERRORS,
+	METRICS_FADES,
+	METRICS_DROPPED,
+	METRICS_NUM_COUNTERS,
+};
+
+enum metrics_hist {
+	METRICS_FADE_OVERRUN,
+	METRICS_LOCK_WAIT,
+	METRICS_DISCOVERY,
+	METRICS_NUM_HISTS,
+};
+
+/* upper bounds of the buckets in microseconds, the last one is +Inf */
+#define METRICS_NUM_BUCKETS 8
+
+struct metrics {
+	uint64_t counters[METRICS_NUM_COUNTERS];
+	struct {
+		uint64_t buckets[METRICS_NUM_BUCKETS];
+		int64_t sum;
+	} hists[METRICS_NUM_HISTS];
+};
+
+extern struct metrics metrics;
+
+#ifdef METRICS_DISABLE
+#define METRICS_COUNT(c) ((void) 0)
+#define METRICS_OBSERVE(h, usec) ((void) (usec))
+#else
+#define METRICS_COUNT(c) (metrics.counters[c]++)
+#define METRICS_OBSERVE(h, usec) metrics_observe(h, usec)
+#endif
+
+void metrics_observe(enum metrics_hist h, int64_t usec);
+bool metrics_use(const char *dir);
+bool metrics_flush(void);
+int metrics_timeout(void);
+void metrics_tick(void);
+void metrics_reset(void);
+
+#endif /* METRICS_H */
@@ -8,8 +8,11 @@
 #include "path.h"
 #include "info.h"
 #include "ctrl.h"
+#include "backend.h"
 #include "value.h"
 #include "light.h"
+#include "metrics.h"
+#include "arb.h"
 
 #define PARSE_SET(str, box, item) \
 	if (box != 0) { \
@@ -58,6 +61,88 @@ static bool parse_check(LIGHT_OP_MODE op, LIGHT_FIELD field)
 	}
 }
 
+/**
+ * parse_rate:
+ * @ctx:	configuration object to store the rate in
+ * @arg:	percent per second, optionally followed by the
+ *		shortest and longest duration in microseconds
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool parse_rate(struct light_conf *ctx, const char *arg)
+{
+	double pct;
+	int n = sscanf(arg, "%lf,%" SCNd64 ",%" SCNd64, &pct,
+			&ctx->rate_min, &ctx->rate_max);
+
+	if (n < 1 || !(pct > 0)) {
+		vlog_err("rate not recognizable");
+		return false;
+	}
+
+	if (ctx->rate_min < 0 || ctx->rate_max < ctx->rate_min) {
+		vlog_err("rate durations must be in increasing order");
+		return false;
+	}
+
+	ctx->rate = (int64_t) (pct * (VALUE_PCT_MAX / 100));
+	if (ctx->rate < 1)
+		ctx->rate = 1;
+
+	return true;
+}
+
+/**
+ * parse_glob:
+ * @ctx:	configuration object to add the pattern to
+ * @glob:	controller name or fnmatch pattern
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool parse_glob(struct light_conf *ctx, char *glob)
+{
+	char **globs;
+
+	if (!path_component(glob)) {
+		vlog_err("can't handle controller: '%s'", glob);
+		return false;
+	}
+
+	globs = realloc(ctx->ctrl_globs, (ctx->ctrl_globs_len + 1) * sizeof(*globs));
+
+	if (!globs) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	globs[ctx->ctrl_globs_len++] = glob;
+	ctx->ctrl_globs = globs;
+
+	return true;
+}
+
+/**
+ * parse_device:
+ * @ctx:	configuration object to add the device to
+ * @path:	path of an input device, or of recorded input events
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool parse_device(struct light_conf *ctx, char *path)
+{
+	char **devices = realloc(ctx->devices, (ctx->num_devices + 1) * sizeof(*devices));
+
+	if (!devices) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	devices[ctx->num_devices++] = path;
+	ctx->devices = devices;
+
+	return true;
+}
+
 /**
  * parse_args:
  * @argc	argument count
@@ -71,11 +156,14 @@ static bool parse_check(LIGHT_OP_MODE op, LIGHT_FIELD field)
 bool parse_args(int argc, char **argv, struct light_conf *ctx)
 {
 	int opt, level;
-	char *value = NULL, *ctrl = NULL;
+	char *value = NULL;
+	char *step = "5";
 
 	level = -1;
+	/* set by arb_defaults() unless given */
+	ctx->hold = -1;
 
-	while ((opt = getopt(argc, argv, "HhVGS:A:U:LIObmclkaes:pqrv:u:")) != -1) {
+	while ((opt = getopt(argc, argv, "HhVGS:A:U:LIOWFPCRX:n:N:f:g:bmclkaes:t:M:pqrv:u:y:dB:E:i:T:wo:z:j:D:YKQ:")) != -1) {
 		switch (opt) {
 			/* -- Operations -- */
 		case 'H':
@@ -109,6 +197,66 @@ bool parse_args(int argc, char **argv, struct light_conf *ctx)
 		case 'O':
 			PARSE_SET_OP(LIGHT_SAVE);
 			break;
+		case 'W':
+			PARSE_SET_OP(LIGHT_WAIT);
+			break;
+		case 'F':
+			PARSE_SET_OP(LIGHT_QUERY);
+			break;
+		case 'P':
+			PARSE_SET_OP(LIGHT_PUBLISH);
+			break;
+		case 'C':
+			PARSE_SET_OP(LIGHT_CALIBRATE);
+			break;
+		case 'R':
+			PARSE_SET_OP(LIGHT_HIST_CREATE);
+			break;
+		case 'X':
+			PARSE_SET_OP(LIGHT_HIST_EXPORT);
+			if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "summary") != 0) {
+				vlog_err("export format must be csv or summary");
+				return info_help();
+			}
+			ctx->export = optarg;
+			break;
+		case 'E':
+			if (ctx->op_mode != LIGHT_LISTEN) {
+				PARSE_SET_OP(LIGHT_LISTEN);
+			}
+			if (!parse_device(ctx, optarg))
+				return info_help();
+			break;
+		case 'n':
+			PARSE_SET_OP(LIGHT_SCENE_APPLY);
+			ctx->scene = optarg;
+			break;
+		case 'N':
+			PARSE_SET_OP(LIGHT_SCENE_SAVE);
+			ctx->scene = optarg;
+			break;
+		case 'f':
+			PARSE_SET_OP(LIGHT_FRAMES);
+			ctx->frames = optarg;
+			break;
+		case 'j':
+			PARSE_SET_OP(LIGHT_FOLLOW);
+			ctx->follow = optarg;
+			break;
+		case 'D':
+			PARSE_SET_OP(LIGHT_ADAPT);
+			ctx->adapt = optarg;
+			break;
+		case 'Y':
+			PARSE_SET_OP(LIGHT_POLICY);
+			break;
+		case 'K':
+			PARSE_SET_OP(LIGHT_PERSIST);
+			break;
+		case 'Q':
+			PARSE_SET_OP(LIGHT_SEQUENCE);
+			ctx->sequence = optarg;
+			break;
 
 			/* -- Targets -- */
 		case 'l':
@@ -137,8 +285,26 @@ bool parse_args(int argc, char **argv, struct light_conf *ctx)
 			PARSE_SET_CTRL(LIGHT_CTRL_ALL);
 			break;
 		case 's':
-			PARSE_SET_CTRL(LIGHT_CTRL_SPECIFY);
-			ctrl = optarg;
+			if (ctx->ctrl_mode != LIGHT_CTRL_SPECIFY) {
+				PARSE_SET_CTRL(LIGHT_CTRL_SPECIFY);
+			}
+			if (!parse_glob(ctx, optarg))
+				return info_help();
+			break;
+		case 't':
+			if (strcmp(optarg, "firmware") != 0 &&
+			    strcmp(optarg, "platform") != 0 &&
+			    strcmp(optarg, "raw") != 0) {
+				vlog_err("type must be firmware, platform or raw");
+				return info_help();
+			}
+			ctx->ctrl_type = optarg;
+			break;
+		case 'M':
+			if (sscanf(optarg, "%" SCNd64, &ctx->ctrl_min_max) != 1) {
+				vlog_err("minimum max brightness not recognizable");
+				return info_help();
+			}
 			break;
 			/* -- Value modes -- */
 		case 'p':
@@ -168,6 +334,43 @@ bool parse_args(int argc, char **argv, struct light_conf *ctx)
 				return info_help();
 			}
 			break;
+		case 'y':
+			if (!parse_rate(ctx, optarg))
+				return info_help();
+			break;
+		case 'g':
+			if ((ctx->frame_scale = value_from_string(LIGHT_PERCENT, optarg)) < 0) {
+				vlog_err("frame brightness not recognizable");
+				return info_help();
+			}
+			break;
+		case 'i':
+			step = optarg;
+			break;
+		case 'd':
+			ctx->detach = true;
+			break;
+		case 'w':
+			ctx->settle = true;
+			break;
+		case 'o':
+			if (!arb_source(ctx, optarg))
+				return info_help();
+			break;
+		case 'z':
+			if (sscanf(optarg, "%" SCNd64, &ctx->hold) != 1 || ctx->hold < 0) {
+				vlog_err("hold time not recognizable");
+				return info_help();
+			}
+			break;
+		case 'B':
+			if (!backend_set(ctx, optarg))
+				return info_help();
+			break;
+		case 'T':
+			if (!metrics_use(optarg))
+				return info_help();
+			break;
 		default:
 			return info_help();
 		}
@@ -177,25 +380,57 @@ bool parse_args(int argc, char **argv, struct light_conf *ctx)
 		vlog_lvl_set((vlog_lvl_t) level);
 
 	light_defaults(ctx);
+	arb_defaults(ctx);
 
 	if (!parse_check(ctx->op_mode, ctx->field))
 		return info_help();
 
-	if (ctx->field != LIGHT_BRIGHTNESS && ctx->usec != 0) {
+	if (ctx->usec != 0 && ctx->rate != 0) {
+		fprintf(stderr, "Time and rate arguments can not be used in conjunction.\n");
+		return info_help();
+	}
+
+	if (ctx->field != LIGHT_BRIGHTNESS && (ctx->usec != 0 || ctx->rate != 0)) {
 		vlog_warning("Resetting time to zero for non-brightness field");
 		ctx->usec = 0;
+		ctx->rate = 0;
 	}
 
+	/* the rate is measured in the percentages the user works in */
+	if (ctx->val_mode == LIGHT_PERCENT_EXPONENTIAL)
+		ctx->rate_mode = LIGHT_PERCENT_EXPONENTIAL;
+
 	if (value &&
 	    (ctx->value = value_from_string(ctx->val_mode, value)) < 0) {
 		vlog_err("value not recognizable");
 		return info_help();
 	}
 
-	if (ctrl && (!path_component(ctrl) || !(ctx->ctrl = strdup(ctrl)))) {
-		vlog_err("can't handle controller: '%s'", ctrl);
+	if ((ctx->step = value_from_string(ctx->val_mode, step)) < 0) {
+		vlog_err("step not recognizable");
+		return info_help();
+	}
+
+	if (ctx->follow && !path_component(ctx->follow)) {
+		vlog_err("can't handle controller: '%s'", ctx->follow);
+		return info_help();
+	}
+
+	if (ctx->scene && (!path_component(ctx->scene) || ctx->scene[0] == '.')) {
+		vlog_err("can't handle scene: '%s'", ctx->scene);
 		return info_help();
 	}
 
+	/* a single plain name selects that controller directly,
+	 * patterns select every controller that matches */
+	if (ctx->ctrl_globs_len == 1 && !strpbrk(ctx->ctrl_globs[0], "*?[")) {
+		if (!(ctx->ctrl = strdup(ctx->ctrl_globs[0]))) {
+			vlog_err("strdup: %m");
+			return info_help();
+		}
+	} else if (ctx->ctrl_globs_len > 0) {
+		ctx->ctrl_mode = LIGHT_CTRL_ALL;
+	}
+
 	return true;
 }
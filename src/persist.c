@@ -0,0 +1,333 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "ctrl.h"
+#include "light.h"
+#include "backend.h"
+#include "init.h"
+#include "file.h"
+#include "meta.h"
+#include "metrics.h"
+#include "persist.h"
+
+/*
+ * The persist operation saves the brightness of the selected controllers
+ * whenever it changes, as -O does, including changes that firmware makes
+ * by itself, such as keyboard backlight hotkeys. It sleeps on the change
+ * notifications of the backend (brightness_hw_changed of LEDs,
+ * actual_brightness of backlights) and wakes up for nothing else, except
+ * to save: a change is saved once the brightness stayed put for
+ * PERSIST_QUIET_MSEC, or PERSIST_MAX_MSEC after it started moving, so that
+ * a burst of changes is stored once. A change that is still waiting is
+ * saved on SIGTERM and SIGINT as well. A controller without notifications
+ * is read every PERSIST_POLL_MSEC instead.
+ */
+
+#define PERSIST_QUIET_MSEC 1000
+#define PERSIST_MAX_MSEC 5000
+#define PERSIST_POLL_MSEC 2000
+
+struct persist_ctrl {
+	struct light_conf *conf;
+	int64_t max;
+	/* raw value last saved, or -1 */
+	int64_t saved;
+	bool pending;
+	/* raw value last read of a controller without notifications */
+	int64_t seen;
+	bool polled;
+	/* when the change started, and when it was last seen */
+	int64_t first;
+	int64_t last;
+};
+
+static volatile sig_atomic_t persist_stop;
+
+/**
+ * persist_now:
+ *
+ * Returns: monotonic time in milliseconds
+ **/
+static int64_t persist_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void persist_signal(int sig)
+{
+	(void) sig;
+	persist_stop = 1;
+}
+
+/**
+ * persist_grow:
+ * @pcs:	controllers to make room in
+ * @fds:	their notification fds
+ * @num:	number of controllers in use
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool persist_grow(struct persist_ctrl **pcs, struct pollfd **fds, size_t num)
+{
+	struct persist_ctrl *p;
+	struct pollfd *f;
+
+	if (!(p = realloc(*pcs, (num + 1) * sizeof(*p)))) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	*pcs = p;
+
+	if (!(f = realloc(*fds, (num + 1) * sizeof(*f)))) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	*fds = f;
+	return true;
+}
+
+/**
+ * persist_add:
+ * @pc:		controller to set up
+ * @pfd:	poll entry to set up
+ * @conf:	configuration object of the invocation
+ * @ctrl:	name of the controller
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool persist_add(struct persist_ctrl *pc, struct pollfd *pfd,
+		struct light_conf *conf, const char *ctrl)
+{
+	struct light_conf *c;
+
+	memset(pc, 0, sizeof(*pc));
+	pfd->fd = -1;
+
+	if (!(c = pc->conf = init_ctrl_conf(conf, conf->target, LIGHT_SAVE, ctrl)))
+		return false;
+
+	if ((pc->max = c->backend->read(c, ctrl, LIGHT_MAX_BRIGHTNESS)) <= 0) {
+		vlog_warning("found inaccessible controller '%s'", ctrl);
+		return false;
+	}
+
+	pc->saved = meta_read(c, LIGHT_SAVERESTORE);
+
+	/* saved right away if it changed since it was last saved */
+	pc->pending = true;
+	pc->first = pc->last = persist_now() - PERSIST_MAX_MSEC;
+
+	pfd->fd = c->backend->notify(c, ctrl);
+	pfd->events = POLLPRI;
+
+	/* reading the attribute arms the notification */
+	if (pfd->fd >= 0) {
+		file_read_fd(pfd->fd);
+	} else {
+		vlog_warning("'%s' reports no changes, reading it every %d ms",
+				ctrl, PERSIST_POLL_MSEC);
+		pc->polled = true;
+		pc->seen = c->backend->read(c, ctrl, LIGHT_BRIGHTNESS);
+	}
+
+	vlog_notice("persisting '%s'", ctrl);
+	return true;
+}
+
+/**
+ * persist_save:
+ * @pc:		controller to save the brightness of
+ **/
+static void persist_save(struct persist_ctrl *pc)
+{
+	struct light_conf *c = pc->conf;
+	int64_t raw = c->backend->read(c, c->ctrl, LIGHT_BRIGHTNESS);
+
+	pc->pending = false;
+
+	if (raw < 0) {
+		vlog_warning("can not read '%s'", c->ctrl);
+		return;
+	}
+
+	if (raw == pc->saved)
+		return;
+
+	if (meta_set(c, LIGHT_SAVERESTORE, raw, pc->max)) {
+		vlog_info("saved %" PRId64 " for '%s'", raw, c->ctrl);
+		pc->saved = raw;
+	}
+}
+
+/**
+ * persist_seen:
+ * @pc:		controller to note a change of
+ * @now:	monotonic time in milliseconds
+ **/
+static void persist_seen(struct persist_ctrl *pc, int64_t now)
+{
+	if (!pc->pending)
+		pc->first = now;
+
+	pc->pending = true;
+	pc->last = now;
+}
+
+/**
+ * persist_due:
+ * @pc:		controller with a change waiting
+ * @now:	monotonic time in milliseconds
+ *
+ * Returns: milliseconds until the change is saved, 0 if it is due
+ **/
+static int64_t persist_due(const struct persist_ctrl *pc, int64_t now)
+{
+	int64_t quiet = pc->last + PERSIST_QUIET_MSEC - now;
+	int64_t max = pc->first + PERSIST_MAX_MSEC - now;
+	int64_t due = quiet < max ? quiet : max;
+
+	return due > 0 ? due : 0;
+}
+
+/**
+ * persist_loop:
+ * @pcs:	controllers to persist
+ * @fds:	their notification fds
+ * @num:	number of controllers
+ *
+ * Returns: true once stopped by a signal, false on failure
+ **/
+static bool persist_loop(struct persist_ctrl *pcs, struct pollfd *fds, size_t num)
+{
+	int64_t now, due;
+	int timeout, mt;
+
+	while (!persist_stop) {
+		now = persist_now();
+		timeout = -1;
+
+		for (size_t i = 0; i < num; i++) {
+			if (!pcs[i].pending)
+				continue;
+			if ((due = persist_due(&pcs[i], now)) == 0)
+				persist_save(&pcs[i]);
+			else if (timeout < 0 || due < timeout)
+				timeout = (int) due;
+		}
+
+		metrics_tick();
+
+		if ((mt = metrics_timeout()) >= 0 && (timeout < 0 || mt < timeout))
+			timeout = mt;
+
+		for (size_t i = 0; i < num; i++)
+			if (pcs[i].polled && (timeout < 0 || timeout > PERSIST_POLL_MSEC))
+				timeout = PERSIST_POLL_MSEC;
+
+		if (poll(fds, num, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			vlog_err("poll: %m");
+			return false;
+		}
+
+		now = persist_now();
+
+		for (size_t i = 0; i < num; i++) {
+			struct persist_ctrl *pc = &pcs[i];
+			int64_t raw;
+
+			if (pc->polled) {
+				raw = pc->conf->backend->read(pc->conf, pc->conf->ctrl,
+						LIGHT_BRIGHTNESS);
+				if (raw >= 0 && raw != pc->seen)
+					persist_seen(pc, now);
+				pc->seen = raw;
+				continue;
+			}
+
+			if (!(fds[i].revents & (POLLPRI | POLLERR)))
+				continue;
+
+			file_read_fd(fds[i].fd);
+			persist_seen(pc, now);
+		}
+	}
+
+	for (size_t i = 0; i < num; i++)
+		if (pcs[i].pending)
+			persist_save(&pcs[i]);
+
+	return true;
+}
+
+/**
+ * persist_run:
+ * @conf:	configuration object holding the selection
+ *
+ * Saves the brightness of the selected controllers whenever it changes.
+ *
+ * Returns: true once stopped by a signal, false on failure
+ **/
+bool persist_run(struct light_conf *conf)
+{
+	burn_o struct persist_ctrl *pcs = NULL;
+	burn_o struct pollfd *fds = NULL;
+	struct sigaction sa;
+	size_t num = 0;
+	bool ret;
+
+	if (conf->ctrl_mode == LIGHT_CTRL_ALL) {
+		burn_iter iter = ctrl_iter_new(conf);
+		char *c;
+
+		while (iter && persist_grow(&pcs, &fds, num) &&
+		       (c = ctrl_iter_next(iter))) {
+			if (persist_add(&pcs[num], &fds[num], conf, c))
+				num++;
+			else
+				light_free(&pcs[num].conf);
+			free(c);
+		}
+	} else if (persist_grow(&pcs, &fds, num)) {
+		if (persist_add(&pcs[num], &fds[num], conf, conf->ctrl))
+			num++;
+		else
+			light_free(&pcs[num].conf);
+	}
+
+	if (num == 0) {
+		vlog_err("no controller to persist");
+		return false;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = persist_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	ret = persist_loop(pcs, fds, num);
+
+	for (size_t i = 0; i < num; i++) {
+		if (fds[i].fd >= 0)
+			close(fds[i].fd);
+		light_free(&pcs[i].conf);
+	}
+
+	return ret;
+}
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdbool.h>
+
+#include "light.h"
+
+bool persist_run(struct light_conf *conf);
+
+#endif /* PERSIST_H */
@@ -0,0 +1,643 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "ctrl.h"
+#include "light.h"
+#include "value.h"
+#include "backend.h"
+#include "init.h"
+#include "file.h"
+#include "exec.h"
+#include "metrics.h"
+#include "policy.h"
+
+/*
+ * The policy operation caps the brightness while the system runs hot or
+ * on a low battery. It reads the hottest thermal zone and the capacity of
+ * the discharging batteries, from <root>/thermal/thermal_zone<n>/temp and
+ * <root>/power_supply/<supply>/capacity, where the root is /sys/class
+ * unless the backend moves it. Every controller maps both through its
+ * policy, kept in <cache>/<target>.<ctrl>.policy:
+ *
+ *	temp <degrees celsius> <percent>
+ *	battery <capacity percent> <percent>
+ *	...
+ *
+ * The points of either kind are in increasing order, joined by straight
+ * lines, and replace the defaults of that kind. The lower of both caps is
+ * stored as a raw value in <cache>/<target>.<ctrl>.cap:
+ *
+ *	<raw cap> <expiry, wall clock milliseconds>
+ *
+ * which every change of the brightness is clamped to, along with the
+ * minimum cap. The controller fades down to a cap that drops, and back
+ * up to where it was once the cap rises, unless it was moved meanwhile.
+ */
+
+/* the sensors are read this often near or over a threshold */
+#define POLICY_FAST_MSEC 1000
+/* and up to this seldom otherwise, backing off while nothing changes */
+#define POLICY_SLOW_MSEC 30000
+/* degrees below the first temperature point that count as near */
+#define POLICY_NEAR 5000
+/* a stored cap outlives a policy that is no longer running this long */
+#define POLICY_TTL_MSEC (4 * POLICY_SLOW_MSEC)
+#define POLICY_FADE_USEC 2000000
+#define POLICY_POINTS_MAX 16
+#define POLICY_UEVENT_BUF 4096
+
+struct policy_curve {
+	/* temperatures in millidegrees or capacities in percent,
+	 * and caps out of VALUE_PCT_MAX */
+	int64_t points[POLICY_POINTS_MAX][2];
+	size_t num;
+};
+
+static const struct policy_curve policy_temp = {
+	{ { 60000, VALUE_PCT_MAX }, { 85000, 40 * VALUE_PCT_MAX / 100 } }, 2
+};
+
+static const struct policy_curve policy_battery = {
+	{ { 5, 40 * VALUE_PCT_MAX / 100 }, { 20, VALUE_PCT_MAX } }, 2
+};
+
+struct policy_ctrl {
+	struct light_conf *conf;
+	int64_t max;
+	int64_t mincap;
+	struct policy_curve temp;
+	struct policy_curve battery;
+	/* raw cap in force, and when its file expires */
+	int64_t cap;
+	int64_t expiry;
+	/* raw value to return to once the cap rises, or -1 */
+	int64_t want;
+	/* raw value last read or written, or -1 */
+	int64_t last;
+};
+
+struct policy {
+	struct light_conf *conf;
+	const char *root;
+	struct policy_ctrl *ctrls;
+	size_t num;
+	/* hottest zone in millidegrees, INT64_MIN without any */
+	int64_t temp;
+	/* lowest discharging battery in percent, or -1 */
+	int64_t capacity;
+};
+
+/**
+ * policy_now:
+ *
+ * Returns: wall clock time in milliseconds
+ **/
+static int64_t policy_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * policy_cap:
+ * @conf:	configuration object holding the controller
+ * @max:	raw maximum of the controller
+ *
+ * Returns: raw cap stored by a running policy, or max without one
+ **/
+int64_t policy_cap(struct light_conf *conf, int64_t max)
+{
+	int64_t cap, until;
+	burn_o char *path = light_path_new(conf, LIGHT_CAP);
+	burn_file file = path ? fopen(path, "r") : NULL;
+
+	if (!file)
+		return max;
+
+	if (fscanf(file, "%" SCNd64 " %" SCNd64, &cap, &until) != 2 ||
+	    until <= policy_now() || cap < 0 || cap > max)
+		cap = max;
+
+	/* cppcheck-suppress resourceLeak */
+	return cap;
+}
+
+/**
+ * policy_store:
+ * @pc:		controller to store the cap of
+ * @cap:	raw cap, or the maximum to lift it
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool policy_store(struct policy_ctrl *pc, int64_t cap)
+{
+	int64_t now = policy_now();
+	burn_o char *path = light_path_new(pc->conf, LIGHT_CAP);
+	burn_o char *tmp = path ? path_new() : NULL;
+	burn_file file = NULL;
+
+	if (!path || !tmp || !(tmp = path_append(tmp, "%s.tmp", path)))
+		return false;
+
+	pc->cap = cap;
+
+	if (cap >= pc->max) {
+		if (unlink(path) < 0 && errno != ENOENT)
+			vlog_warning("unlink '%s': %m", path);
+		pc->expiry = INT64_MAX;
+		/* cppcheck-suppress resourceLeak */
+		return true;
+	}
+
+	if (!(file = fopen(tmp, "w"))) {
+		vlog_err("open '%s': %m", tmp);
+		return false;
+	}
+
+	fprintf(file, "%" PRId64 " %" PRId64 "\n", cap, now + POLICY_TTL_MSEC);
+
+	if (fflush(file) != 0 || rename(tmp, path) != 0) {
+		vlog_err("save '%s': %m", path);
+		unlink(tmp);
+		/* cppcheck-suppress resourceLeak */
+		return false;
+	}
+
+	pc->expiry = now + POLICY_TTL_MSEC;
+	/* cppcheck-suppress resourceLeak */
+	return true;
+}
+
+/**
+ * policy_map:
+ * @c:		curve to map through
+ * @in:		temperature or capacity
+ *
+ * Returns: cap out of VALUE_PCT_MAX
+ **/
+static int64_t policy_map(const struct policy_curve *c, int64_t in)
+{
+	const int64_t (*p)[2] = c->points;
+	size_t n = c->num, i = 0;
+
+	if (n == 0)
+		return VALUE_PCT_MAX;
+
+	while (i < n && in > p[i][0])
+		i++;
+
+	if (i == 0)
+		return p[0][1];
+	if (i == n)
+		return p[n - 1][1];
+
+	return p[i - 1][1] + (p[i][1] - p[i - 1][1]) *
+		(in - p[i - 1][0]) / (p[i][0] - p[i - 1][0]);
+}
+
+/**
+ * policy_load:
+ * @pc:		controller to load the policy of
+ *
+ * Returns: true on success or if there is no policy, false on failure
+ **/
+static bool policy_load(struct policy_ctrl *pc)
+{
+	char line[128], kind[16];
+	double in, out;
+	struct policy_curve *c;
+	burn_o char *path = light_path_new(pc->conf, LIGHT_CAP_POLICY);
+	burn_file file = path ? fopen(path, "r") : NULL;
+
+	pc->temp = policy_temp;
+	pc->battery = policy_battery;
+
+	if (!file)
+		return path != NULL;
+
+	pc->temp.num = 0;
+	pc->battery.num = 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+			continue;
+
+		if (sscanf(line, "%15s %lf %lf", kind, &in, &out) != 3 ||
+		    out < 0 || out > 100)
+			break;
+
+		if (strcmp(kind, "temp") == 0) {
+			c = &pc->temp;
+			in *= 1000;
+		} else if (strcmp(kind, "battery") == 0) {
+			c = &pc->battery;
+		} else {
+			break;
+		}
+
+		if (c->num >= POLICY_POINTS_MAX ||
+		    (c->num > 0 && (int64_t) in <= c->points[c->num - 1][0]))
+			break;
+
+		c->points[c->num][0] = (int64_t) in;
+		c->points[c->num][1] = (int64_t) (out * (VALUE_PCT_MAX / 100));
+		c->num++;
+	}
+
+	if (!feof(file)) {
+		line[strcspn(line, "\n")] = '\0';
+		vlog_err("'%s' is not a policy: '%s'", path, line);
+		/* cppcheck-suppress resourceLeak */
+		return false;
+	}
+
+	/* a kind without points keeps its defaults */
+	if (pc->temp.num == 0)
+		pc->temp = policy_temp;
+	if (pc->battery.num == 0)
+		pc->battery = policy_battery;
+
+	/* cppcheck-suppress resourceLeak */
+	return true;
+}
+
+/**
+ * policy_string:
+ * @path:	attribute to read
+ * @buf:	buffer to read the first line into
+ * @len:	size of the buffer
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool policy_string(const char *path, char *buf, size_t len)
+{
+	burn_file file = fopen(path, "r");
+
+	if (!file || !fgets(buf, (int) len, file))
+		return false;
+
+	buf[strcspn(buf, "\n")] = '\0';
+	/* cppcheck-suppress resourceLeak */
+	return true;
+}
+
+/**
+ * policy_sense:
+ * @p:		policy state to store the readings in
+ *
+ * Reads the hottest thermal zone and the lowest discharging battery.
+ **/
+static void policy_sense(struct policy *p)
+{
+	char path[PATH_MAX], buf[32];
+	struct dirent *ent;
+	burn_dir thermal = NULL;
+	burn_dir supply = NULL;
+	int64_t val;
+
+	p->temp = INT64_MIN;
+	p->capacity = -1;
+
+	snprintf(path, sizeof(path), "%s/thermal", p->root);
+
+	while ((thermal || (thermal = opendir(path))) && (ent = readdir(thermal))) {
+		if (strncmp(ent->d_name, "thermal_zone", 12) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/thermal/%s/temp", p->root, ent->d_name);
+		/* zones below freezing read as errors, and cap nothing */
+		if ((val = file_read(path)) >= 0 && val > p->temp)
+			p->temp = val;
+	}
+
+	snprintf(path, sizeof(path), "%s/power_supply", p->root);
+
+	if (!(supply = opendir(path)))
+		return;
+
+	while ((ent = readdir(supply))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/power_supply/%s/type", p->root, ent->d_name);
+		if (!policy_string(path, buf, sizeof(buf)) || strcmp(buf, "Battery") != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/power_supply/%s/status", p->root, ent->d_name);
+		if (!policy_string(path, buf, sizeof(buf)) || strcmp(buf, "Discharging") != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/power_supply/%s/capacity", p->root, ent->d_name);
+		if ((val = file_read(path)) >= 0 && (p->capacity < 0 || val < p->capacity))
+			p->capacity = val;
+	}
+}
+
+/**
+ * policy_conf:
+ * @conf:	configuration object of the invocation
+ * @ctrl:	name of the controller
+ *
+ * Returns: initialized configuration object, or NULL on failure
+ **/
+static struct light_conf *policy_conf(struct light_conf *conf, const char *ctrl)
+{
+	struct light_conf *c = init_ctrl_conf(conf, conf->target, LIGHT_SET, ctrl);
+
+	if (!c)
+		return NULL;
+
+	c->val_mode = LIGHT_RAW;
+	/* caps are reached smoothly, unless told otherwise */
+	c->usec = conf->usec || conf->rate ? conf->usec : POLICY_FADE_USEC;
+
+	return c;
+}
+
+/**
+ * policy_add:
+ * @p:		policy state
+ * @ctrl:	name of the controller to add
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool policy_add(struct policy *p, const char *ctrl)
+{
+	struct policy_ctrl *pc, *ctrls;
+
+	if (!(ctrls = realloc(p->ctrls, (p->num + 1) * sizeof(*ctrls)))) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	p->ctrls = ctrls;
+	pc = memset(&ctrls[p->num], 0, sizeof(*pc));
+	pc->want = -1;
+	pc->last = -1;
+
+	if (!(pc->conf = policy_conf(p->conf, ctrl)))
+		return false;
+
+	p->num++;
+
+	if ((pc->max = exec_get_max(pc->conf)) <= 0 ||
+	    (pc->mincap = exec_get_min(pc->conf)) < 0 || !policy_load(pc))
+		return false;
+
+	/* a cap left behind is lifted or renewed on the first pass */
+	pc->cap = policy_cap(pc->conf, pc->max);
+	pc->expiry = 0;
+
+	vlog_notice("capping '%s'", ctrl);
+	return true;
+}
+
+/**
+ * policy_set:
+ * @pc:		controller to adjust
+ * @raw:	raw value to fade to
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool policy_set(struct policy_ctrl *pc, int64_t raw)
+{
+	struct light_conf *c = pc->conf;
+
+	c->value = raw;
+
+	if (!exec_op(c))
+		return false;
+
+	pc->last = c->backend->read(c, c->ctrl, LIGHT_BRIGHTNESS);
+	return true;
+}
+
+/**
+ * policy_apply:
+ * @p:		policy state holding the readings
+ * @pc:		controller to cap
+ *
+ * Returns: true if the cap of the controller changed, otherwise false
+ **/
+static bool policy_apply(struct policy *p, struct policy_ctrl *pc)
+{
+	struct light_conf *c = pc->conf;
+	int64_t pct = VALUE_PCT_MAX, cap, cur;
+	bool changed;
+
+	if (p->temp != INT64_MIN)
+		pct = policy_map(&pc->temp, p->temp);
+	if (p->capacity >= 0 && policy_map(&pc->battery, p->capacity) < pct)
+		pct = policy_map(&pc->battery, p->capacity);
+
+	cap = value_clamp(value_to_raw(LIGHT_PERCENT, pct, pc->max), pc->mincap, pc->max);
+	changed = cap != pc->cap;
+
+	/* renewed well before it expires */
+	if ((changed || policy_now() > pc->expiry - POLICY_TTL_MSEC / 2) &&
+	    !policy_store(pc, cap))
+		return changed;
+
+	if (changed)
+		vlog_notice("cap of '%s' is %" PRId64 " (%.2f%%)", c->ctrl, cap, pct / 100.0);
+
+	if ((cur = c->backend->read(c, c->ctrl, LIGHT_BRIGHTNESS)) < 0)
+		return changed;
+
+	/* moved by someone else, where it stays */
+	if (pc->last >= 0 && cur != pc->last)
+		pc->want = -1;
+
+	pc->last = cur;
+
+	if (cur > cap) {
+		if (pc->want < 0)
+			pc->want = cur;
+		policy_set(pc, cap);
+	} else if (pc->want >= 0 && cur < cap) {
+		policy_set(pc, pc->want < cap ? pc->want : cap);
+		if (pc->want <= cap)
+			pc->want = -1;
+	}
+
+	return changed;
+}
+
+/**
+ * policy_near:
+ * @p:		policy state holding the readings
+ *
+ * Returns: true if a temperature cap is close, or in force
+ **/
+static bool policy_near(const struct policy *p)
+{
+	if (p->temp == INT64_MIN)
+		return false;
+
+	for (size_t i = 0; i < p->num; i++)
+		if (p->ctrls[i].temp.num > 0 &&
+		    p->temp >= p->ctrls[i].temp.points[0][0] - POLICY_NEAR)
+			return true;
+
+	return false;
+}
+
+/**
+ * policy_uevent:
+ * @p:		policy state
+ *
+ * Listens to the kernel for changes of power supplies and thermal zones,
+ * which only reach the real sysfs tree.
+ *
+ * Returns: netlink socket, or -1 if only polling is possible
+ **/
+static int policy_uevent(const struct policy *p)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	if (p->conf->sys_root)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+
+	if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+					NETLINK_KOBJECT_UEVENT)) < 0) {
+		vlog_info("socket: %m");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		vlog_info("bind: %m");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * policy_drain:
+ * @fd:		netlink socket
+ *
+ * Returns: true if a power supply or thermal zone changed
+ **/
+static bool policy_drain(int fd)
+{
+	char buf[POLICY_UEVENT_BUF];
+	bool relevant = false;
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		/* the fields are separated by terminators */
+		for (char *f = buf; f < buf + len; f += strlen(f) + 1)
+			if (strcmp(f, "SUBSYSTEM=power_supply") == 0 ||
+			    strcmp(f, "SUBSYSTEM=thermal") == 0)
+				relevant = true;
+	}
+
+	return relevant;
+}
+
+/**
+ * policy_loop:
+ * @p:		policy state
+ *
+ * Returns: false on failure, does not return otherwise
+ **/
+static bool policy_loop(struct policy *p)
+{
+	struct pollfd pfd = { .fd = policy_uevent(p), .events = POLLIN };
+	int interval = POLICY_FAST_MSEC, timeout, mt;
+	bool changed;
+
+	for (;;) {
+		policy_sense(p);
+		changed = false;
+
+		for (size_t i = 0; i < p->num; i++)
+			changed |= policy_apply(p, &p->ctrls[i]);
+
+		/* back off while nothing is near to change */
+		if (changed || policy_near(p))
+			interval = POLICY_FAST_MSEC;
+		else if ((interval *= 2) > POLICY_SLOW_MSEC)
+			interval = POLICY_SLOW_MSEC;
+
+		metrics_tick();
+
+		timeout = interval;
+		if ((mt = metrics_timeout()) >= 0 && mt < timeout)
+			timeout = mt;
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			vlog_err("poll: %m");
+			break;
+		}
+
+		if ((pfd.revents & POLLIN) && policy_drain(pfd.fd))
+			interval = POLICY_FAST_MSEC;
+	}
+
+	if (pfd.fd >= 0)
+		close(pfd.fd);
+
+	return false;
+}
+
+/**
+ * policy_run:
+ * @conf:	configuration object holding the selection
+ *
+ * Caps the selected controllers by temperature and battery.
+ *
+ * Returns: false on failure, does not return otherwise
+ **/
+bool policy_run(struct light_conf *conf)
+{
+	bool ret;
+	struct policy p = {
+		.conf = conf,
+		.root = conf->sys_root ? conf->sys_root : "/sys/class",
+	};
+
+	if (conf->ctrl_mode == LIGHT_CTRL_ALL) {
+		burn_iter iter = ctrl_iter_new(conf);
+		char *c;
+
+		ret = iter != NULL;
+		while (ret && (c = ctrl_iter_next(iter))) {
+			ret = policy_add(&p, c);
+			free(c);
+		}
+	} else {
+		ret = policy_add(&p, conf->ctrl);
+	}
+
+	if (ret)
+		ret = policy_loop(&p);
+
+	for (size_t i = 0; i < p.num; i++)
+		light_free(&p.ctrls[i].conf);
+
+	free(p.ctrls);
+	return ret;
+}
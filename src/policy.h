@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "light.h"
+
+int64_t policy_cap(struct light_conf *conf, int64_t max);
+bool policy_run(struct light_conf *conf);
+
+#endif /* POLICY_H */
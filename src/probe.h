@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: 0BSD */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+/*
+ * Static tracepoints of the brillo provider, for bpftrace and perf probe.
+ * A probe compiles to a single nop plus an ELF note describing where its
+ * arguments are, which should be values at hand rather than anything
+ * computed for the probe alone. The probes are left out
+ * when sys/sdt.h (from systemtap) is missing, or when building with
+ * PROBE_DISABLE defined.
+ */
+
+#if !defined(PROBE_DISABLE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE_ENABLED 1
+#endif
+#endif
+
+#ifdef PROBE_ENABLED
+#define PROBE1(name, a) DTRACE_PROBE1(brillo, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(brillo, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(brillo, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(brillo, name, a, b, c, d)
+#else
+#define PROBE1(name, a) ((void) (a))
+#define PROBE2(name, a, b) ((void) (a), (void) (b))
+#define PROBE3(name, a, b, c) ((void) (a), (void) (b), (void) (c))
+#define PROBE4(name, a, b, c, d) ((void) (a), (void) (b), (void) (c), (void) (d))
+#endif
+
+#endif /* PROBE_H */
@@ -0,0 +1,331 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "ctrl.h"
+#include "value.h"
+#include "light.h"
+#include "shm.h"
+#include "pub.h"
+#include "metrics.h"
+
+#define PUB_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+/* spins before assuming the other writer died mid-update */
+#define PUB_SPIN_MAX (1 << 20)
+
+/**
+ * pub_path_new:
+ * @conf:	configuration object holding the sysfs prefix
+ *
+ * WARNING: this function allocates memory, but does not free it.
+ *          free the data pointed to by the return value after use.
+ *
+ * Returns: path of the shared memory page for the target, or NULL on failure
+ **/
+static char *pub_path_new(struct light_conf *conf)
+{
+	char *p;
+	const char *tgt = strrchr(conf->sys_prefix, '/');
+
+	if (!tgt || !(p = path_new()))
+		return NULL;
+
+	return path_append(p, "/dev/shm/" PROG ".%s", tgt + 1);
+}
+
+/**
+ * pub_open:
+ * @conf:	configuration object holding the sysfs prefix
+ * @create:	whether to create the page if it does not exist
+ * @page:	where to store the mapped page
+ *
+ * Opens, locks and maps the shared memory page of the target.
+ * The page stays mapped after the returned fd is closed.
+ *
+ * Returns: locked fd of the page, or -1 on failure
+ **/
+static int pub_open(struct light_conf *conf, bool create, struct shm_page **page)
+{
+	int fd;
+	struct stat st;
+	struct shm_page *p;
+	burn_o char *path = pub_path_new(conf);
+
+	if (!path)
+		return -1;
+
+	if ((fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, PUB_MODE)) < 0) {
+		/* publishing is off unless the page exists */
+		if (create || errno != ENOENT)
+			vlog_err("open '%s': %m", path);
+		return -1;
+	}
+
+	if (lockf(fd, F_LOCK, 0) < 0 || fstat(fd, &st) < 0) {
+		vlog_err("'%s': %m", path);
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size < (off_t) sizeof(*p) && ftruncate(fd, sizeof(*p)) < 0) {
+		vlog_err("ftruncate '%s': %m", path);
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, sizeof(*p), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (p == MAP_FAILED) {
+		vlog_err("mmap '%s': %m", path);
+		close(fd);
+		return -1;
+	}
+
+	if (p->magic == 0) {
+		p->version = SHM_VERSION;
+		__atomic_store_n(&p->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	if (p->magic != SHM_MAGIC || p->version != SHM_VERSION) {
+		vlog_err("'%s' has an unknown layout", path);
+		munmap(p, sizeof(*p));
+		close(fd);
+		return -1;
+	}
+
+	*page = p;
+	return fd;
+}
+
+/**
+ * pub_slot:
+ * @page:	page locked by pub_open()
+ * @name:	name of the controller
+ *
+ * Looks up the entry of a controller, appending it if needed.
+ *
+ * Returns: the entry, or NULL if it does not fit
+ **/
+static struct shm_ctrl *pub_slot(struct shm_page *page, const char *name)
+{
+	uint32_t n = page->num_ctrls;
+
+	for (uint32_t i = 0; i < n && i < SHM_CTRLS; i++)
+		if (strncmp(page->ctrls[i].name, name, SHM_NAME_MAX) == 0)
+			return &page->ctrls[i];
+
+	if (n >= SHM_CTRLS || strlen(name) >= SHM_NAME_MAX) {
+		vlog_warning("can not publish '%s'", name);
+		return NULL;
+	}
+
+	strcpy(page->ctrls[n].name, name);
+	__atomic_store_n(&page->num_ctrls, n + 1, __ATOMIC_RELEASE);
+
+	return &page->ctrls[n];
+}
+
+/**
+ * pub_attach:
+ * @pub:	publisher to initialize
+ * @conf:	configuration object of the controller
+ * @max:	raw maximum of the controller
+ *
+ * Returns: true if the value of the controller should be published
+ **/
+bool pub_attach(struct pub *pub, struct light_conf *conf, int64_t max)
+{
+	burn_fd fd = pub_open(conf, false, &pub->page);
+
+	if (fd < 0)
+		return false;
+
+	if (!(pub->ctrl = pub_slot(pub->page, conf->ctrl))) {
+		munmap(pub->page, sizeof(*pub->page));
+		return false;
+	}
+
+	pub->max = max;
+	return true;
+}
+
+/**
+ * pub_step:
+ * @data:	publisher from pub_attach()
+ * @raw:	raw value that was just written
+ *
+ * Publishes a value under the seqlock of the controller entry.
+ **/
+void pub_step(void *data, int64_t raw)
+{
+	struct pub *pub = data;
+	struct shm_ctrl *c = pub->ctrl;
+	uint32_t s, next;
+
+	/* writers of the same entry (a fade and the watcher) take turns,
+	 * an entry left odd by a writer that died is taken over */
+	for (int i = 0; ; i++) {
+		s = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+		if ((s & 1) && i < PUB_SPIN_MAX)
+			continue;
+		next = (s & 1) ? s + 2 : s + 1;
+		if (__atomic_compare_exchange_n(&c->seq, &s, next, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&c->raw, raw, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->max, pub->max, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->pct, value_from_raw(LIGHT_PERCENT, raw, pub->max),
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&c->changes, c->changes + 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&c->seq, next + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * pub_detach:
+ * @pub:	publisher from pub_attach()
+ **/
+void pub_detach(struct pub *pub)
+{
+	munmap(pub->page, sizeof(*pub->page));
+}
+
+/**
+ * pub_watch_read:
+ * @fd:		fd of the attribute to read
+ *
+ * Reads an attribute from the start, which also rearms poll().
+ *
+ * Returns: value, or a negative value on failure
+ **/
+static int64_t pub_watch_read(int fd)
+{
+	char buf[32];
+	ssize_t r = pread(fd, buf, sizeof(buf) - 1, 0);
+
+	if (r <= 0)
+		return -1;
+
+	buf[r] = '\0';
+	return strtoll(buf, NULL, 10);
+}
+
+/**
+ * pub_watch_add:
+ * @conf:	configuration object of the target
+ * @page:	page locked by pub_open()
+ * @name:	name of the controller
+ * @pfd:	poll entry to initialize
+ * @pub:	publisher to initialize
+ *
+ * Publishes the current value of a controller and opens the
+ * fd through which the backend notifies about changes.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool pub_watch_add(struct light_conf *conf, struct shm_page *page,
+		const char *name, struct pollfd *pfd, struct pub *pub)
+{
+	int64_t raw;
+
+	if ((pub->max = conf->backend->read(conf, name, LIGHT_MAX_BRIGHTNESS)) <= 0 ||
+	    (raw = conf->backend->read(conf, name, LIGHT_BRIGHTNESS)) < 0) {
+		vlog_warning("found inaccessible controller '%s'", name);
+		return false;
+	}
+
+	if (!(pub->ctrl = pub_slot(page, name)))
+		return false;
+
+	pub->page = page;
+	pub_step(pub, raw);
+
+	/* without a notification fd, only our own writes are published */
+	pfd->fd = conf->backend->notify(conf, name);
+	pfd->events = POLLPRI;
+
+	if (pfd->fd >= 0)
+		pub_watch_read(pfd->fd);
+
+	return true;
+}
+
+/**
+ * pub_watch:
+ * @conf:	configuration object to operate on
+ *
+ * Creates the shared memory page of the target, publishes the
+ * selected controllers and keeps them up to date with the
+ * change notifications of the backend.
+ *
+ * Returns: false on failure, does not return otherwise
+ **/
+bool pub_watch(struct light_conf *conf)
+{
+	size_t n = 0;
+	struct shm_page *page;
+	struct pollfd fds[SHM_CTRLS];
+	struct pub pubs[SHM_CTRLS];
+	int fd = pub_open(conf, true, &page);
+
+	if (fd < 0)
+		return false;
+
+	if (conf->ctrl_mode == LIGHT_CTRL_ALL) {
+		burn_iter iter = ctrl_iter_new(conf);
+		char *c;
+
+		while (iter && n < SHM_CTRLS && (c = ctrl_iter_next(iter))) {
+			if (pub_watch_add(conf, page, c, &fds[n], &pubs[n]))
+				n++;
+			free(c);
+		}
+	} else if (pub_watch_add(conf, page, conf->ctrl, &fds[n], &pubs[n])) {
+		n++;
+	}
+
+	close(fd);
+
+	if (n == 0) {
+		vlog_err("no controller to publish");
+		return false;
+	}
+
+	vlog_notice("publishing %zu controller(s)", n);
+
+	for (;;) {
+		metrics_tick();
+
+		if (poll(fds, n, metrics_timeout()) < 0) {
+			if (errno == EINTR)
+				continue;
+			vlog_err("poll: %m");
+			return false;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			int64_t raw;
+
+			if (!(fds[i].revents & (POLLPRI | POLLERR)))
+				continue;
+			if ((raw = pub_watch_read(fds[i].fd)) >= 0)
+				pub_step(&pubs[i], raw);
+		}
+	}
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef PUB_H
+#define PUB_H
+
+#include <stdbool.h>
+
+#include "light.h"
+#include "shm.h"
+
+struct pub {
+	struct shm_page *page;
+	struct shm_ctrl *ctrl;
+	int64_t max;
+};
+
+bool pub_attach(struct pub *pub, struct light_conf *conf, int64_t max);
+void pub_step(void *pub, int64_t raw);
+void pub_detach(struct pub *pub);
+bool pub_watch(struct light_conf *conf);
+
+#endif /* PUB_H */
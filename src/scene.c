@@ -0,0 +1,439 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "path.h"
+#include "file.h"
+#include "ctrl.h"
+#include "value.h"
+#include "light.h"
+#include "backend.h"
+#include "init.h"
+#include "exec.h"
+#include "pub.h"
+#include "scene.h"
+#include "hist.h"
+#include "arb.h"
+
+/*
+ * A scene is a text file in the cache directory, with one line per
+ * controller:
+ *
+ *	<target> <controller> <value> <mode>
+ *
+ * target is "backlight" or "leds", mode is "raw", "percent" or "exp".
+ * Empty lines and lines starting with '#' are ignored.
+ */
+
+struct scene_entry {
+	LIGHT_TARGET target;
+	LIGHT_VAL_MODE mode;
+	int64_t value;
+	char ctrl[NAME_MAX + 1];
+};
+
+struct scene_fade {
+	struct scene_entry *entry;
+	int64_t max;
+};
+
+static const char *scene_targets[] = {
+	[LIGHT_BACKLIGHT] = "backlight",
+	[LIGHT_KEYBOARD] = "leds",
+};
+
+static const char *scene_modes[] = {
+	[LIGHT_RAW] = "raw",
+	[LIGHT_PERCENT] = "percent",
+	[LIGHT_PERCENT_EXPONENTIAL] = "exp",
+};
+
+/**
+ * scene_lookup:
+ * @names:	table of names, indexed by enum value
+ * @len:	length of the table
+ * @str:	name to look up
+ *
+ * Returns: enum value of the name, or 0 if it is unknown
+ **/
+static int scene_lookup(const char **names, size_t len, const char *str)
+{
+	for (size_t i = 1; i < len; i++)
+		if (names[i] && strcmp(names[i], str) == 0)
+			return (int) i;
+	return 0;
+}
+
+#define SCENE_LOOKUP(names, str) \
+	scene_lookup(names, sizeof(names) / sizeof(*names), str)
+
+/**
+ * scene_path_new:
+ * @conf:	configuration object holding the cache prefix and scene name
+ * @suffix:	suffix to append to the path
+ *
+ * WARNING: this function allocates memory, but does not free it.
+ *          free the data pointed to by the return value after use.
+ *
+ * Returns: path of the scene file, or NULL on failure
+ **/
+static char *scene_path_new(struct light_conf *conf, const char *suffix)
+{
+	char *p;
+	const char *tgt = strrchr(conf->cache_prefix, '/');
+
+	if (!tgt || !(p = path_new()))
+		return NULL;
+
+	/* scenes span targets, so they live next to the target prefixes */
+	return path_append(p, "%.*s/%s.scene%s", (int) (tgt - conf->cache_prefix),
+			conf->cache_prefix, conf->scene, suffix);
+}
+
+/**
+ * scene_parse:
+ * @line:	line of a scene file
+ * @entry:	where to store the entry
+ *
+ * Returns: 1 if an entry was parsed, 0 for blank lines, -1 on failure
+ **/
+static int scene_parse(const char *line, struct scene_entry *entry)
+{
+	char tgt[16], val[32], mode[16];
+	int n;
+
+	if ((n = sscanf(line, "%15s %255s %31s %15s", tgt, entry->ctrl, val, mode)) < 1 ||
+	    tgt[0] == '#')
+		return 0;
+
+	if (n != 4 || !path_component(entry->ctrl) ||
+	    !(entry->target = SCENE_LOOKUP(scene_targets, tgt)) ||
+	    !(entry->mode = SCENE_LOOKUP(scene_modes, mode)) ||
+	    (entry->value = value_from_string(entry->mode, val)) < 0)
+		return -1;
+
+	return 1;
+}
+
+/**
+ * scene_load:
+ * @conf:	configuration object holding the scene name
+ * @entries:	where to store the allocated entries
+ *
+ * Returns: number of entries, or -1 on failure
+ **/
+static ssize_t scene_load(struct light_conf *conf, struct scene_entry **entries)
+{
+	char line[512];
+	ssize_t num = 0;
+	size_t lineno = 0;
+	burn_o char *path = scene_path_new(conf, "");
+	burn_file file = path ? fopen(path, "r") : NULL;
+
+	*entries = NULL;
+
+	if (!file) {
+		vlog_err("open scene '%s': %m", conf->scene);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		struct scene_entry *e = realloc(*entries, (num + 1) * sizeof(*e));
+		int r;
+
+		lineno++;
+
+		if (!e) {
+			vlog_err("realloc: %m");
+			return -1;
+		}
+
+		*entries = e;
+
+		if ((r = scene_parse(line, &e[num])) < 0) {
+			vlog_err("scene '%s' line %zu: malformed entry", conf->scene, lineno);
+			return -1;
+		}
+
+		num += r;
+	}
+
+	/* cppcheck-suppress resourceLeak */
+	return num;
+}
+
+/**
+ * scene_conf:
+ * @conf:	configuration object of the invocation
+ * @target:	target to create a configuration object for
+ *
+ * Returns: initialized configuration object, or NULL on failure
+ **/
+static struct light_conf *scene_conf(struct light_conf *conf, LIGHT_TARGET target)
+{
+	struct light_conf *c = light_conf_clone(conf);
+
+	if (!c)
+		return NULL;
+
+	c->target = target;
+	c->op_mode = LIGHT_SET;
+	c->ctrl_mode = LIGHT_CTRL_ALL;
+	c->field = LIGHT_BRIGHTNESS;
+
+	if (!init_strings(c)) {
+		light_free(&c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/**
+ * scene_apply:
+ * @conf:	configuration object holding the scene name
+ *
+ * Opens and locks every controller of the scene, then moves those
+ * that are not at their value yet in a single smooth adjustment.
+ * With a rate, the largest change sets the duration.
+ *
+ * Returns: true on success, false if any controller failed
+ **/
+bool scene_apply(struct light_conf *conf)
+{
+	bool ret = true;
+	size_t num_fades = 0;
+	int64_t usec = 0;
+	struct light_conf *confs[] = { NULL, NULL, NULL };
+	burn_o struct scene_entry *entries = NULL;
+	burn_o struct file_fade *fades = NULL;
+	burn_o struct file_hooks *hooks = NULL;
+	burn_o struct pub *pubs = NULL;
+	burn_o struct scene_fade *done = NULL;
+	ssize_t num = scene_load(conf, &entries);
+
+	if (num < 0)
+		return false;
+
+	if (!(fades = calloc(num + 1, sizeof(*fades))) ||
+	    !(hooks = calloc(num + 1, sizeof(*hooks))) ||
+	    !(pubs = calloc(num + 1, sizeof(*pubs))) ||
+	    !(done = calloc(num + 1, sizeof(*done)))) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	for (ssize_t i = 0; i < num; i++) {
+		struct scene_entry *e = &entries[i];
+		struct light_conf *c = confs[e->target];
+		struct file_fade *f = &fades[num_fades];
+		int64_t max;
+
+		if (!c && !(c = confs[e->target] = scene_conf(conf, e->target))) {
+			ret = false;
+			continue;
+		}
+
+		c->ctrl = e->ctrl;
+		c->value = e->value;
+		c->val_mode = e->mode;
+		c->cached_max = 0;
+
+		if (!arb_allow(c)) {
+			/* the name is owned by the entry */
+			c->ctrl = NULL;
+			continue;
+		}
+
+		if ((f->fd = exec_prepare(c, &f->start, &f->end, &max)) < 0) {
+			vlog_err("scene '%s': can not set '%s'", conf->scene, e->ctrl);
+			ret = false;
+		} else if (f->start == f->end) {
+			vlog_info("'%s' is already set", e->ctrl);
+			file_close(f->fd);
+		} else {
+			int64_t d = exec_duration(c, f->start, f->end, max);
+
+			usec = d > usec ? d : usec;
+			done[num_fades].entry = e;
+			done[num_fades].max = max;
+			hooks[num_fades].rewrite = conf->backend->write;
+			hooks[num_fades].data = &pubs[num_fades];
+			if (pub_attach(&pubs[num_fades], c, max))
+				hooks[num_fades].step = pub_step;
+			/* the fade takes over the levels of the controller */
+			hooks[num_fades].levels = c->levels;
+			hooks[num_fades].num_levels = c->num_levels;
+			hooks[num_fades].ramp = c->ramp_usec > 0;
+			c->levels = NULL;
+			f->hooks = &hooks[num_fades++];
+		}
+
+		/* the name is owned by the entry */
+		c->ctrl = NULL;
+	}
+
+	if (num_fades > 0 && !file_write_all(fades, num_fades, usec))
+		ret = false;
+
+	/* the history is recorded once the fades are done */
+	for (size_t i = 0; ret && i < num_fades; i++) {
+		struct light_conf *c = confs[done[i].entry->target];
+
+		c->ctrl = done[i].entry->ctrl;
+		c->usec = usec;
+		hist_append(c, LIGHT_SCENE_APPLY, fades[i].start, fades[i].end,
+				done[i].max);
+		c->ctrl = NULL;
+	}
+
+	for (size_t i = 0; i < num_fades; i++) {
+		file_close(fades[i].fd);
+		free((void *) hooks[i].levels);
+		if (hooks[i].step)
+			pub_detach(&pubs[i]);
+	}
+
+	for (size_t i = 0; i < sizeof(confs) / sizeof(*confs); i++)
+		light_free(&confs[i]);
+
+	return ret;
+}
+
+/**
+ * scene_capture:
+ * @conf:	configuration object of the invocation
+ * @ctrl:	controller to capture
+ * @entries:	entries to append to
+ * @num:	number of entries
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool scene_capture(struct light_conf *conf, const char *ctrl,
+		struct scene_entry **entries, size_t *num)
+{
+	int64_t raw, max;
+	struct scene_entry *e;
+
+	if ((max = conf->backend->read(conf, ctrl, LIGHT_MAX_BRIGHTNESS)) <= 0 ||
+	    (raw = conf->backend->read(conf, ctrl, LIGHT_BRIGHTNESS)) < 0) {
+		vlog_warning("found inaccessible controller '%s'", ctrl);
+		return false;
+	}
+
+	if (!(e = realloc(*entries, (*num + 1) * sizeof(*e)))) {
+		vlog_err("realloc: %m");
+		return false;
+	}
+
+	*entries = e;
+	e = &e[(*num)++];
+	e->target = conf->target;
+	e->mode = conf->val_mode;
+	e->value = value_from_raw(conf->val_mode, raw, max);
+	snprintf(e->ctrl, sizeof(e->ctrl), "%s", ctrl);
+
+	return true;
+}
+
+/**
+ * scene_superseded:
+ * @line:	line of the previous scene file
+ * @entries:	captured entries
+ * @num:	number of captured entries
+ *
+ * Returns: true if the line is replaced by a captured entry
+ **/
+static bool scene_superseded(const char *line, const struct scene_entry *entries,
+		size_t num)
+{
+	struct scene_entry e;
+
+	if (scene_parse(line, &e) <= 0)
+		return false;
+
+	for (size_t i = 0; i < num; i++)
+		if (entries[i].target == e.target && strcmp(entries[i].ctrl, e.ctrl) == 0)
+			return true;
+
+	return false;
+}
+
+/**
+ * scene_save:
+ * @conf:	configuration object holding the scene name
+ *
+ * Captures the selected controllers of the target into the scene,
+ * keeping the entries of other controllers and targets.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool scene_save(struct light_conf *conf)
+{
+	char line[512];
+	bool ret = true;
+	size_t num = 0;
+	burn_o struct scene_entry *entries = NULL;
+	burn_o char *path = scene_path_new(conf, "");
+	burn_o char *tmp = scene_path_new(conf, ".tmp");
+	burn_file old = NULL;
+	burn_file file = NULL;
+
+	if (!path || !tmp)
+		return false;
+
+	if (conf->ctrl_mode == LIGHT_CTRL_ALL) {
+		burn_iter iter = ctrl_iter_new(conf);
+		char *c;
+
+		if (!iter)
+			return false;
+
+		while ((c = ctrl_iter_next(iter))) {
+			if (!scene_capture(conf, c, &entries, &num))
+				ret = false;
+			free(c);
+		}
+	} else if (!scene_capture(conf, conf->ctrl, &entries, &num)) {
+		return false;
+	}
+
+	if (!(file = fopen(tmp, "w"))) {
+		vlog_err("open '%s': %m", tmp);
+		return false;
+	}
+
+	if ((old = fopen(path, "r")))
+		while (fgets(line, sizeof(line), old))
+			if (!scene_superseded(line, entries, num))
+				fputs(line, file);
+
+	for (size_t i = 0; i < num; i++) {
+		const struct scene_entry *e = &entries[i];
+
+		fprintf(file, "%s %s ", scene_targets[e->target], e->ctrl);
+
+		if (e->mode == LIGHT_RAW)
+			fprintf(file, "%" PRId64, e->value);
+		else
+			fprintf(file, "%.2f", (double) e->value / 100.00);
+
+		fprintf(file, " %s\n", scene_modes[e->mode]);
+	}
+
+	if (fflush(file) != 0 || fsync(fileno(file)) != 0 || rename(tmp, path) != 0) {
+		vlog_err("save scene '%s': %m", conf->scene);
+		unlink(tmp);
+		/* cppcheck-suppress resourceLeak */
+		return false;
+	}
+
+	/* cppcheck-suppress resourceLeak */
+	return ret;
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdbool.h>
+
+#include "light.h"
+
+bool scene_apply(struct light_conf *conf);
+bool scene_save(struct light_conf *conf);
+
+#endif /* SCENE_H */
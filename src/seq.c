@@ -0,0 +1,314 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <string.h>
+
+#include "common.h"
+
+#include "burno.h"
+#include "vlog.h"
+#include "value.h"
+#include "light.h"
+#include "backend.h"
+#include "ctrl.h"
+#include "exec.h"
+#include "file.h"
+#include "level.h"
+#include "policy.h"
+#include "arb.h"
+#include "pub.h"
+#include "seq.h"
+
+/*
+ * A sequence plays keyframes on the selected controllers, such as a
+ * notification flash or an alert pulse:
+ *
+ *	<value>:<usecs>[:<easing>][,<value>:<usecs>[:<easing>]...][x<repeat>]
+ *
+ * Every keyframe moves from the previous value to its own over its
+ * duration, linearly or with one of the easings below. The keyframes
+ * are played repeat times, for ever if it is 0. Each controller is
+ * opened and locked once, and every write is scheduled from the start
+ * of the sequence by file_write_keys().
+ */
+
+#define SEQ_KEYS_MAX 64
+
+struct seq {
+	struct file_key keys[SEQ_KEYS_MAX];
+	/* values of the keyframes in the value mode */
+	int64_t vals[SEQ_KEYS_MAX];
+	size_t num_keys;
+	int64_t repeat;
+};
+
+struct seq_ctrl {
+	int64_t vals[SEQ_KEYS_MAX];
+	struct file_hooks hooks;
+	struct pub pub;
+};
+
+static const char *seq_eases[] = {
+	[FILE_EASE_LINEAR] = "linear",
+	[FILE_EASE_IN] = "in",
+	[FILE_EASE_OUT] = "out",
+	[FILE_EASE_IN_OUT] = "in-out",
+	[FILE_EASE_STEP] = "step",
+};
+
+/**
+ * seq_parse_key:
+ * @s:		sequence to add the keyframe to
+ * @mode:	value mode of the keyframe value
+ * @str:	keyframe to parse, modified
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool seq_parse_key(struct seq *s, LIGHT_VAL_MODE mode, char *str)
+{
+	char *val = str, *usec = strchr(str, ':'), *ease;
+	struct file_key *key = &s->keys[s->num_keys];
+	char end;
+
+	if (s->num_keys >= SEQ_KEYS_MAX) {
+		vlog_err("sequence has more than %d keyframes", SEQ_KEYS_MAX);
+		return false;
+	}
+
+	if (!usec) {
+		vlog_err("keyframe '%s' has no duration", str);
+		return false;
+	}
+
+	*usec++ = '\0';
+
+	if ((ease = strchr(usec, ':')))
+		*ease++ = '\0';
+
+	if ((s->vals[s->num_keys] = value_from_string(mode, val)) < 0) {
+		vlog_err("keyframe value '%s' not recognizable", val);
+		return false;
+	}
+
+	if (sscanf(usec, "%" SCNd64 "%c", &key->usec, &end) != 1 || key->usec < 0) {
+		vlog_err("keyframe duration '%s' not recognizable", usec);
+		return false;
+	}
+
+	key->ease = FILE_EASE_LINEAR;
+
+	if (ease) {
+		size_t i = 0;
+
+		while (i < sizeof(seq_eases) / sizeof(*seq_eases) &&
+		       strcmp(seq_eases[i], ease) != 0)
+			i++;
+
+		if (i == sizeof(seq_eases) / sizeof(*seq_eases)) {
+			vlog_err("easing must be linear, in, out, in-out or step");
+			return false;
+		}
+
+		key->ease = (FILE_EASE) i;
+	}
+
+	s->num_keys++;
+	return true;
+}
+
+/**
+ * seq_parse:
+ * @s:		sequence to fill in
+ * @mode:	value mode of the keyframe values
+ * @spec:	keyframes, optionally followed by the repeat count
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool seq_parse(struct seq *s, LIGHT_VAL_MODE mode, const char *spec)
+{
+	burn_o char *buf = strdup(spec);
+	char *repeat, *save = NULL, *key;
+	int64_t usec = 0;
+	char end;
+
+	if (!buf) {
+		vlog_err("strdup: %m");
+		return false;
+	}
+
+	s->num_keys = 0;
+	s->repeat = 1;
+
+	if ((repeat = strrchr(buf, 'x'))) {
+		*repeat++ = '\0';
+		if (sscanf(repeat, "%" SCNd64 "%c", &s->repeat, &end) != 1 || s->repeat < 0) {
+			vlog_err("repeat count '%s' not recognizable", repeat);
+			return false;
+		}
+	}
+
+	for (key = strtok_r(buf, ",", &save); key; key = strtok_r(NULL, ",", &save))
+		if (!seq_parse_key(s, mode, key))
+			return false;
+
+	for (size_t k = 0; k < s->num_keys; k++)
+		usec += s->keys[k].usec;
+
+	if (s->num_keys == 0) {
+		vlog_err("sequence has no keyframes");
+		return false;
+	}
+
+	/* an endless sequence has to take some time */
+	if (s->repeat == 0 && usec == 0) {
+		vlog_err("endless sequence takes no time");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * seq_add:
+ * @conf:	configuration object holding the controller
+ * @s:		sequence to play
+ * @sc:		where to store the state of the controller
+ * @t:		track to set up
+ *
+ * Opens and locks the controller, and works out the raw value of every
+ * keyframe, between the minimum cap and the cap of a running policy.
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool seq_add(struct light_conf *conf, const struct seq *s,
+		struct seq_ctrl *sc, struct file_track *t)
+{
+	int64_t max, mincap, cap;
+
+	if ((t->fd = conf->backend->open(conf, conf->ctrl)) < 0)
+		return false;
+
+	if ((t->start = conf->backend->read_fd(t->fd)) < 0 ||
+	    (max = exec_get_max(conf)) <= 0) {
+		vlog_err("can not read '%s'", conf->ctrl);
+		return false;
+	}
+
+	mincap = exec_get_min(conf);
+
+	if ((cap = policy_cap(conf, max)) < mincap)
+		cap = mincap;
+
+	for (size_t k = 0; k < s->num_keys; k++)
+		sc->vals[k] = value_clamp(value_to_raw(conf->val_mode, s->vals[k], max),
+				mincap, cap);
+
+	level_load_ramp(conf);
+
+	sc->hooks.rewrite = conf->backend->write;
+	sc->hooks.data = &sc->pub;
+	if (pub_attach(&sc->pub, conf, max))
+		sc->hooks.step = pub_step;
+	/* the sequence takes over the levels of the controller */
+	if (level_load(conf, max)) {
+		sc->hooks.levels = conf->levels;
+		sc->hooks.num_levels = conf->num_levels;
+		conf->levels = NULL;
+	}
+	sc->hooks.ramp = conf->ramp_usec > 0;
+
+	t->vals = sc->vals;
+	t->hooks = &sc->hooks;
+
+	vlog_notice("playing %zu keyframes on '%s'", s->num_keys, conf->ctrl);
+	return true;
+}
+
+/**
+ * seq_play:
+ * @conf:	configuration object holding the keyframes
+ *
+ * Plays the keyframes on the selected controllers in lockstep.
+ *
+ * Returns: true on success, false on failure
+ **/
+bool seq_play(struct light_conf *conf)
+{
+	bool ret = true;
+	size_t num = 0, num_tracks = 0;
+	char *ctrl = conf->ctrl, **more;
+	burn_o char **names = calloc(1, sizeof(*names));
+	burn_o struct seq *s = calloc(1, sizeof(*s));
+	burn_o struct seq_ctrl *scs = NULL;
+	burn_o struct file_track *tracks = NULL;
+
+	if (!s || !names) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	if (!seq_parse(s, conf->val_mode, conf->sequence))
+		return false;
+
+	if (conf->ctrl_mode == LIGHT_CTRL_ALL) {
+		burn_iter iter = ctrl_iter_new(conf);
+		char *c;
+
+		while (iter && (c = ctrl_iter_next(iter))) {
+			if (!(more = realloc(names, (num + 1) * sizeof(*names)))) {
+				vlog_err("realloc: %m");
+				free(c);
+				ret = false;
+				break;
+			}
+			names = more;
+			names[num++] = c;
+		}
+	} else {
+		names[num++] = ctrl;
+	}
+
+	/* every selected controller gets a track, however many there are */
+	scs = calloc(num + 1, sizeof(*scs));
+	tracks = calloc(num + 1, sizeof(*tracks));
+
+	if (!scs || !tracks) {
+		vlog_err("calloc: %m");
+		ret = false;
+	}
+
+	for (size_t i = 0; scs && tracks && i < num; i++) {
+		struct file_track *t = &tracks[num_tracks];
+
+		conf->ctrl = names[i];
+
+		/* a dropped request leaves the controller alone */
+		if (!arb_allow(conf))
+			continue;
+
+		if (seq_add(conf, s, &scs[num_tracks], t)) {
+			num_tracks++;
+		} else {
+			file_close(t->fd);
+			ret = false;
+		}
+	}
+
+	conf->ctrl = ctrl;
+
+	if (num_tracks > 0 && !file_write_keys(tracks, num_tracks, s->keys,
+				s->num_keys, s->repeat))
+		ret = false;
+
+	for (size_t i = 0; i < num_tracks; i++) {
+		file_close(tracks[i].fd);
+		free((void *) scs[i].hooks.levels);
+		if (scs[i].hooks.step)
+			pub_detach(&scs[i].pub);
+	}
+
+	/* the names of every controller were allocated by the iterator */
+	for (size_t i = 0; conf->ctrl_mode == LIGHT_CTRL_ALL && i < num; i++)
+		free(names[i]);
+
+	return ret;
+}
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#ifndef SEQ_H
+#define SEQ_H
+
+#include <stdbool.h>
+
+#include "light.h"
+
+bool seq_play(struct light_conf *conf);
+
+#endif /* SEQ_H */
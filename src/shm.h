@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: 0BSD */
+
+/*
+ * Layout of the shared memory page published by `brillo -P`, along with
+ * a lock free reader. This header has no dependencies on the rest of
+ * brillo and may be copied into other programs:
+ *
+ *	int fd = open("/dev/shm/brillo.backlight", O_RDONLY);
+ *	const struct shm_page *page = mmap(NULL, sizeof(*page), PROT_READ,
+ *					   MAP_SHARED, fd, 0);
+ *	const struct shm_ctrl *ctrl = shm_find(page, "intel_backlight");
+ *	struct shm_value val;
+ *
+ *	shm_read(ctrl, &val);
+ *
+ * Once mapped, reading a value is a handful of memory loads.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_MAGIC 0x6f6c6972 /* "rilo" */
+#define SHM_VERSION 1
+#define SHM_CTRLS 256
+#define SHM_NAME_MAX 64
+
+struct shm_ctrl {
+	uint32_t seq;		/* odd while the values are being written */
+	uint32_t reserved;
+	char name[SHM_NAME_MAX];
+	int64_t raw;
+	int64_t max;
+	int64_t pct;		/* linear percentage, in hundredths */
+	uint64_t changes;	/* bumped on every published value */
+};
+
+struct shm_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_ctrls;	/* entries are appended, never removed */
+	uint32_t reserved;
+	struct shm_ctrl ctrls[SHM_CTRLS];
+};
+
+struct shm_value {
+	int64_t raw;
+	int64_t max;
+	int64_t pct;
+	uint64_t changes;
+};
+
+/**
+ * shm_find:
+ * @page:	mapped page
+ * @name:	name of the controller
+ *
+ * Returns: the controller entry, or NULL if it was never published
+ **/
+static inline const struct shm_ctrl *shm_find(const struct shm_page *page,
+		const char *name)
+{
+	uint32_t n;
+
+	if (page->magic != SHM_MAGIC || page->version != SHM_VERSION)
+		return NULL;
+
+	n = __atomic_load_n(&page->num_ctrls, __ATOMIC_ACQUIRE);
+
+	for (uint32_t i = 0; i < n && i < SHM_CTRLS; i++)
+		if (strncmp(page->ctrls[i].name, name, SHM_NAME_MAX) == 0)
+			return &page->ctrls[i];
+
+	return NULL;
+}
+
+/**
+ * shm_read:
+ * @ctrl:	controller entry
+ * @val:	where to store a consistent copy of the values
+ *
+ * Retries until the values were not written to while being copied.
+ **/
+static inline void shm_read(const struct shm_ctrl *ctrl, struct shm_value *val)
+{
+	uint32_t s0, s1;
+
+	do {
+		s0 = __atomic_load_n(&ctrl->seq, __ATOMIC_ACQUIRE);
+		val->raw = __atomic_load_n(&ctrl->raw, __ATOMIC_RELAXED);
+		val->max = __atomic_load_n(&ctrl->max, __ATOMIC_RELAXED);
+		val->pct = __atomic_load_n(&ctrl->pct, __ATOMIC_RELAXED);
+		val->changes = __atomic_load_n(&ctrl->changes, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s1 = __atomic_load_n(&ctrl->seq, __ATOMIC_RELAXED);
+	} while ((s0 & 1) || s0 != s1);
+}
+
+#endif /* SHM_H */
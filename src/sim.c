@@ -0,0 +1,536 @@
+/* SPDX-License-Identifier: GPL-3.0-only */
+
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "vlog.h"
+#include "light.h"
+#include "backend.h"
+#include "clk.h"
+#include "metrics.h"
+
+#define SIM_CTRLS_MAX 4096
+#define SIM_MAXES_MAX 16
+
+/*
+ * In-memory controllers, configured by a spec such as
+ *
+ *	sim:n=4,max=255/1000,lat=2000,jitter=500,spike=5/40000,quant=10,smooth=100000
+ *
+ * n:		number of controllers, named sim0, sim1, ...
+ * max:		raw maximum, a '/' separated list is cycled through
+ * val:		initial raw value (default: half of the maximum)
+ * lat:		microseconds every write takes
+ * jitter:	uniform spread of the write latency, in microseconds
+ * spike:	percentage of writes taking the given extra microseconds
+ * quant:	raw step the hardware rounds written values down to
+ * smooth:	microseconds the firmware takes to ramp to a written value
+ * seed:	seed of the latency generator
+ * clock:	"virtual" to run on a clock that only moves when waited on
+ * trace:	1 to print every write, with the microseconds since start
+ * cache:	cache directory
+ * root:	directory standing in for /sys/class, for the policy operation
+ *
+ * Reads of the brightness report the ramped (actual) value.
+ * Every controller is a multicolor LED as well.
+ */
+
+struct sim_ctrl {
+	int fd;
+	int color_fd;
+	uint16_t rgb[3];
+	int64_t max;
+	int64_t from;
+	int64_t target;
+	struct timespec t;
+};
+
+static struct sim {
+	size_t num;
+	int64_t maxes[SIM_MAXES_MAX];
+	size_t num_maxes;
+	int64_t val;
+	int64_t lat;
+	int64_t jitter;
+	int64_t spike_pct;
+	int64_t spike;
+	int64_t quant;
+	int64_t smooth;
+	uint64_t seed;
+	bool trace;
+	struct timespec start;
+	struct sim_ctrl *ctrls;
+} sim;
+
+/**
+ * sim_rand:
+ *
+ * Returns: next value of the xorshift generator
+ **/
+static uint64_t sim_rand(void)
+{
+	sim.seed ^= sim.seed << 13;
+	sim.seed ^= sim.seed >> 7;
+	sim.seed ^= sim.seed << 17;
+	return sim.seed;
+}
+
+/**
+ * sim_usec:
+ * @t0:		earlier time
+ * @t1:		later time
+ *
+ * Returns: microseconds between the two times
+ **/
+static int64_t sim_usec(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000 +
+		(t1->tv_nsec - t0->tv_nsec) / 1000;
+}
+
+/**
+ * sim_parse_maxes:
+ * @str:	'/' separated list of maximums
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool sim_parse_maxes(const char *str)
+{
+	int n;
+
+	for (sim.num_maxes = 0; sim.num_maxes < SIM_MAXES_MAX; sim.num_maxes++) {
+		int64_t *max = &sim.maxes[sim.num_maxes];
+
+		if (sscanf(str, "%" SCNd64 "%n", max, &n) != 1 || *max <= 0)
+			return false;
+
+		str += n;
+
+		if (*str != '/')
+			break;
+
+		str++;
+	}
+
+	sim.num_maxes++;
+	return *str == '\0' || *str == ',';
+}
+
+/**
+ * sim_parse_clock:
+ * @str:	name of the clock
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool sim_parse_clock(const char *str)
+{
+	size_t len = strcspn(str, ",");
+
+	if (strncmp(str, clk_virtual.name, len) == 0 && !clk_virtual.name[len])
+		clk_use(&clk_virtual);
+	else if (strncmp(str, clk_real.name, len) == 0 && !clk_real.name[len])
+		clk_use(&clk_real);
+	else
+		return false;
+
+	return true;
+}
+
+/**
+ * sim_parse_dir:
+ * @dst:	where to store the directory
+ * @str:	directory
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool sim_parse_dir(char **dst, const char *str)
+{
+	free(*dst);
+
+	if (!(*dst = strndup(str, strcspn(str, ",")))) {
+		vlog_err("strndup: %m");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * sim_trace:
+ * @c:		controller written to
+ * @vals:	values written
+ * @num:	number of values
+ *
+ * Prints a write, if tracing is enabled.
+ **/
+static void sim_trace(const struct sim_ctrl *c, const int64_t *vals, size_t num)
+{
+	struct timespec now;
+
+	if (!sim.trace)
+		return;
+
+	clk_now(&now);
+	printf("%" PRId64 " sim%td", sim_usec(&sim.start, &now), c - sim.ctrls);
+
+	for (size_t i = 0; i < num; i++)
+		printf(" %" PRId64, vals[i]);
+
+	/* a daemon is watched while it runs */
+	putchar('\n');
+	fflush(stdout);
+}
+
+/**
+ * sim_init:
+ * @conf:	configuration object
+ * @opts:	comma separated key=value options
+ *
+ * Returns: true on success, false on failure
+ **/
+static bool sim_init(struct light_conf *conf, const char *opts)
+{
+	int trace = 0;
+
+	sim.num = 1;
+	sim.maxes[0] = 1000;
+	sim.num_maxes = 1;
+	sim.val = -1;
+	sim.seed = 1;
+
+	while (*opts) {
+		char key[8];
+		int n;
+		bool ok = true;
+
+		if (sscanf(opts, "%7[a-z]=%n", key, &n) != 1) {
+			vlog_err("sim: malformed option '%s'", opts);
+			return false;
+		}
+
+		opts += n;
+
+		if (strcmp(key, "max") == 0)
+			ok = sim_parse_maxes(opts);
+		else if (strcmp(key, "n") == 0)
+			ok = sscanf(opts, "%zu", &sim.num) == 1;
+		else if (strcmp(key, "val") == 0)
+			ok = sscanf(opts, "%" SCNd64, &sim.val) == 1;
+		else if (strcmp(key, "lat") == 0)
+			ok = sscanf(opts, "%" SCNd64, &sim.lat) == 1;
+		else if (strcmp(key, "jitter") == 0)
+			ok = sscanf(opts, "%" SCNd64, &sim.jitter) == 1;
+		else if (strcmp(key, "spike") == 0)
+			ok = sscanf(opts, "%" SCNd64 "/%" SCNd64,
+					&sim.spike_pct, &sim.spike) == 2;
+		else if (strcmp(key, "quant") == 0)
+			ok = sscanf(opts, "%" SCNd64, &sim.quant) == 1;
+		else if (strcmp(key, "smooth") == 0)
+			ok = sscanf(opts, "%" SCNd64, &sim.smooth) == 1;
+		else if (strcmp(key, "seed") == 0)
+			ok = sscanf(opts, "%" SCNu64, &sim.seed) == 1 && sim.seed;
+		else if (strcmp(key, "clock") == 0)
+			ok = sim_parse_clock(opts);
+		else if (strcmp(key, "trace") == 0)
+			ok = sscanf(opts, "%d", &trace) == 1;
+		else if (strcmp(key, "cache") == 0)
+			ok = sim_parse_dir(&conf->cache_root, opts);
+		else if (strcmp(key, "root") == 0)
+			ok = sim_parse_dir(&conf->sys_root, opts);
+		else {
+			vlog_err("sim: unknown option '%s'", key);
+			return false;
+		}
+
+		if (!ok) {
+			vlog_err("sim: bad value for '%s'", key);
+			return false;
+		}
+
+		opts += strcspn(opts, ",");
+		if (*opts == ',')
+			opts++;
+	}
+
+	sim.trace = trace != 0;
+	clk_now(&sim.start);
+
+	if (sim.num == 0 || sim.num > SIM_CTRLS_MAX) {
+		vlog_err("sim: controller count must be in range 1-%d", SIM_CTRLS_MAX);
+		return false;
+	}
+
+	if (!(sim.ctrls = calloc(sim.num, sizeof(*sim.ctrls)))) {
+		vlog_err("calloc: %m");
+		return false;
+	}
+
+	for (size_t i = 0; i < sim.num; i++) {
+		struct sim_ctrl *c = &sim.ctrls[i];
+
+		c->fd = -1;
+		c->color_fd = -1;
+		c->max = sim.maxes[i % sim.num_maxes];
+		c->target = sim.val < 0 ? c->max / 2 : (sim.val > c->max ? c->max : sim.val);
+		c->from = c->target;
+	}
+
+	return true;
+}
+
+/**
+ * sim_ctrl:
+ * @name:	name of the controller
+ *
+ * Returns: the controller, or NULL if there is none by that name
+ **/
+static struct sim_ctrl *sim_ctrl(const char *name)
+{
+	size_t i;
+	int n = -1;
+
+	if (!name || sscanf(name, "sim%zu%n", &i, &n) != 1 ||
+	    name[n] != '\0' || i >= sim.num)
+		return NULL;
+
+	return &sim.ctrls[i];
+}
+
+/**
+ * sim_actual:
+ * @c:		controller
+ * @now:	current time
+ *
+ * Returns: value of the controller, partway through the firmware ramp
+ **/
+static int64_t sim_actual(const struct sim_ctrl *c, const struct timespec *now)
+{
+	int64_t elapsed;
+
+	if (sim.smooth <= 0 || c->from == c->target)
+		return c->target;
+
+	if ((elapsed = sim_usec(&c->t, now)) >= sim.smooth)
+		return c->target;
+
+	return c->from + (c->target - c->from) * elapsed / sim.smooth;
+}
+
+static void *sim_iter_new(struct light_conf *conf)
+{
+	size_t *i = calloc(1, sizeof(*i));
+
+	(void) conf;
+
+	if (!i)
+		vlog_err("calloc: %m");
+
+	return i;
+}
+
+static char *sim_iter_next(void *iter)
+{
+	char name[32];
+	size_t *i = iter;
+
+	if (*i >= sim.num)
+		return NULL;
+
+	snprintf(name, sizeof(name), "sim%zu", (*i)++);
+	return strdup(name);
+}
+
+static void sim_iter_free(void *iter)
+{
+	free(iter);
+}
+
+static int64_t sim_read(struct light_conf *conf, const char *ctrl, LIGHT_FIELD field)
+{
+	struct timespec now;
+	struct sim_ctrl *c = sim_ctrl(ctrl);
+
+	(void) conf;
+
+	if (!c)
+		return -ENOENT;
+
+	if (field == LIGHT_MAX_BRIGHTNESS)
+		return c->max;
+
+	clk_now(&now);
+	return sim_actual(c, &now);
+}
+
+static int64_t sim_read_fd(int fd)
+{
+	struct timespec now;
+
+	for (size_t i = 0; i < sim.num; i++) {
+		if (sim.ctrls[i].fd == fd) {
+			clk_now(&now);
+			return sim_actual(&sim.ctrls[i], &now);
+		}
+	}
+
+	return -EBADF;
+}
+
+static int64_t sim_read_actual(struct light_conf *conf, const char *ctrl)
+{
+	return sim_read(conf, ctrl, LIGHT_BRIGHTNESS);
+}
+
+/**
+ * sim_forget:
+ * @owner:	controller the fd was handed out for
+ * @fd:		new fd
+ *
+ * Drops the fd from every other controller, which must
+ * have closed it, as it has been handed out again.
+ **/
+static void sim_forget(const struct sim_ctrl *owner, int fd)
+{
+	for (size_t i = 0; i < sim.num && fd >= 0; i++) {
+		struct sim_ctrl *c = &sim.ctrls[i];
+
+		if (c == owner)
+			continue;
+		if (c->fd == fd)
+			c->fd = -1;
+		if (c->color_fd == fd)
+			c->color_fd = -1;
+	}
+}
+
+static int sim_open(struct light_conf *conf, const char *ctrl)
+{
+	struct sim_ctrl *c = sim_ctrl(ctrl);
+
+	(void) conf;
+
+	if (!c) {
+		vlog_err("sim: no controller '%s'", ctrl ? ctrl : "");
+		return -1;
+	}
+
+	/* hand out a real fd, so it can be closed like any other */
+	if ((c->fd = open("/dev/null", O_WRONLY)) < 0)
+		vlog_err("open '/dev/null': %m");
+
+	sim_forget(c, c->fd);
+	return c->fd;
+}
+
+/**
+ * sim_latency:
+ *
+ * Sleeps for as long as a write takes.
+ **/
+static void sim_latency(void)
+{
+	int64_t lat = sim.lat;
+
+	if (sim.jitter > 0)
+		lat += (int64_t) (sim_rand() % (uint64_t) (2 * sim.jitter + 1)) - sim.jitter;
+	if (sim.spike_pct > 0 && (int64_t) (sim_rand() % 100) < sim.spike_pct)
+		lat += sim.spike;
+	if (lat <= 0)
+		return;
+
+	clk_sleep(lat * 1000);
+}
+
+static bool sim_write(int fd, int64_t val)
+{
+	struct timespec now;
+	struct sim_ctrl *c = NULL;
+
+	for (size_t i = 0; i < sim.num && !c; i++)
+		if (sim.ctrls[i].fd == fd)
+			c = &sim.ctrls[i];
+
+	if (!c || val < 0 || val > c->max) {
+		vlog_err("sim: invalid write");
+		METRICS_COUNT(METRICS_WRITE_ERRORS);
+		return false;
+	}
+
+	sim_trace(c, &val, 1);
+
+	if (sim.quant > 1)
+		val -= val % sim.quant;
+
+	/* the firmware ramps from wherever it currently is */
+	clk_now(&now);
+	c->from = sim_actual(c, &now);
+	c->t = now;
+	c->target = val;
+
+	sim_latency();
+	METRICS_COUNT(METRICS_WRITES);
+	return true;
+}
+
+static int sim_open_color(struct light_conf *conf, const char *ctrl)
+{
+	struct sim_ctrl *c = sim_ctrl(ctrl);
+
+	(void) conf;
+
+	if (!c)
+		return -1;
+
+	if ((c->color_fd = open("/dev/null", O_WRONLY)) < 0)
+		vlog_err("open '/dev/null': %m");
+
+	sim_forget(c, c->color_fd);
+	return c->color_fd;
+}
+
+static bool sim_write_color(int fd, const uint16_t rgb[3])
+{
+	struct sim_ctrl *c = NULL;
+
+	for (size_t i = 0; i < sim.num && !c; i++)
+		if (sim.ctrls[i].color_fd == fd)
+			c = &sim.ctrls[i];
+
+	if (!c) {
+		vlog_err("sim: invalid write");
+		return false;
+	}
+
+	memcpy(c->rgb, rgb, sizeof(c->rgb));
+
+	sim_trace(c, (int64_t[]) { rgb[0], rgb[1], rgb[2] }, 3);
+	sim_latency();
+	return true;
+}
+
+static int sim_notify(struct light_conf *conf, const char *ctrl)
+{
+	(void) conf;
+	(void) ctrl;
+	return -1;
+}
+
+const struct backend backend_sim = {
+	.name = "sim",
+	.init = sim_init,
+	.iter_new = sim_iter_new,
+	.iter_next = sim_iter_next,
+	.iter_free = sim_iter_free,
+	.read = sim_read,
+	.open = sim_open,
+	.write = sim_write,
+	.read_fd = sim_read_fd,
+	.read_actual = sim_read_actual,
+	.notify = sim_notify,
+	.open_color = sim_open_color,
+	.write_color = sim_write_color,
+};
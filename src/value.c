@@ -2,9 +2,9 @@
 
 #include <stdio.h>
 #include <inttypes.h>
-#include <math.h>
 
 #include "value.h"
+#include "fixed.h"
 #include "vlog.h"
 
 /**
@@ -39,7 +39,11 @@ int64_t value_clamp(int64_t val, int64_t min, int64_t max)
  **/
 static int64_t value_log_pct(int64_t raw, int64_t max)
 {
-	return (int64_t) ((log((double) raw) / log((double) max)) * VALUE_PCT_MAX);
+	/* there is no logarithm of zero, nor a scale to a maximum of one */
+	if (raw < 1 || max <= 1)
+		return raw >= max && max > 0 ? VALUE_PCT_MAX : 0;
+
+	return (int64_t) (fixed_log2(raw) * VALUE_PCT_MAX / fixed_log2(max));
 }
 
 /**
@@ -74,7 +78,18 @@ int64_t value_from_raw(LIGHT_VAL_MODE mode, int64_t raw, int64_t max)
  **/
 static int64_t value_exp_raw(int64_t val, int64_t max)
 {
-	return (int64_t) (exp((double) val * log((double) max) / VALUE_PCT_MAX));
+	uint64_t e;
+
+	if (val < 0 || max < 1)
+		return 0;
+
+	e = val * fixed_log2(max) / VALUE_PCT_MAX;
+
+	/* far beyond the maximum, where the value is clamped anyway */
+	if (e >= (uint64_t) 62 << FIXED_SHIFT)
+		return INT64_MAX;
+
+	return (int64_t) fixed_exp2(e);
 }
 
 /**
@@ -133,3 +148,46 @@ int64_t value_from_string(LIGHT_VAL_MODE mode, const char* str)
 	else
 		return VALUE_CLAMP_PCT((int64_t) (value_pct * (VALUE_PCT_MAX / 100)));
 }
+
+/**
+ * value_level:
+ * @levels:	sorted raw values that take effect
+ * @num:	number of levels, at least one
+ * @raw:	raw value
+ *
+ * Returns: index of the level in effect for the raw value
+ **/
+size_t value_level(const int64_t *levels, size_t num, int64_t raw)
+{
+	size_t lo = 0, hi = num;
+
+	/* find the last level not above raw */
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (levels[mid] <= raw)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * value_snap:
+ * @levels:	sorted raw values that take effect
+ * @num:	number of levels, at least one
+ * @raw:	raw value
+ *
+ * Returns: the level closest to the raw value
+ **/
+int64_t value_snap(const int64_t *levels, size_t num, int64_t raw)
+{
+	size_t i = value_level(levels, num, raw);
+
+	if (i + 1 < num && levels[i + 1] - raw < raw - levels[i])
+		return levels[i + 1];
+
+	return levels[i];
+}
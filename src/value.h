@@ -3,6 +3,7 @@
 #ifndef VALUE_H
 #define VALUE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "light.h"
@@ -13,6 +14,8 @@ int64_t value_clamp(int64_t val, int64_t min, int64_t max);
 int64_t value_from_raw(LIGHT_VAL_MODE mode, int64_t raw, int64_t max);
 int64_t value_to_raw(LIGHT_VAL_MODE mode, int64_t val, int64_t max);
 int64_t value_from_string(LIGHT_VAL_MODE mode, const char *str);
+size_t value_level(const int64_t *levels, size_t num, int64_t raw);
+int64_t value_snap(const int64_t *levels, size_t num, int64_t raw);
 
 #define VALUE_CLAMP_PCT(val) value_clamp(val, 0, VALUE_PCT_MAX)
 
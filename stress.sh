@@ -0,0 +1,152 @@
+#!/bin/sh
+
+# Runs many overlapping invocations against a fake sysfs and cache tree,
+# reports throughput, completion latency and lock wait, and checks that
+# the final brightness results from some serial order of the requests.
+
+set -eu
+
+: ${BRILLO_BIN:=./brillo}
+: ${BRILLO_STRESS_RUNS:=32}
+: ${BRILLO_STRESS_USEC:=100000}
+: ${BRILLO_STRESS_SEED:=1}
+
+max=1000
+init=500
+mincap=10
+saved=333
+
+dir="$(mktemp -d)"
+trap '[ -n "${BRILLO_STRESS_KEEP:-}" ] || rm -rf "${dir}"' EXIT
+
+mkdir -p "${dir}/sys/backlight/stress0" "${dir}/cache"
+echo "${max}" > "${dir}/sys/backlight/stress0/max_brightness"
+echo "${init}" > "${dir}/sys/backlight/stress0/brightness"
+echo "${mincap}" > "${dir}/cache/backlight.stress0.mincap"
+echo "${saved}" > "${dir}/cache/backlight.stress0.brightness"
+
+opts="-B sysfs:root=${dir}/sys,cache=${dir}/cache -s stress0 -r -v 7"
+
+_worker() {
+	local i="$1" op="$2" arg="$3" usec="$4" t0 t1 rc=0 curr next wait
+
+	t0="$(date +%s%N)"
+	"$BRILLO_BIN" $opts -u "${usec}" "${op}" ${arg} 2> "${dir}/log.${i}" || rc=$?
+	t1="$(date +%s%N)"
+
+	curr="$(sed -n 's/^Notice: current value: //p' "${dir}/log.${i}")"
+	next="$(sed -n 's/^Notice: Writing (raw) value: //p' "${dir}/log.${i}")"
+	wait="$(sed -n "s/^Debug: waited \([0-9]*\) us for lock on '.*\/brightness'$/\1/p" "${dir}/log.${i}")"
+
+	echo "${i} ${op} ${arg:--} ${t0} ${t1} ${rc} ${curr:--1} ${next:--1} ${wait:-0}" > "${dir}/run.${i}"
+}
+
+_pct() {
+	sort -n | awk -v p="$1" '
+		{ v[NR] = $1 }
+		END {
+			i = int((NR * p + 99) / 100)
+			print NR ? v[i < 1 ? 1 : i] : 0
+		}'
+}
+
+awk -v runs="${BRILLO_STRESS_RUNS}" -v usec="${BRILLO_STRESS_USEC}" \
+    -v seed="${BRILLO_STRESS_SEED}" -v max="${max}" 'BEGIN {
+	srand(seed)
+	for (i = 0; i < runs; i++) {
+		r = rand()
+		if (r < 0.4)
+			op = "-A " (1 + int(rand() * 50))
+		else if (r < 0.8)
+			op = "-U " (1 + int(rand() * 50))
+		else if (r < 0.95)
+			op = "-S " int(rand() * (max + 1))
+		else
+			op = "-I"
+		print i, op, rand() < 0.5 ? 0 : int(rand() * usec)
+	}
+}' > "${dir}/plan"
+
+while read i op arg usec; do
+	[ "${op}" = "-I" ] && { usec="${arg}"; arg=; }
+	_worker "${i}" "${op}" "${arg}" "${usec}" &
+done < "${dir}/plan"
+
+wait
+
+cat "${dir}"/run.* > "${dir}/runs"
+final="$(cat "${dir}/sys/backlight/stress0/brightness")"
+
+printf 'runs: %s\n' "$(wc -l < "${dir}/runs")"
+
+awk '{ if ($4 < t0 || !t0) t0 = $4; if ($5 > t1) t1 = $5 }
+	END { printf "throughput: %.1f runs/s over %.3f s\n", NR / ((t1 - t0) / 1e9), (t1 - t0) / 1e9 }' \
+	"${dir}/runs"
+
+printf 'latency: p50 %s ms, p99 %s ms\n' \
+	"$(awk '{ print int(($5 - $4) / 1e6) }' "${dir}/runs" | _pct 50)" \
+	"$(awk '{ print int(($5 - $4) / 1e6) }' "${dir}/runs" | _pct 99)"
+
+printf 'lock wait: p50 %s ms, p99 %s ms\n' \
+	"$(awk '{ print int($9 / 1e3) }' "${dir}/runs" | _pct 50)" \
+	"$(awk '{ print int($9 / 1e3) }' "${dir}/runs" | _pct 99)"
+
+# Every run moves the brightness from the value it read to the value it
+# wrote. The runs are serializable if those moves chain up from the
+# initial to the final value, using each exactly once (an Euler path).
+awk -v init="${init}" -v final="${final}" -v max="${max}" \
+    -v mincap="${mincap}" -v saved="${saved}" '
+function clamp(v) { return v < mincap ? mincap : (v > max ? max : v) }
+function find(x) { while (x in up && up[x] != x) x = up[x]; return x }
+{
+	i = $1; op = $2; arg = $3; rc = $6; curr = $7; next_ = $8
+
+	if (rc != 0 || curr < 0 || next_ < 0) {
+		printf "run %s (%s %s) failed\n", i, op, arg
+		bad = 1
+		next
+	}
+
+	if (op == "-A")
+		want = clamp(curr + arg)
+	else if (op == "-U")
+		want = clamp(arg > curr ? 0 : curr - arg)
+	else if (op == "-S")
+		want = clamp(arg)
+	else
+		want = clamp(saved)
+
+	if (next_ != want) {
+		printf "run %s (%s %s) wrote %s after reading %s, expected %s\n",
+			i, op, arg, next_, curr, want
+		bad = 1
+	}
+
+	deg[curr]++
+	deg[next_]--
+	if (!(curr in up)) up[curr] = curr
+	if (!(next_ in up)) up[next_] = next_
+	up[find(curr)] = find(next_)
+}
+END {
+	deg[init]--
+	deg[final]++
+
+	for (v in deg) {
+		if (deg[v] != 0) {
+			printf "value %s is read %s more times than written\n", v, deg[v]
+			bad = 1
+		}
+	}
+
+	if (!(init in up)) up[init] = init
+	for (v in up) {
+		if (find(v) != find(init)) {
+			printf "value %s is not reachable from %s\n", v, init
+			bad = 1
+		}
+	}
+
+	printf "serial order: %s (%s -> %s)\n", bad ? "none" : "found", init, final
+	exit bad
+}' "${dir}/runs"
@@ -22,9 +22,26 @@ _ckvg() {
 ret=0
 ckstr='ERROR SUMMARY: 0 errors from 0 context'
 
+# the simulated controllers are kept out of the cache of the user
+frames="$(mktemp)"
+metrics="$(mktemp -d)"
+cache="$(mktemp -d)"
+trap 'rm -rf "${frames}" "${metrics}" "${cache}"' EXIT
+
 _ckvg "opmode=help" -h
 _ckvg "opmode=version" -V
 
+_ckvg "backend=sim opmode=list" -B "sim:n=4,cache=${cache}" -L
+_ckvg "backend=sim opmode=get ctrl=all" -B "sim:n=4,max=255/1000,cache=${cache}" -e
+_ckvg "backend=sim opmode=set" -B "sim:lat=500,quant=10,smooth=50000,cache=${cache}" -u 100000 -S 20
+_ckvg "backend=sim opmode=listen" -B "sim:cache=${cache}" -u 100000 -E /dev/null
+_ckvg "backend=sim opmode=set rate" -B "sim:n=2,max=255/1000,cache=${cache}" -e -q -y 400,1000,50000 -A 10
+_ckvg "backend=sim opmode=set source" -B "sim:cache=${cache}" -o ambient,10 -z 1000000 -S 20
+
+printf 'sim0,255,0,0,1\nsim1,0,255,0\n\nsim0,0,0,255\n' > "${frames}"
+_ckvg "backend=sim opmode=frames" -B "sim:n=2,cache=${cache}" -k -g 50 -f "${frames}"
+_ckvg "backend=sim opmode=set metrics" -B "sim:cache=${cache}" -T "${metrics}" -u 100000 -S 20
+
 test ! -d /sys/class/backlight || {
 	_ckvg "opmode=get"
 	_ckvg "opmode=list" -L